@@ -0,0 +1,68 @@
+#include "FanController.h"
+
+static float clampPwm(float pwm)
+{
+  return pwm < 0.0f ? 0.0f : pwm > FAN_PWM_MAX ? FAN_PWM_MAX : pwm;
+}
+
+FanController::FanController(void) :
+  mode(FAN_MODE_MANUAL),
+  slew(50.0f),
+  output(0.0f),
+  mIntegral(0.0f),
+  mLastTemperature(0.0f),
+  mPrimed(false)
+{
+  curve[0] = 30.0f; curve[1] = 60.0f;  // at 30 C and below, a gentle 60
+  curve[2] = 60.0f; curve[3] = 255.0f; // at 60 C and above, flat out
+  pid[0] = 45.0f;                      // setpoint
+  pid[1] = 8.0f; pid[2] = 0.2f; pid[3] = 0.0f;
+}
+
+void FanController::reset(float pwm)
+{
+  output = clampPwm(pwm);
+  mIntegral = 0.0f;
+  mPrimed = false;
+}
+
+float FanController::step(float temperature, float dtSeconds)
+{
+  if (dtSeconds <= 0.0f) return output;
+  float target;
+  if (mode == FAN_MODE_CURVE)
+  {
+    if (temperature <= curve[0] || curve[2] <= curve[0]) target = curve[1];
+    else if (temperature >= curve[2]) target = curve[3];
+    else target = curve[1] + (curve[3] - curve[1]) * (temperature - curve[0]) / (curve[2] - curve[0]);
+  }
+  else if (mode == FAN_MODE_PID)
+  {
+    float error = temperature - pid[0];
+    if (!mPrimed)
+    {
+      // first step since reset(): preload the integral so that the loop takes over from the current output without a jump
+      mIntegral = pid[2] ? (output - pid[1] * error) / pid[2] : 0.0f;
+      mLastTemperature = temperature;
+      mPrimed = true;
+    }
+    // derivative on the measurement, not the error, so that changing the setpoint does not kick the fans
+    float derivative = (temperature - mLastTemperature) / dtSeconds;
+    mLastTemperature = temperature;
+    float integral = mIntegral + error * dtSeconds;
+    target = pid[1] * error + pid[2] * integral + pid[3] * derivative;
+    // anti-windup: only keep integrating while the output is not pinned at the limit it is pushing against
+    if (!(target > FAN_PWM_MAX && error > 0.0f) && !(target < 0.0f && error < 0.0f)) mIntegral = integral;
+  }
+  else return output; // manual (or unknown) mode: nothing to do
+
+  target = clampPwm(target);
+  if (slew > 0.0f)
+  {
+    float limit = slew * dtSeconds;
+    if (target > output + limit) target = output + limit;
+    else if (target < output - limit) target = output - limit;
+  }
+  output = target;
+  return output;
+}
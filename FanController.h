@@ -0,0 +1,42 @@
+// On-device fan control law for the controller sketch.
+//
+// step() turns a temperature into a fan PWM, either from a two-point fan
+// curve or from a PID loop, and limits how fast the PWM may change. It
+// is plain C++ with no Arduino dependencies (the sketch supplies the
+// temperature and applies the result), so the same code can be driven
+// by a simulated thermal plant on a desktop build.
+
+#ifndef __FanController_H__
+#define __FanController_H__
+
+#define FAN_MODE_MANUAL 0 // the host sets the fan PWMs itself
+#define FAN_MODE_CURVE  1 // PWM follows the temperature along `curve`
+#define FAN_MODE_PID    2 // PWM holds the temperature at `pid[0]`
+
+#define FAN_PWM_MAX 255.0f
+
+class FanController
+{
+  public:
+    FanController(void);
+
+    // One control step: `temperature` in degrees C, `dtSeconds` since the previous step. Returns the new PWM (0..255).
+    float step(float temperature, float dtSeconds);
+    // Bumpless transfer: the next step() starts from `pwm`, with no integral or derivative history (e.g. while in manual mode).
+    void  reset(float pwm);
+    // True in the modes in which step() drives the fans (anything but FAN_MODE_CURVE or FAN_MODE_PID counts as manual).
+    bool  active(void) const { return mode == FAN_MODE_CURVE || mode == FAN_MODE_PID; }
+
+    unsigned char mode;     // one of the FAN_MODE_ values
+    float curve[4];         // t_low, pwm_low, t_high, pwm_high: pwm_low below t_low, pwm_high above t_high, linear in between
+    float pid[4];           // setpoint (degrees C), kp, ki, kd, acting on (temperature - setpoint) so that hotter means faster
+    float slew;             // largest PWM change per second (0 = no limit)
+    float output;           // the last PWM returned by step(), or given to reset()
+
+  private:
+    float mIntegral;
+    float mLastTemperature;
+    bool  mPrimed;          // false until step() has seen a temperature to take a derivative against
+};
+
+#endif // __FanController_H__
@@ -3,64 +3,262 @@
 
 #include <MotorDriver.h>
 #include "Keyhole.h"
+#include "Scheduler.h"
+#include "MotorOutput.h"
+#include "Tachometer.h"
+#include "FanController.h"
+#include "LedPattern.h"
+#include "Settings.h"
 
 #define CMD_PING "ping!"
 #define CMD_LED  "led"
 #define CMD_FAN1 "fan1"
 #define CMD_FAN2 "fan2"
 #define CMD_FAN3 "fan3"
+#define CMD_FANS "fans"  // all three fans at once, e.g. fans=[100,120,90]
+#define CMD_LOOP_US  "loop_us"   // read-only: longest loop pass during the last second
+#define CMD_LATE_US  "late_us"   // read-only: worst task lateness during the last second
+#define CMD_CMD_RATE "cmd_rate"  // read-only: commands handled during the last second
+#define CMD_TX_HWM   "tx_hwm"    // read-only: most bytes ever waiting in Keyhole's output queue
+#define CMD_REPORT_SEC      "report_sec"       // automatic report period (0 = off)
+#define CMD_REPORT_KEYFRAME "report_keyframe"  // every Nth automatic report is a full one, the rest only list changes
+#define CMD_MOTOR_WRITES "motor_writes"  // read-only: motor driver updates actually made
+#define CMD_MOTOR_SKIPS  "motor_skips"   // read-only: assignments that did not change a motor, so were never sent to the driver
+#define CMD_RPM1 "rpm1"  // read-only: measured fan speeds (0 = stalled or no tach signal)
+#define CMD_RPM2 "rpm2"
+#define CMD_RPM3 "rpm3"
+#define CMD_TEMP_C    "temp_c"     // read-only: temperature input of the fan controller
+#define CMD_FAN_MODE  "fan_mode"   // 0 = manual (the host sets fanN), 1 = fan curve, 2 = PID
+#define CMD_FAN_CURVE "fan_curve"  // [t_low, pwm_low, t_high, pwm_high]
+#define CMD_FAN_PID   "fan_pid"    // [setpoint, kp, ki, kd]
+#define CMD_FAN_SLEW  "fan_slew"   // largest fan PWM change per second in modes 1 and 2 (0 = no limit)
+#define CMD_RAMP_RATE "ramp_rate"  // [fan1, fan2, fan3, led]: how fast each output moves toward its target, in PWM steps per second (0 = jump)
+#define CMD_LED_PATTERN "led_pattern"  // 0 = none (the host sets led), 1..9 = identify with N pulses, 10 = breathe, 11 = locate
 
 #define M_FAN1 1
 #define M_FAN2 2
 #define M_FAN3 3
 #define M_LED  4
 
+// Tach inputs must be external-interrupt pins (2, 18 and 19 on the Mega)
+#define TACH_PIN_FAN1 2
+#define TACH_PIN_FAN2 18
+#define TACH_PIN_FAN3 19
+
+// Temperature input: an LM35 (10 mV per degree C) against the default 5 V reference
+#define TEMP_PIN      A0
+#define TEMP_C_PER_LSB (500.0 / 1024.0)
+
+#define MOTOR_PERIOD_MS     20
+#define CONTROL_PERIOD_MS   100
+#define LED_PERIOD_MS       20
+#define SETTINGS_PERIOD_MS  5    // Settings::poll() writes one EEPROM byte per call, and a byte takes 3.3 ms
+#define STATS_PERIOD_MS     1000
+
 MotorDriver m;
-int power = 0;
-int up_down = 1;
-int led_count = 0;
+MotorOutput motors(m);
+Tachometer tach;
+const uint8_t tach_pins[TACH_FANS] = { TACH_PIN_FAN1, TACH_PIN_FAN2, TACH_PIN_FAN3 };
+FanController fan_control;
+LedPattern led_pattern;
+Settings settings;
+float temp_c = 0.0;
 
 String ping = "pong!";
 short led_pwm = 0;
-short fan1_pwm = 0;
-short fan2_pwm = 0;
-short fan3_pwm = 0;
+short fan_pwm[3] = { 0, 0, 0 }; // fan1, fan2, fan3
+short manual_pwm[3] = { 0, 0, 0 }; // fan_pwm as last set in manual mode: what EEPROM keeps, since in modes 1 and 2 fan_pwm changes all the time
+
+unsigned long commands_this_second = 0;
+unsigned long loop_us = 0;
+unsigned long late_us = 0;
+unsigned long cmd_rate = 0;
 
 KEYHOLE keyhole(Serial);
 
+// Every variable the host can reach, as key, variable and write mode
+#define EXPOSED_LIST(X) \
+  X(CMD_PING,            ping,                     VARIABLE_READ_ONLY) \
+  X(CMD_FANS,            fan_pwm,                  VARIABLE_SILENT) \
+  X(CMD_FAN1,            fan_pwm[0],               VARIABLE_SILENT) \
+  X(CMD_FAN2,            fan_pwm[1],               VARIABLE_SILENT) \
+  X(CMD_FAN3,            fan_pwm[2],               VARIABLE_SILENT) \
+  X(CMD_LED,             led_pwm,                  VARIABLE_SILENT) \
+  X(CMD_LOOP_US,         loop_us,                  VARIABLE_READ_ONLY) \
+  X(CMD_LATE_US,         late_us,                  VARIABLE_READ_ONLY) \
+  X(CMD_CMD_RATE,        cmd_rate,                 VARIABLE_READ_ONLY) \
+  X(CMD_TX_HWM,          keyhole.output.highWater, VARIABLE_READ_ONLY) \
+  X(CMD_REPORT_SEC,      keyhole.autoSeconds,      VARIABLE_SILENT) \
+  X(CMD_REPORT_KEYFRAME, keyhole.deltaReports,     VARIABLE_SILENT) \
+  X(CMD_MOTOR_WRITES,    motors.writes,            VARIABLE_READ_ONLY) \
+  X(CMD_MOTOR_SKIPS,     motors.skipped,           VARIABLE_READ_ONLY) \
+  X(CMD_RPM1,            tach.rpm[0],              VARIABLE_READ_ONLY) \
+  X(CMD_RPM2,            tach.rpm[1],              VARIABLE_READ_ONLY) \
+  X(CMD_RPM3,            tach.rpm[2],              VARIABLE_READ_ONLY) \
+  X(CMD_TEMP_C,          temp_c,                   VARIABLE_READ_ONLY) \
+  X(CMD_FAN_MODE,        fan_control.mode,         VARIABLE_SILENT) \
+  X(CMD_FAN_CURVE,       fan_control.curve,        VARIABLE_SILENT) \
+  X(CMD_FAN_PID,         fan_control.pid,          VARIABLE_SILENT) \
+  X(CMD_FAN_SLEW,        fan_control.slew,         VARIABLE_SILENT) \
+  X(CMD_RAMP_RATE,       motors.rate,              VARIABLE_SILENT) \
+  X(CMD_LED_PATTERN,     led_pattern.pattern,      VARIABLE_SILENT)
+#define EXPOSED_COUNT(KEY, V, MODE) + 1
+#define EXPOSED_ADD(KEY, V, MODE)   keyhole.expose(KEY, V, MODE);
+static_assert(0 EXPOSED_LIST(EXPOSED_COUNT) <= KEYHOLE_MAX_VARIABLES, "too many variables for Keyhole: raise KEYHOLE_MAX_VARIABLES");
+
+// What is kept in EEPROM across resets and brown-outs (changing this list discards the saved copy)
+#define SETTINGS_LIST(X) X(manual_pwm) X(led_pwm) X(fan_control.mode) X(fan_control.curve) X(fan_control.pid) X(fan_control.slew) X(motors.rate)
+#define SETTINGS_BYTES(V) + sizeof(V)
+#define SETTINGS_COUNT(V) + 1
+#define SETTINGS_ADD(V)   settings.add(V);
+static_assert(2 + 0 SETTINGS_LIST(SETTINGS_BYTES) + 2 <= SETTINGS_RECORD_MAX, "the settings do not fit in an EEPROM record: raise SETTINGS_RECORD_MAX");
+static_assert(0 SETTINGS_LIST(SETTINGS_COUNT) <= SETTINGS_MAX_ITEMS, "too many settings: raise SETTINGS_MAX_ITEMS");
+
+void pollKeyhole(void);
+void readTachometers(void);
+void controlFans(void);
+void updateMotors(void);
+void playLedPattern(void);
+void saveSettings(void);
+void measureLoop(void);
+void setSerialBaud(unsigned long baud);
+
+Task tasks[] = {
+  { pollKeyhole,     0,                   0 },
+  { readTachometers, 0,                   0 },
+  { controlFans,     CONTROL_PERIOD_MS,   0 },
+  { updateMotors,    MOTOR_PERIOD_MS,     0 },
+  { playLedPattern,  LED_PERIOD_MS,       0 },
+  { saveSettings,    SETTINGS_PERIOD_MS,  0 },
+  { measureLoop,     STATS_PERIOD_MS,     0 },
+};
+Scheduler scheduler(tasks, sizeof(tasks) / sizeof(tasks[0]));
+
 void setup()
 {
-  Serial.begin(9600);
+  Serial.begin(KEYHOLE_FALLBACK_BAUD); // the host can raise this with the `baud` command
   while (!Serial) continue;
 
   pinMode(LED_BUILTIN, OUTPUT);
+  tach.begin(tach_pins);
+
+  // queue replies instead of waiting for them to be transmitted, so a slow host never stalls the fans
+  keyhole.output.mode = KEYHOLE_OUTPUT_DROP_OLDEST;
+  // if the host turns on automatic reports, send only what has changed, with a full report every 10th time
+  keyhole.deltaReports = 10;
+  keyhole.setBaud = setSerialBaud;
+
+  // register everything once, so that keyhole.begin() can dispatch each command straight to its variable
+  EXPOSED_LIST(EXPOSED_ADD) // (cannot fail: see the static_assert above)
+
+  SETTINGS_LIST(SETTINGS_ADD) // (cannot fail: see the static_asserts above)
+  if (settings.begin(millis()))
+  {
+    // restored before the first loop, so the fans start ramping back up straight away (in modes 1 and 2, the controller takes over from there)
+    for (unsigned char i = 0; i < 3; i++)
+    {
+      fan_pwm[i] = manual_pwm[i];
+      motors.set(M_FAN1 + i, fan_pwm[i]);
+    }
+    motors.set(M_LED, led_pwm);
+  }
 }
 
 void loop()
-{  
+{
+  scheduler.run(); // never blocks: every task returns as soon as its work is done
+}
+
+void pollKeyhole(void)
+{
   if(keyhole.begin()) // on most loops, this will return false, so
   {                   // very little processing will need to be done
-    
-    if (keyhole.variable(CMD_PING, ping, VARIABLE_READ_ONLY)) {
-    }    
-    if (keyhole.variable(CMD_FAN1, fan1_pwm)) {
-      m.motor(M_FAN1, FORWARD, fan1_pwm);
+    commands_this_second += keyhole.numberOfCommands();
+
+    // `fans` and `fan1` share an address, so this also catches fan1 on its own; the other two are then no-ops
+    if (fan_control.active())
+    {
+      // the controller owns the fans: put its output back and tell the host, rather than let controlFans() quietly overwrite it
+      short pwm = (short)(fan_control.output + 0.5);
+      for (unsigned char i = 0; i < 3; i++)
+      {
+        if (!keyhole.assigned(&fan_pwm[i])) continue;
+        for (unsigned char j = 0; j < 3; j++) fan_pwm[j] = pwm; // (`fans` sets all three)
+        keyhole.reject(&fan_pwm[i], "fan_mode 1 and 2 set the fans themselves: set fan_mode=0 first");
+      }
     }
-    if (keyhole.variable(CMD_FAN2, fan2_pwm)) {
-      m.motor(M_FAN2, FORWARD, fan2_pwm);
+    else if (keyhole.assigned(fan_pwm)) // `fans` (the array only, not fan1)
+    {
+      motors.assign(M_FAN1, fan_pwm[0]);
+      motors.assign(M_FAN2, fan_pwm[1]);
+      motors.assign(M_FAN3, fan_pwm[2]);
     }
-    if (keyhole.variable(CMD_FAN3, fan3_pwm)) {
-      m.motor(M_FAN3, FORWARD, fan3_pwm);
+    else
+    {
+      for (unsigned char i = 0; i < 3; i++) if (keyhole.assigned(&fan_pwm[i])) motors.assign(M_FAN1 + i, fan_pwm[i]);
     }
-    if (keyhole.variable(CMD_LED, led_pwm)) {
-      m.motor(M_LED, FORWARD, led_pwm);
+    if (keyhole.assigned(&led_pattern.pattern))
+    {
+      if (!led_pattern.select(millis())) keyhole.reject(&led_pattern.pattern, "led_pattern must be 0 to 11");
+      else if (!led_pattern.active()) motors.set(M_LED, led_pwm); // pattern off: back to the host's value
     }
+    else if (keyhole.assigned(&led_pwm) && !led_pattern.active()) motors.assign(M_LED, led_pwm);
 
     keyhole.end(); // must call this if `.begin()` returned `true`
   }
+}
+
+void readTachometers(void)
+{
+  tach.update(); // bounded: handles at most TACH_DRAIN_MAX pulses per pass
+}
+
+void controlFans(void)
+{
+  temp_c = analogRead(TEMP_PIN) * TEMP_C_PER_LSB;
+  if (!fan_control.active())
+  {
+    fan_control.reset(fan_pwm[0]); // so that switching to a control mode carries on from where the host left the fans
+    for (unsigned char i = 0; i < 3; i++) manual_pwm[i] = fan_pwm[i];
+    return;
+  }
+  // in the control modes the fanN values are outputs (pollKeyhole() rejects assignments to them)
+  short pwm = (short)(fan_control.step(temp_c, CONTROL_PERIOD_MS / 1000.0) + 0.5);
+  for (unsigned char i = 0; i < 3; i++)
+  {
+    fan_pwm[i] = pwm;
+    motors.set(M_FAN1 + i, pwm);
+  }
+}
+
+void updateMotors(void)
+{
+  motors.update(); // one ramp step toward whatever was last assigned; only channels whose PWM actually moved reach the driver
+}
 
-  digitalWrite(LED_BUILTIN, HIGH);  // turn the LED on (HIGH is the voltage level)
-  delay(500);                      // wait for a second
-  digitalWrite(LED_BUILTIN, LOW);   // turn the LED off by making the voltage LOW
-  delay(500);                      // wait for a second
+void playLedPattern(void)
+{
+  unsigned char level = led_pattern.update(millis()); // the heartbeat while no pattern is selected
+  digitalWrite(LED_BUILTIN, level >= 128 ? HIGH : LOW);
+  if (led_pattern.active()) motors.set(M_LED, level, false); // patterns are timed here, so bypass the ramp
+}
+
+void saveSettings(void)
+{
+  settings.poll(millis()); // saves only once the values have been left alone for SETTINGS_SETTLE_MS
+}
+
+void measureLoop(void)
+{
+  loop_us  = scheduler.maxLoopMicros;
+  late_us  = scheduler.maxLateMicros;
+  cmd_rate = commands_this_second;
+  commands_this_second = 0;
+  scheduler.resetTiming();
+}
+
+void setSerialBaud(unsigned long baud)
+{
+  Serial.end();
+  Serial.begin(baud);
 }
@@ -45,20 +45,79 @@
 #define   __Keyhole_CPP__
 
 #include "Keyhole.h"
+#include <ctype.h>  // for isspace()
+#include <stdlib.h> // for strtol() and strtoul()
+#include <math.h>   // for INFINITY, NAN, isinf(), signbit() and frexp()
+#include <float.h>  // for FLT_MAX and DBL_MAX_10_EXP
+#include <string.h> // for strlen() and memcpy()
+
+#if KEYHOLE_STATS
+#	define _STAT( X )  X
+#else
+#	define _STAT( X )
+#endif
+
 Keyhole::Keyhole( Stream & _stream, float _autoSeconds, bool _plotterMode ) :
 	stream( _stream ),
 	autoSeconds( _autoSeconds ),
 	plotterMode( _plotterMode ),
+	deltaReports( 0 ),
+	flushAfterReply( true ),
+	setBaud( NULL ),
+	output( _stream ),
 	mBeginMicros( 0 ),
-	//mFullCommand( "" ),
+#if KEYHOLE_BUFFER_SIZE > 0
+	mBufferLength( 0 ),
+#endif
+	mPartialStart( 0 ),
+	mNumberOfCommands( 0 ),
+	mTag( -1 ),
+	mListTag( -1 ),
 	mListAllVariables( 0 ),
-	//mPartialCommand( "" ),
+	mListIndex( 0 ),
+	mDroppedAtLastReport( 0 ),
+	mAutoReportCount( 0 ),
+	mShadow(),
+	mReplyItems( 0 ),
+	mOutputPending( false ),
+	mActive( false ),
+	mOverflow( false ),
+	mOverflows( 0 ),
 	mBackslash( false ),
 	mHexEscape( 0 ),
 	mHexValue( '\0' ),
 	mQuote( '\0' ),
 	mTimestampOfLastAutoReport( 0 ),
-	mBad( '\xFF' )
+	mBad( '\xFF' ),
+	mSubscribed( 0 ),
+	mDue( 0 ),
+	mUnconfirmed( 0 ),
+	mWheel(),
+	mWheelCursor( 0 ),
+	mWheelMillis( 0 ),
+	mNumberOfVariables( 0 ),
+	mReservedVariables( 0 ),
+	mVariableIndex(),
+	mDispatching( false ),
+	mDispatchIndex( 0 ),
+	mBinary( false ),
+	mFrames( 0 ),
+	mBaud( KEYHOLE_FALLBACK_BAUD ),
+	mBaudPending( false ),
+	mBaudChangeMillis( 0 )
+#if KEYHOLE_STATS
+	,
+	mLatencyStats(),
+	mParseStats(),
+	mDispatchStats(),
+	mOutputStats(),
+	mBytesIn( 0 ),
+	mCommandCount( 0 ),
+	mErrorCount( 0 ),
+	mMaxLoopMicros( 0 ),
+	mLastBeginMicros( 0 ),
+	mDispatchMicros( 0 )
+#endif
 {
 	/*     Members are set up.
 	   What more do you want to see?
@@ -78,25 +137,45 @@ bool Keyhole::begin( void )
 bool Keyhole::begin( unsigned long microsecondTimestamp )
 {
 	mBeginMicros = microsecondTimestamp;
-	while( this->stream.available() )
+	if( this->output.queued() ) this->output.drain(); // in the non-blocking modes, send whatever the Stream can now take
+	if( mBaudPending && millis() - mBaudChangeMillis >= KEYHOLE_BAUD_TIMEOUT_MS )
+	{
+		// The host never confirmed the new rate, so whatever we have received since is noise: go back to a rate it can reach.
+		mBaudPending = false;
+		mBaud = KEYHOLE_FALLBACK_BAUD;
+		this->setBaud( mBaud );
+		_truncate( mPartialStart );
+		mBackslash = false;
+		mHexEscape = 0;
+		mHexValue = '\0';
+		mQuote = '\0';
+	}
+#if KEYHOLE_STATS
+	if( !mReservedVariables ) _exposeStats(); // (here rather than in the constructor, so that they come after the sketch's variables)
+	unsigned long startMicros = micros();
+	if( mLastBeginMicros && startMicros - mLastBeginMicros > mMaxLoopMicros ) mMaxLoopMicros = startMicros - mLastBeginMicros;
+	mLastBeginMicros = startMicros;
+	unsigned long bytesIn = mBytesIn;
+#endif
+	// Drain every complete command that is waiting in the Stream, up to KEYHOLE_BATCH_SIZE of them. Each one is
+	// null-terminated in place inside mBuffer, and anything after the last terminator stays there as a partial command.
+	while( mNumberOfCommands < KEYHOLE_BATCH_SIZE && this->stream.available() )
 	{
+#if KEYHOLE_BUFFER_SIZE > 0
+		if( mNumberOfCommands && mBufferLength + 1 >= KEYHOLE_BUFFER_SIZE ) break; // leave the rest in the Stream until end() has made room
+#endif
 		char c = this->stream.read();	
+		_STAT( mBytesIn++ );
+		if( mBinary )
+		{
+			if( c ) _append( c );
+			else _finishFrame();
+			continue;
+		}
 		if( !mQuote && ( c == ';' || c == '\n' ) )
 		{
-			// Solution 1
-			//mFullCommand = mPartialCommand; // TODO: on some boards this messes up when there's a null byte in there
-			//mFullCommand.trim();
-			
-			// Solution 2
-			assignString( mFullCommand, mPartialCommand.c_str(), mPartialCommand.length(), true );
-						
-			if( mFullCommand == "?" ) { mListAllVariables = 1; mFullCommand = ""; }
-			mPartialCommand = "";
-			mBackslash = false;
-			mHexEscape = 0;
-			mHexValue = '\0';
-			mQuote = '\0';
-			return true;
+			_finishCommand();
+			continue;
 		}
 		bool escape = ( c == '\\' && !mBackslash && mQuote );
 		if( mHexEscape == 2 )
@@ -111,7 +190,7 @@ bool Keyhole::begin( unsigned long microsecondTimestamp )
 			if(      c >= 'A' && c <= 'F' ) { c = c - 'A' + 10 + mHexValue * 16; }
 			else if( c >= 'a' && c <= 'f' ) { c = c - 'a' + 10 + mHexValue * 16; }
 			else if( c >= '0' && c <= '9' ) { c = c - '0'      + mHexValue * 16; }
-			else mPartialCommand += mHexValue;
+			else _append( mHexValue );
 			mHexEscape = 0;
 			mHexValue  = 0;
 		}
@@ -123,173 +202,1093 @@ bool Keyhole::begin( unsigned long microsecondTimestamp )
 			else if( c == '0' ) c = '\0';
 			else if( c == 'x' ) { mBackslash = false; mHexEscape = 2; continue; }
 		}
-		if( !escape && ( mPartialCommand.length() || !isspace( c ) ) ) mPartialCommand += c;
+		if( !escape && ( _bufferLength() > mPartialStart || !isspace( c ) ) ) _append( c );
 		if( !mQuote && ( c == '\'' || c == '"' ) ) mQuote = c;
 		else if( mQuote && c == mQuote && !mBackslash ) mQuote = '\0';
 		mBackslash = escape;
 	}
-	if( autoSeconds > 0.0 && microsecondTimestamp - mTimestampOfLastAutoReport >= ( unsigned long )( autoSeconds * 1e6 ) )
+#if KEYHOLE_STATS
+	if( mBytesIn != bytesIn ) mParseStats.record( micros() - startMicros ); // (idle passes would swamp the histogram)
+#endif
+	if( !mBinary && autoSeconds > 0.0 && microsecondTimestamp - mTimestampOfLastAutoReport >= ( unsigned long )( autoSeconds * 1e6 ) )
 	{
 		mTimestampOfLastAutoReport = microsecondTimestamp;
-		mListAllVariables = 1;
+		if( this->output.queued() ) {} // if the last report is still queued, skip this one rather than pile up behind it
+		else if( mListAllVariables ) {} // a "?" has just asked for a full listing anyway
+		else if( deltaReports && !plotterMode && mAutoReportCount % deltaReports && this->output.dropped == mDroppedAtLastReport ) mListAllVariables = 2; // changes only
+		else mListAllVariables = 1; // full listing (a "keyframe" in delta mode, and after any output was dropped: the host may have missed the values a delta would build on)
+		if( mListAllVariables ) { mAutoReportCount++; mDroppedAtLastReport = this->output.dropped; }
+	}
+	if( mSubscribed && !mBinary ) _advanceWheel();
+	mActive = mNumberOfCommands || mListAllVariables || mOverflows || mDue || mOutputPending || mFrames || mUnconfirmed;
+	_STAT( if( mActive ) mDispatchMicros = micros() );
+	if( mNumberOfVariables && mActive ) _dispatchRegistered();
+	return mActive;
+}
+
+void Keyhole::_finishCommand( void )
+{
+	unsigned int length = _bufferLength();
+	while( length > mPartialStart && isspace( _bufferData()[ length - 1 ] ) ) length--;
+	_truncate( length );
+	length -= mPartialStart;
+	if( mOverflow ) { mOverflows++; mOverflow = false; length = 0; _truncate( mPartialStart ); }
+	if( length )
+	{
+		_STAT( mCommandCount++ );
+		_terminate(); // terminate in place, so that the command can be parsed where it lies (there is always room for this)
+		const char * command = _bufferData() + mPartialStart; // (only now: appending may have moved a String buffer)
+		unsigned int start = mPartialStart;
+		mTag = -1;
+		if( command[ 0 ] == '#' && isdigit( command[ 1 ] ) )
+		{
+			// "#N command": remember N, and parse the command as if the tag were not there
+			char * remainder = NULL;
+			mTag = strtol( command + 1, &remainder, 10 );
+			while( isspace( *remainder ) ) remainder++;
+			start  += remainder - command;
+			length -= remainder - command;
+			command = remainder;
+		}
+		if( !length ) { _acknowledgeTag(); _truncate( mPartialStart ); } // a bare "#N" is just a ping, handy for syncing a pipeline
+		else if( _builtinCommand( command, length ) ) { _acknowledgeTag(); _truncate( mPartialStart ); } // (a built-in with a reply of its own has used the tag up)
+		else
+		{
+			mCommands[ mNumberOfCommands ].start   = start;
+			mCommands[ mNumberOfCommands ].length  = length;
+			mCommands[ mNumberOfCommands ].pending = true;
+			mCommands[ mNumberOfCommands ].tag     = mTag;
+			mCommands[ mNumberOfCommands ].acknowledge = -1;
+			_STAT( mCommands[ mNumberOfCommands ].receivedMicros = micros() );
+			mNumberOfCommands++;
+			mPartialStart = _bufferLength();
+		}
+		mTag = -1;
+	}
+	mBackslash = false;
+	mHexEscape = 0;
+	mHexValue = '\0';
+	mQuote = '\0';
+}
+
+// If `command` starts with the word `name` (a PSTR() in flash), return a pointer to whatever follows it (skipping whitespace), otherwise NULL.
+static const char * _builtinArguments( const char * command, const char * name )
+{
+	for( char c; ( c = pgm_read_byte( name ) ) != '\0'; name++ ) if( *command++ != c ) return NULL;
+	if( *command && !isspace( *command ) ) return NULL;
+	while( isspace( *command ) ) command++;
+	return command;
+}
+
+bool Keyhole::_builtinCommand( const char * command, unsigned int length )
+{
+	// Commands that Keyhole handles itself, before any variable() or command() call gets to see them.
+	const char * arguments;
+	if( length == 1 && *command == '?' ) { mListAllVariables = 1; mListTag = mTag; mTag = -1; return true; }
+	if( ( arguments = _builtinArguments( command, PSTR( "sub" )   ) ) != NULL ) { _subscribe(   arguments ); return true; }
+	if( ( arguments = _builtinArguments( command, PSTR( "unsub" ) ) ) != NULL ) { _unsubscribe( arguments ); return true; }
+	if( _builtinArguments( command, PSTR( "binary" ) ) ) { _switchProtocol( true ); return true; }
+	if( ( arguments = _builtinArguments( command, PSTR( "baud" )  ) ) != NULL ) { _changeBaud( arguments ); return true; }
+	if( _builtinArguments( command, PSTR( "schema" )  ) ) { _printSchema( true  ); return true; }
+	if( _builtinArguments( command, PSTR( "schema?" ) ) ) { _printSchema( false ); return true; }
+	return false;
+}
+
+void Keyhole::_subscribe( const char * arguments )
+{
+	// sub KEY PERIOD   where PERIOD is in milliseconds, optionally followed by "ms", or in seconds if followed by "s"
+	unsigned int keyLength = 0;
+	while( arguments[ keyLength ] && !isspace( arguments[ keyLength ] ) ) keyLength++;
+	const char * periodPtr = arguments + keyLength;
+	while( isspace( *periodPtr ) ) periodPtr++;
+	char * remainder = NULL;
+	unsigned long period;
+	bool negative;
+	bool valid = parseInteger( periodPtr, &remainder, period, negative ) && !negative;
+	const unsigned long longest = 0xFFFFUL * KEYHOLE_WHEEL_TICK_MS; // as far ahead as the wheel can schedule
+	if(      remainder[ 0 ] == 'm' && remainder[ 1 ] == 's' ) remainder += 2;
+	else if( remainder[ 0 ] == 's' ) { remainder++; if( period > longest / 1000 ) valid = false; else period *= 1000; }
+	while( isspace( *remainder ) ) remainder++;
+	if( !keyLength || !valid || *remainder || period > longest )
+	{
+		this->_startError( F( "BadValue" ) );
+		this->output.print( F( "\"expected: sub KEY PERIOD[ms|s], with PERIOD up to " ) );
+		this->output.print( longest );
+		this->output.println( F( " ms\"}" ) );
+		return;
+	}
+	unsigned int keyHash = hash( arguments, keyLength );
+	if( !period ) { _unsubscribe( arguments ); return; }
+	int free = -1, i;
+	for( i = 0; i < KEYHOLE_MAX_SUBSCRIPTIONS; i++ )
+	{
+		if( !( mSubscribed & ( 1u << i ) ) ) { if( free < 0 ) free = i; }
+		else if( mSubscriptions[ i ].keyHash == keyHash ) break; // re-subscribing just changes the period
+	}
+	if( i == KEYHOLE_MAX_SUBSCRIPTIONS ) i = free;
+	if( i < 0 )
+	{
+		this->_startError( F( "TooManySubscriptions" ) );
+		this->output.print( F( "\"cannot subscribe to more than " ) );
+		this->output.print( KEYHOLE_MAX_SUBSCRIPTIONS );
+		this->output.println( F( " variables\"}" ) );
+		return;
+	}
+	if( !mSubscribed ) mWheelMillis = millis();
+	unsigned long ticks = ( period + KEYHOLE_WHEEL_TICK_MS - 1 ) / KEYHOLE_WHEEL_TICK_MS;
+	mSubscriptions[ i ].keyHash     = keyHash;
+	mSubscriptions[ i ].periodTicks = ticks;
+	mSubscribed |= 1u << i;
+	_unschedule( i );
+	_schedule( i );
+	mSubscriptions[ i ].tag = -1;
+	if( _findVariable( arguments, keyLength ) < 0 )
+	{
+		// Not registered, but it may yet be passed to variable() in this pass: end() confirms it, or rejects it, then
+		mUnconfirmed |= 1u << i;
+		mSubscriptions[ i ].tag = mTag;
+		mTag = -1; // (so the tag is answered then, too)
+	}
+}
+
+void Keyhole::_unsubscribe( const char * arguments )
+{
+	// unsub KEY   cancels one subscription;   unsub   on its own cancels them all
+	unsigned int keyLength = 0;
+	while( arguments[ keyLength ] && !isspace( arguments[ keyLength ] ) ) keyLength++;
+	unsigned int keyHash = hash( arguments, keyLength );
+	for( unsigned char i = 0; i < KEYHOLE_MAX_SUBSCRIPTIONS; i++ )
+	{
+		if( !( mSubscribed & ( 1u << i ) ) || ( keyLength && mSubscriptions[ i ].keyHash != keyHash ) ) continue;
+		_unschedule( i );
+		mSubscribed &= ~( 1u << i );
+		mDue &= ~( 1u << i );
+		mUnconfirmed &= ~( 1u << i );
+	}
+}
+
+void Keyhole::_confirmSubscription( unsigned int keyHash )
+{
+	for( unsigned char i = 0; i < KEYHOLE_MAX_SUBSCRIPTIONS; i++ )
+	{
+		if( !( mUnconfirmed & ( 1u << i ) ) || mSubscriptions[ i ].keyHash != keyHash ) continue;
+		mUnconfirmed &= ~( 1u << i );
+		mTag = mSubscriptions[ i ].tag;
+		_acknowledgeTag();
+	}
+}
+
+void Keyhole::_rejectUnconfirmedSubscriptions( void )
+{
+	for( unsigned char i = 0; mUnconfirmed; i++ )
+	{
+		if( !( mUnconfirmed & ( 1u << i ) ) ) continue;
+		mUnconfirmed &= ~( 1u << i );
+		_unschedule( i );
+		mSubscribed &= ~( 1u << i );
+		mDue &= ~( 1u << i );
+		mTag = mSubscriptions[ i ].tag;
+		this->_startError( F( "BadValue" ) );
+		this->output.println( F( "\"cannot subscribe to a key that is not a variable\"}" ) );
+	}
+}
+
+// The subscriptions are kept on a "timer wheel": a ring of KEYHOLE_WHEEL_SLOTS slots, each KEYHOLE_WHEEL_TICK_MS
+// apart, with a bitmask of the subscriptions that expire in each. Each tick only looks at one slot, however many
+// subscriptions there are. A period longer than one turn of the wheel is counted down in `rounds`.
+void Keyhole::_schedule( unsigned char i )
+{
+	unsigned int ticks = mSubscriptions[ i ].periodTicks;
+	mSubscriptions[ i ].rounds = ( ticks - 1 ) / KEYHOLE_WHEEL_SLOTS;
+	mWheel[ ( mWheelCursor + ticks ) % KEYHOLE_WHEEL_SLOTS ] |= 1u << i;
+}
+
+void Keyhole::_unschedule( unsigned char i )
+{
+	for( unsigned char slot = 0; slot < KEYHOLE_WHEEL_SLOTS; slot++ ) mWheel[ slot ] &= ~( 1u << i );
+}
+
+void Keyhole::_advanceWheel( void )
+{
+	unsigned long ticks = ( millis() - mWheelMillis ) / KEYHOLE_WHEEL_TICK_MS;
+	if( !ticks ) return;
+	mWheelMillis += ticks * KEYHOLE_WHEEL_TICK_MS;
+	if( ticks > KEYHOLE_WHEEL_SLOTS ) ticks = KEYHOLE_WHEEL_SLOTS; // after a long stall, visit each slot once rather than spin
+	while( ticks-- )
+	{
+		mWheelCursor = ( mWheelCursor + 1 ) % KEYHOLE_WHEEL_SLOTS;
+		unsigned int expiring = mWheel[ mWheelCursor ];
+		for( unsigned char i = 0; expiring; i++, expiring >>= 1 )
+		{
+			if( !( expiring & 1 ) ) continue;
+			if( mSubscriptions[ i ].rounds ) { mSubscriptions[ i ].rounds--; continue; }
+			mWheel[ mWheelCursor ] &= ~( 1u << i );
+			mDue |= 1u << i;
+			_schedule( i );
+		}
+	}
+}
+
+bool Keyhole::_due( unsigned int keyHash, bool consume )
+{
+	for( unsigned char i = 0; i < KEYHOLE_MAX_SUBSCRIPTIONS; i++ )
+	{
+		if( !( mDue & ( 1u << i ) ) || mSubscriptions[ i ].keyHash != keyHash ) continue;
+		if( consume ) mDue &= ~( 1u << i ); // so that a variable is reported only once per batch
 		return true;
 	}
 	return false;
 }
 
-bool Keyhole::command( const char * cmd )
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Binary protocol: after the text command `binary`, everything in both directions is a COBS-encoded frame terminated by
+// a zero byte. Decoded, a frame is  [op] [index] [type] [payload...] [crc16 lo] [crc16 hi]  where the index is the
+// variable's position in the expose() table, the type is its KeyholeType, the payload is the raw little-endian value
+// (the characters, for a String) and the CRC is CRC-16/CCITT-FALSE over everything before it.
+
+static unsigned int _cobsDecode( uint8_t * data, unsigned int length )
+{
+	// Decodes in place (the output is never longer than the input). Returns the decoded length, or 0 if malformed.
+	unsigned int r = 0, w = 0;
+	while( r < length )
+	{
+		uint8_t code = data[ r++ ];
+		if( !code || r + code - 1 > length ) return 0;
+		for( uint8_t i = 1; i < code; i++ ) data[ w++ ] = data[ r++ ];
+		if( code < 0xFF && r < length ) data[ w++ ] = 0;
+	}
+	return w;
+}
+
+static void _cobsEncode( Print & out, const uint8_t * data, unsigned int length )
+{
+	unsigned int start = 0;
+	for( ;; )
+	{
+		unsigned int end = start;
+		while( end < length && data[ end ] && end - start < 254 ) end++;
+		out.write( ( uint8_t )( end - start + 1 ) );
+		out.write( data + start, end - start );
+		if( end >= length ) break;
+		start = ( end - start < 254 ) ? end + 1 : end; // skip the zero that the code byte stands for (a full 254-byte block stands for none)
+	}
+	out.write( ( uint8_t )0 );
+}
+
+static unsigned char _typeSize( unsigned char type )
+{
+	switch( type )
+	{
+		case KEYHOLE_BOOL:   return sizeof( bool );
+		case KEYHOLE_CHAR:   return sizeof( char );
+		case KEYHOLE_INT8:   return sizeof( int8_t );
+		case KEYHOLE_UCHAR:  return sizeof( unsigned char );
+		case KEYHOLE_INT:    return sizeof( int );
+		case KEYHOLE_UINT:   return sizeof( unsigned int );
+		case KEYHOLE_SHORT:  return sizeof( short );
+		case KEYHOLE_USHORT: return sizeof( unsigned short );
+		case KEYHOLE_LONG:   return sizeof( long );
+		case KEYHOLE_ULONG:  return sizeof( unsigned long );
+		case KEYHOLE_FLOAT:  return sizeof( float );
+		case KEYHOLE_DOUBLE: return sizeof( double );
+	}
+	return 0; // KEYHOLE_STRING: variable length
+}
+
+void Keyhole::_switchProtocol( bool binary )
+{
+	// The acknowledgement goes out in the old protocol's clothing (text), so that the host knows where the switch happened.
+	// It also answers the tag, if any: nothing may follow it in text once the switch to binary has been made.
+	if( mTag >= 0 ) this->_startTaggedReply( F( "_KEYHOLE_PROTOCOL" ) );
+	else { this->_endReply(); mOutputPending = true; this->output.print( F( "{\"_KEYHOLE_PROTOCOL\": " ) ); }
+	this->output.println( binary ? F( "\"binary\"}" ) : F( "\"text\"}" ) );
+	mBinary = binary;
+	this->output.delimiter = binary ? 0 : '\n'; // a frame may well contain a 0x0A byte, but never a 0
+}
+
+void Keyhole::_changeBaud( const char * arguments )
+{
+	// baud RATE   proposes a new rate;   baud   on its own reports the current rate, and confirms a proposed one
+	char * remainder = NULL;
+	unsigned long baud = *arguments ? strToUnsignedInteger( arguments, &remainder ) : 0;
+	while( remainder && isspace( *remainder ) ) remainder++;
+	if( !this->setBaud ) { this->_startError( F( "Unsupported" ) ); this->output.println( F( "\"no setBaud function\"}" ) ); return; }
+	if( *arguments && ( !baud || !remainder || *remainder ) )
+	{
+		this->_startError( F( "BadValue" ) );
+		this->output.println( F( "\"expected: baud RATE\"}" ) );
+		return;
+	}
+	if( mTag >= 0 ) this->_startTaggedReply( F( "_KEYHOLE_BAUD" ) );
+	else { this->_endReply(); mOutputPending = true; this->output.print( F( "{\"_KEYHOLE_BAUD\": " ) ); }
+	this->output.print( baud ? baud : mBaud );
+	this->output.println( F( "}" ) );
+	if( !baud ) { mBaudPending = false; return; }
+	// The acknowledgement must leave at the old rate, so send it (and everything queued before it) right now.
+	this->output.sendAll();
+	this->stream.flush();
+	mOutputPending = false;
+	mBaud = baud;
+	mBaudPending = true;
+	mBaudChangeMillis = millis();
+	this->setBaud( baud );
+}
+
+// Names of the KeyholeTypes and KeyholeWriteModes, as reported by the `schema` command, packed one after another in flash:
+static const char _typeNames[] PROGMEM = "bool\0char\0int8_t\0unsigned char\0int\0unsigned int\0short\0unsigned short\0long\0unsigned long\0float\0double\0String\0stats";
+static const char _modeNames[] PROGMEM = "read-only\0silent\0verbose";
+
+static void _printName( Print & out, const char * names, unsigned char index )
+{
+	while( index-- ) while( pgm_read_byte( names++ ) ) {}
+	out.print( ( const __FlashStringHelper * )names );
+}
+
+unsigned int Keyhole::_schemaVersion( void )
+{
+	// Combine the key hashes, types and modes in registration order, djb2-style.
+	unsigned int h = 5381;
+	for( unsigned char i = 0; i < mNumberOfVariables; i++ )
+	{
+		h = ( h << 5 ) + h + mVariables[ i ].hash;
+		h = ( h << 5 ) + h + mVariables[ i ].type;
+		h = ( h << 5 ) + h + mVariables[ i ].mode;
+	}
+	return h;
+}
+
+void Keyhole::_printSchema( bool full )
+{
+	// `schema` lists every registered variable; `schema?` only gives the version, for a host to check its cached copy.
+	if( mTag >= 0 ) { this->_startTaggedReply( ( const char * )NULL ); this->output.print( F( ", " ) ); }
+	else { this->_endReply(); mOutputPending = true; this->output.print( F( "{" ) ); }
+	this->output.print( F( "\"_KEYHOLE_SCHEMA_VERSION\": " ) );
+	this->output.print( _schemaVersion() );
+	if( full )
+	{
+		this->output.print( F( ", \"_KEYHOLE_SCHEMA\": [" ) );
+		for( unsigned char i = 0; i < mNumberOfVariables; i++ )
+		{
+			KeyholeVariable & v = mVariables[ i ];
+			this->output.print( i ? F( ", [" ) : F( "[" ) );
+			this->output.print( i );
+			this->output.print( F( ", \"" ) );
+			this->output.print( v.key );
+			this->output.print( F( "\", \"" ) );
+			_printName( this->output, _typeNames, v.type );
+			if( v.count ) { this->output.print( F( "[" ) ); this->output.print( v.count ); this->output.print( F( "]" ) ); }
+			this->output.print( F( "\", \"" ) );
+			_printName( this->output, _modeNames, v.mode );
+			this->output.print( F( "\"]" ) );
+		}
+		this->output.print( F( "]" ) );
+	}
+	this->output.println( F( "}" ) );
+}
+
+#if KEYHOLE_STATS
+void KeyholeHistogram::record( unsigned long micros )
+{
+	if( micros > maxMicros ) maxMicros = micros;
+	unsigned char bucket = 0;
+	for( unsigned long limit = 16; micros >= limit && bucket < KEYHOLE_STATS_BUCKETS - 1; limit <<= 2 ) bucket++;
+	if( counts[ bucket ] != ( unsigned int )-1 ) counts[ bucket ]++; // saturate rather than wrap
+}
+
+void Keyhole::_exposeStats( void )
+{
+	mReservedVariables = KEYHOLE_RESERVED_VARIABLES; // first, so that _expose() lets them in on top of the sketch's own
+	_expose( "_stats",       this,            KEYHOLE_STATISTICS, VARIABLE_SILENT );
+	_expose( "_latency_us",  &mLatencyStats,  KEYHOLE_STATISTICS, VARIABLE_SILENT );
+	_expose( "_parse_us",    &mParseStats,    KEYHOLE_STATISTICS, VARIABLE_SILENT );
+	_expose( "_dispatch_us", &mDispatchStats, KEYHOLE_STATISTICS, VARIABLE_SILENT );
+	_expose( "_output_us",   &mOutputStats,   KEYHOLE_STATISTICS, VARIABLE_SILENT );
+}
+
+bool Keyhole::_resetStats( const void * address, const char * text )
 {
-	if( mFullCommand != cmd ) return false;
-	mFullCommand = "";
+	// _stats=0   resets everything;   _latency_us=0 (and so on)   resets just that histogram
+	char * remainder = NULL;
+	unsigned long magnitude;
+	bool negative;
+	if( !parseInteger( text, &remainder, magnitude, negative ) || magnitude ) return false;
+	while( isspace( *remainder ) ) remainder++;
+	if( *remainder ) return false;
+	if( address != this ) { *( KeyholeHistogram * )address = KeyholeHistogram(); return true; }
+	mLatencyStats = mParseStats = mDispatchStats = mOutputStats = KeyholeHistogram();
+	mBytesIn = mCommandCount = mErrorCount = mMaxLoopMicros = 0;
+	this->output.sent = this->output.dropped = 0;
 	return true;
 }
 
-// Let's define some hefty macros for internal use:
+void Keyhole::_printStats( const void * address )
+{
+	// Each one is a line of its own, short enough for the 128-byte output queue of the smaller boards.
+	if( address != this )
+	{
+		const KeyholeHistogram & h = *( const KeyholeHistogram * )address;
+		this->output.print( F( "{\"max\": " ) );
+		this->output.print( h.maxMicros );
+		this->output.print( F( ", \"counts\": [" ) );
+		for( unsigned char i = 0; i < KEYHOLE_STATS_BUCKETS; i++ ) { if( i ) this->output.print( F( ", " ) ); this->output.print( h.counts[ i ] ); }
+		this->output.print( F( "]}" ) );
+		return;
+	}
+	this->output.print( F( "{\"commands\": " ) );     this->output.print( mCommandCount );
+	this->output.print( F( ", \"errors\": " ) );      this->output.print( mErrorCount );
+	this->output.print( F( ", \"bytes_in\": " ) );    this->output.print( mBytesIn );
+	this->output.print( F( ", \"bytes_out\": " ) );   this->output.print( this->output.sent );
+	this->output.print( F( ", \"dropped\": " ) );     this->output.print( this->output.dropped );
+	this->output.print( F( ", \"max_loop_us\": " ) ); this->output.print( mMaxLoopMicros );
+	this->output.print( F( "}" ) );
+}
+#endif
+
+void Keyhole::_finishFrame( void )
+{
+	uint8_t * frame = ( uint8_t * )_bufferData() + mPartialStart; // (in place - it is our own buffer)
+	unsigned int length = _bufferLength() - mPartialStart;
+	if( !length && !mOverflow ) return; // consecutive delimiters are harmless, and a host may send one to resynchronize
+	if( mOverflow ) { mOverflow = false; length = 0; }
+	else length = _cobsDecode( frame, length );
+	if( length >= 3 && crc16( frame, length - 2 ) == ( unsigned int )( frame[ length - 2 ] | ( frame[ length - 1 ] << 8 ) ) ) _binaryCommand( frame, length - 2 );
+	else _sendFrame( KEYHOLE_FRAME_ERROR, 0, KEYHOLE_FRAME_BAD_FRAME, NULL, 0 );
+	_truncate( mPartialStart );
+	mFrames++;
+	_STAT( mCommandCount++ );
+}
+
+void Keyhole::_binaryCommand( const uint8_t * frame, unsigned int length )
+{
+	unsigned char op = frame[ 0 ];
+	unsigned char index = ( length > 1 ) ? frame[ 1 ] : 0;
+	if( op == KEYHOLE_FRAME_TEXT ) { _switchProtocol( false ); return; }
+	if( op == KEYHOLE_FRAME_LIST ) { for( unsigned char i = 0; i < mNumberOfVariables; i++ ) if( mVariables[ i ].type != KEYHOLE_STATISTICS ) _sendValue( i ); return; }
+	if( op != KEYHOLE_FRAME_GET && op != KEYHOLE_FRAME_SET ) { _sendFrame( KEYHOLE_FRAME_ERROR, index, KEYHOLE_FRAME_BAD_OP, NULL, 0 ); return; }
+	if( index >= mNumberOfVariables ) { _sendFrame( KEYHOLE_FRAME_ERROR, index, KEYHOLE_FRAME_BAD_INDEX, NULL, 0 ); return; }
+	KeyholeVariable & v = mVariables[ index ];
+	if( v.type == KEYHOLE_STATISTICS ) { _sendFrame( KEYHOLE_FRAME_ERROR, index, KEYHOLE_FRAME_BAD_TYPE, NULL, 0 ); return; } // (text only)
+	if( op == KEYHOLE_FRAME_GET ) { _sendValue( index ); return; }
+	
+	const uint8_t * payload = frame + 3;
+	unsigned int payloadLength = length - 3;
+	unsigned int size = _typeSize( v.type ) * ( v.count ? v.count : 1 );
+	if( length < 3 || frame[ 2 ] != v.type || ( size && payloadLength != size ) ) { _sendFrame( KEYHOLE_FRAME_ERROR, index, KEYHOLE_FRAME_BAD_TYPE, NULL, 0 ); return; }
+	if( v.mode == VARIABLE_READ_ONLY ) { _sendFrame( KEYHOLE_FRAME_ERROR, index, KEYHOLE_FRAME_READ_ONLY, NULL, 0 ); return; }
+	if(      v.type == KEYHOLE_STRING ) assignString( *( String * )v.address, ( const char * )payload, payloadLength );
+	else if( v.type == KEYHOLE_BOOL   ) for( unsigned int i = 0; i < size; i++ ) ( ( bool * )v.address )[ i ] = ( payload[ i ] != 0 );
+	else memcpy( v.address, payload, size ); // both ends are little-endian
+	v.assigned = true;
+	if( v.mode == VARIABLE_VERBOSE ) v.echo = true; // end() sends the value back, unless the sketch reject()s it first
+}
+
+void Keyhole::_sendValue( unsigned char index )
+{
+	KeyholeVariable & v = mVariables[ index ];
+	if( v.type == KEYHOLE_STRING )
+	{
+		String & s = *( String * )v.address;
+		_sendFrame( KEYHOLE_FRAME_VALUE, index, v.type, s.c_str(), s.length() );
+	}
+	else _sendFrame( KEYHOLE_FRAME_VALUE, index, v.type, v.address, _typeSize( v.type ) * ( v.count ? v.count : 1 ) );
+}
+
+void Keyhole::_sendFrame( unsigned char op, unsigned char index, unsigned char type, const void * payload, unsigned int payloadLength )
+{
+	uint8_t frame[ KEYHOLE_MAX_FRAME ];
+	if( payloadLength > KEYHOLE_MAX_FRAME - 5 ) { op = KEYHOLE_FRAME_ERROR; type = KEYHOLE_FRAME_TOO_LONG; payloadLength = 0; }
+	frame[ 0 ] = op;
+	frame[ 1 ] = index;
+	frame[ 2 ] = type; // for an error frame, this is the error code instead
+	_STAT( if( op == KEYHOLE_FRAME_ERROR ) mErrorCount++ );
+	if( payloadLength ) memcpy( frame + 3, payload, payloadLength );
+	unsigned int crc = crc16( frame, payloadLength + 3 );
+	frame[ payloadLength + 3 ] = crc & 0xFF;
+	frame[ payloadLength + 4 ] = ( crc >> 8 ) & 0xFF;
+	_cobsEncode( this->output, frame, payloadLength + 5 );
+	mOutputPending = true;
+}
+
+bool Keyhole::command( const char * cmd )
+{
+	bool received = false;
+	for( unsigned char i = 0; i < mNumberOfCommands; i++ )
+	{
+		if( !mCommands[ i ].pending || strcmp( _bufferData() + mCommands[ i ].start, cmd ) != 0 ) continue;
+		mCommands[ i ].pending = false;
+		_STAT( mLatencyStats.record( micros() - mCommands[ i ].receivedMicros ) );
+		mTag = mCommands[ i ].tag;
+		_acknowledgeTag();
+		received = true;
+	}
+	return received;
+}
+
+unsigned int Keyhole::numberOfCommands( void )
+{
+	return mNumberOfCommands;
+}
+
+// Each listed variable's value is remembered only as a hash, which is enough to tell whether it has changed:
+static unsigned int _valueHash( const void * address, KeyholeType type, unsigned char count )
+{
+	if( type == KEYHOLE_STRING ) return Keyhole::hash( ( ( const String * )address )->c_str(), ( ( const String * )address )->length() );
+	return Keyhole::hash( ( const char * )address, _typeSize( type ) * ( count ? count : 1 ) );
+}
+
+bool Keyhole::_listing( unsigned int valueHash )
+{
+	// Called for each variable in turn during a listing. Variables are always visited in the same order,
+	// so the position in the listing identifies the variable.
+	unsigned char i = mListIndex++;
+	if( i >= KEYHOLE_MAX_VARIABLES ) return true;
+	bool changed = ( mShadow[ i ] != valueHash );
+	mShadow[ i ] = valueHash;
+	return changed || mListAllVariables == 1;
+}
 
 #define _DEFINE_LSHIFT( TYPE )   Kout Keyhole::operator<<( TYPE x ) { Kout s( this->stream ); s << x; return s; }
-_DEFINE_LSHIFT( const char * ) // edge-case that will not be covered by the various _START_VARIABLE_PROCESSOR() macro calls
-_DEFINE_LSHIFT( const Kfmt & )
-
-#define _START_VARIABLE_PROCESSOR( TYPE, PRINT_STATEMENT, PLOTTABLE ) \
-	_DEFINE_LSHIFT( const TYPE & ) \
-	bool Keyhole::variable( const char * key, TYPE & var, KeyholeWriteMode writeMode ) \
-	{ \
-		bool allowOutput = PLOTTABLE || !this->plotterMode; \
-		if( mListAllVariables && allowOutput ) \
-		{ \
-			if( this->plotterMode ) this->stream.print( ( mListAllVariables++ == 1 ) ?    "" : ","    ); \
-			else                    this->stream.print( ( mListAllVariables++ == 1 ) ? "{\"" : ", \"" ); \
-			this->stream.print( key ); \
-			if( this->plotterMode ) this->stream.print(   ":"  ); \
-			else                    this->stream.print( "\": " ); \
-			PRINT_STATEMENT; \
-		} \
-		unsigned int commandLength; \
-		const char * commandPtr = _parseVariableCommand( key, commandLength ); /* this quickly returns NULL if mFullCommand has been used and emptied already */ \
-		if( !commandPtr ) return false; /* ...so this effectively shortcuts the whole thing if a command has already been matched since the call to begin() */ \
-		if( !*commandPtr && !this->plotterMode ) { this->stream.print( "{\"" ); this->stream.print( key ); this->stream.print( "\": " ); PRINT_STATEMENT; this->stream.println( "}" ); this->stream.flush();   mFullCommand = ""; return false; } \
-		if( !*commandPtr &&  this->plotterMode ) { if( allowOutput ) {          this->stream.print( key ); this->stream.print(   ":"  ); PRINT_STATEMENT; this->stream.println(     ); this->stream.flush(); } mFullCommand = ""; return false; } \
-		if( writeMode == VARIABLE_READ_ONLY ) { this->_startError( "ReadOnly" ); this->stream.print( "\"cannot change the '" ); this->stream.print( key ); this->stream.println( "' variable because it is read-only\"}" ); this->stream.flush(); mFullCommand = ""; return false; } \
-		char *remainder = NULL; \
-		TYPE value;
-		//
-		// conversion of const char * commandPtr to TYPE value happens here between _START_VARIABLE_PROCESSOR and _END_VARIABLE_PROCESSOR macros
-		//
-#define _END_VARIABLE_PROCESSOR( TYPE, PRINT_STATEMENT, ASSIGN ) \
-		while( remainder && isspace( *remainder ) ) remainder++; \
-		if( remainder && *remainder ) \
-		{ \
-			this->_startError( "BadValue" ); \
-			this->stream.print( "\"failed to interpret argument as type '" ); \
-			this->stream.print( #TYPE ); \
-			this->stream.print( "' when setting the '" ); \
-			this->stream.print( key ); \
-			this->stream.println( "' variable\"}" ); \
-			this->stream.flush(); \
-			mFullCommand = ""; \
-			return false; \
-		} \
-		if( ASSIGN ) var = value; \
-		if( writeMode == VARIABLE_VERBOSE && allowOutput ) \
-		{ \
-			if( !this->plotterMode ) this->stream.print( "{\"" ); \
-			this->stream.print( key ); \
-			this->stream.print( this->plotterMode ? ":" : "\": " ); \
-			PRINT_STATEMENT; \
-			this->stream.println( this->plotterMode ? "" : "}" ); \
-			this->stream.flush(); \
-		} \
-		mFullCommand = ""; \
-		return true; \
-	}
-
-// Now let us use the above macros to define multiple polymorphisms, supporting different variable TYPEs, of:
-// bool variable( const char * key, TYPE & referenceToVariable,  KeyholeWriteMode mode=VARIABLE_SILENT );
-// (mode can be VARIABLE_READ_ONLY, VARIABLE_SILENT or VARIABLE_VERBOSE)
-
-///////////////////////////////////////////////////////////////////////////////
-_START_VARIABLE_PROCESSOR( String,         this->printLiteral( var ),  false )
-	char quote = *commandPtr++; commandLength--;
-	if( quote != '"' && quote != '\'' ) remainder = &mBad;
-	else
+_DEFINE_LSHIFT( const char *           )
+_DEFINE_LSHIFT( const Kfmt &           )
+_DEFINE_LSHIFT( const String &         )
+_DEFINE_LSHIFT( const char &           )
+_DEFINE_LSHIFT( const int8_t &         )
+_DEFINE_LSHIFT( const bool &           )
+_DEFINE_LSHIFT( const unsigned char &  )
+_DEFINE_LSHIFT( const int &            )
+_DEFINE_LSHIFT( const unsigned int &   )
+_DEFINE_LSHIFT( const short &          )
+_DEFINE_LSHIFT( const unsigned short & )
+_DEFINE_LSHIFT( const long &           )
+_DEFINE_LSHIFT( const unsigned long &  )
+_DEFINE_LSHIFT( const float &          )
+_DEFINE_LSHIFT( const double &         )
+
+bool Keyhole::_variable( const char * key, void * address, KeyholeType type, unsigned char count, KeyholeWriteMode writeMode )
+{
+	// The engine behind every variable() template (and behind begin()'s dispatch of registered variables). The templates
+	// only work out the `type`, and the `count` of elements if it is an array (otherwise 0), so all the parsing, printing
+	// and error handling below is compiled once rather than once per type.
+	if( mNumberOfVariables && !mDispatching ) { int registered = _registeredVariable( address ); if( registered >= 0 ) return mVariables[ registered ].assigned; } // begin() has already dealt with it
+	bool allowOutput = !this->plotterMode || ( type != KEYHOLE_STRING && type != KEYHOLE_STATISTICS && !count ); // the Serial Plotter only understands single numbers
+	bool assigned = false;
+	bool report = ( mListAllVariables && type != KEYHOLE_STATISTICS && _listing( _valueHash( address, type, count ) ) ) | ( mDue && _due( hash( key, strlen( key ) ) ) ); // not || because _due() must consume the subscription
+	if( mUnconfirmed ) _confirmSubscription( hash( key, strlen( key ) ) );
+	for( unsigned char commandIndex = 0; commandIndex < mNumberOfCommands; commandIndex++ ) // zero iterations on a typical loop, when nothing has been received
 	{
-		while( commandLength && isspace( commandPtr[ commandLength - 1 ] ) ) commandLength--; // trim trailing space
-		if( !commandLength || commandPtr[ commandLength - 1 ] != quote ) remainder = &mBad;
+		unsigned int commandLength;
+		int element = -1;
+		const char * commandPtr = _parseVariableCommand( key, commandIndex, commandLength, count ? &element : NULL ); // this quickly returns NULL if the command has been matched already
+		if( !commandPtr ) continue;
+		mTag = mCommands[ commandIndex ].tag; // a tagged command gets a line of its own, which uses up mTag
+		if( !*commandPtr && mTag >= 0 ) { this->_startTaggedReply( key ); _printValue( address, type, count ); this->output.println( F( "}" ) ); continue; }
+		if( !*commandPtr ) { report = true; continue; }
+		if( writeMode == VARIABLE_READ_ONLY ) { this->_startError( F( "ReadOnly" ) ); this->output.print( F( "\"cannot change the '" ) ); this->output.print( key ); this->output.println( F( "' variable because it is read-only\"}" ) ); continue; }
+		if( !_parseValue( commandPtr, commandLength, address, type, element, count ) ) { _badValue( key, type, element, count ); continue; }
+		assigned = true;
+		if( mTag >= 0 && mDispatching ) { mCommands[ commandIndex ].acknowledge = mDispatchIndex; mTag = -1; } // end() answers it, unless the sketch reject()s the value first
+		else if( mTag >= 0 && writeMode == VARIABLE_VERBOSE ) { this->_startTaggedReply( key ); _printValue( address, type, count ); this->output.println( F( "}" ) ); }
+		else if( mTag >= 0 ) this->_acknowledgeTag();
+		else if( writeMode == VARIABLE_VERBOSE ) report = true;
+	}
+	mTag = -1;
+	if( report && allowOutput ) { this->_startReplyItem( key ); _printValue( address, type, count ); } // each key appears at most once, with its final value
+	return assigned;
+}
+
+bool Keyhole::_parseValue( const char * text, unsigned int length, void * address, KeyholeType type, int element, unsigned char count )
+{
+	// Interpret the `length` characters after "key=" (or "key[element]=") and, only if all of it makes sense, assign it.
+	if( count && element < 0 ) return _parseArray( text, NULL, type, count ) && _parseArray( text, address, type, count ); // check it all, then assign it all
+	if( count && element >= count ) return false;
+#if KEYHOLE_STATS
+	if( type == KEYHOLE_STATISTICS ) return _resetStats( address, text );
+#endif
+	if( type == KEYHOLE_STRING || ( type == KEYHOLE_CHAR && *text == '\'' ) )
+	{
+		// Quoted values have already been unescaped, in begin(), so they may contain null characters: go by `length`.
+		char quote = *text++; length--;
+		if( quote != '"' && quote != '\'' ) return false;
+		while( length && isspace( text[ length - 1 ] ) ) length--; // trim trailing space
+		if( !length || text[ length - 1 ] != quote ) return false;
+		length--; // remove closing quote
+		if( type == KEYHOLE_CHAR ) { if( length != 1 ) return false; ( ( char * )address )[ element < 0 ? 0 : element ] = *text; return true; }
+		// Note that some boards mess up copying `string2 = string1;` if `string1` contains null characters, and that
+		// some boards do not have a `String(ptr,length)` constructor.
+		assignString( *( String * )address, text, length, false );
+		return true;
+	}
+	union { long l; double d; } scratch; // parse into here first, so that the variable is untouched if parsing fails
+	char * remainder = NULL;
+	if( !_parseElement( text, &remainder, &scratch, type, 0 ) ) return false;
+	while( isspace( *remainder ) ) remainder++;
+	if( *remainder ) return false;
+	unsigned int size = _typeSize( type );
+	memcpy( ( char * )address + ( element < 0 ? 0 : element ) * size, &scratch, size );
+	return true;
+}
+
+bool Keyhole::_parseArray( const char * text, void * array, KeyholeType type, unsigned char count )
+{
+	// Parse "[a, b, c]" with exactly `count` elements. If `array` is NULL, only check that it can be parsed.
+	while( isspace( *text ) ) text++;
+	if( *text++ != '[' ) return false;
+	for( unsigned char i = 0; i < count; i++ )
+	{
+		char * remainder = NULL;
+		if( !_parseElement( text, &remainder, array, type, i ) ) return false;
+		while( isspace( *remainder ) ) remainder++;
+		if( *remainder != ( ( i + 1 < count ) ? ',' : ']' ) ) return false;
+		text = remainder + 1;
+	}
+	while( isspace( *text ) ) text++;
+	return !*text;
+}
+
+static bool _integerFits( KeyholeType type, unsigned long magnitude, bool negative )
+{
+	// Is the number in the range of the given integer type? (Plain char is signed or unsigned depending on the architecture.)
+	bool isSigned = ( type == KEYHOLE_INT8 || type == KEYHOLE_INT || type == KEYHOLE_SHORT || type == KEYHOLE_LONG || ( type == KEYHOLE_CHAR && ( char )-1 < 0 ) );
+	unsigned int bits = 8 * _typeSize( type );
+	unsigned long maximum = ( bits >= 8 * sizeof( unsigned long ) ) ? ~0UL : ( 1UL << bits ) - 1;
+	if( isSigned ) maximum >>= 1;
+	if( negative ) return magnitude == 0 || ( isSigned && magnitude <= maximum + 1 );
+	return magnitude <= maximum;
+}
+
+static bool _matchWord( const char * text, const char * word )
+{
+	// Case-insensitive comparison of the start of `text` with the lowercase `word` (which is in flash).
+	for( char c; ( c = pgm_read_byte( word ) ) != '\0'; word++ ) if( tolower( *text++ ) != c ) return false;
+	return true;
+}
+
+#define _STORE_ELEMENT( TYPE, TYPE_CODE, VALUE )   case TYPE_CODE: ( ( TYPE * )array )[ i ] = ( TYPE )( VALUE ); break;
+bool Keyhole::_parseElement( const char * text, char ** remainder, void * array, KeyholeType type, unsigned char i )
+{
+	// Parse one number (or true/false) at `text`, leaving `*remainder` just after it, and store it as array[i] unless
+	// `array` is NULL. Numbers that are out of range for the type are rejected rather than wrapped or truncated.
+	while( isspace( *text ) ) text++;
+	*remainder = NULL;
+	if( type == KEYHOLE_BOOL )
+	{
+		// true, false, 1 or 0, and nothing else (not -1, 2 or 0x1)
+		bool value = ( ( *text | 0x20 ) == 't' || *text == '1' );
+		if(      _matchWord( text, PSTR( "true" ) ) || _matchWord( text, PSTR( "false" ) ) ) *remainder = ( char * )text + ( value ? 4 : 5 );
+		else if( *text == '0' || *text == '1' ) *remainder = ( char * )text + 1;
+		else return false;
+		if( array ) ( ( bool * )array )[ i ] = value;
+		return true;
+	}
+	if( type == KEYHOLE_FLOAT || type == KEYHOLE_DOUBLE )
+	{
+		double value;
+		if( text[ 0 ] == '0' && ( text[ 1 ] == 'x' || text[ 1 ] == 'X' || text[ 1 ] == 'b' || text[ 1 ] == 'B' ) ) value = strToSignedInteger( text, remainder );
+		else if( !parseDecimal( text, remainder, value ) ) return false;
+		if( *remainder == text ) return false;
+		if( type == KEYHOLE_FLOAT && !isinf( value ) && ( value > FLT_MAX || value < -FLT_MAX ) ) return false;
+		if( array && type == KEYHOLE_FLOAT ) ( ( float * )array )[ i ] = ( float )value;
+		if( array && type == KEYHOLE_DOUBLE ) ( ( double * )array )[ i ] = value;
+		return true;
+	}
+	unsigned long magnitude;
+	bool negative;
+	if( !parseInteger( text, remainder, magnitude, negative ) || !_integerFits( type, magnitude, negative ) ) return false;
+	if( !array ) return true;
+	long value = negative ? ( long )( 0UL - magnitude ) : ( long )magnitude; // (only used for the signed types, so always in range)
+	switch( type )
+	{
+		_STORE_ELEMENT( char,           KEYHOLE_CHAR,   value          )
+		_STORE_ELEMENT( int8_t,         KEYHOLE_INT8,   value          )
+		_STORE_ELEMENT( unsigned char,  KEYHOLE_UCHAR,  magnitude      )
+		_STORE_ELEMENT( int,            KEYHOLE_INT,    value          )
+		_STORE_ELEMENT( unsigned int,   KEYHOLE_UINT,   magnitude      )
+		_STORE_ELEMENT( short,          KEYHOLE_SHORT,  value          )
+		_STORE_ELEMENT( unsigned short, KEYHOLE_USHORT, magnitude      )
+		_STORE_ELEMENT( long,           KEYHOLE_LONG,   value          )
+		_STORE_ELEMENT( unsigned long,  KEYHOLE_ULONG,  magnitude      )
+		default: return false;
+	}
+	return true;
+}
+
+#define PRINT_FLOAT( X )   this->printLiteral( X, this->plotterMode ? '\0' : '"', sizeof( X ) < sizeof( double ) )
+#define _PRINT_VALUE( TYPE, TYPE_CODE, PRINT )   case TYPE_CODE: PRINT( *( const TYPE * )address ); break;
+void Keyhole::_printValue( const void * address, KeyholeType type, unsigned char count )
+{
+	if( count )
+	{
+		this->output.print( F( "[" ) );
+		for( unsigned char i = 0; i < count; i++ )
+		{
+			if( i ) this->output.print( F( ", " ) );
+			_printValue( ( const char * )address + i * _typeSize( type ), type, 0 );
+		}
+		this->output.print( F( "]" ) );
+		return;
+	}
+	switch( type )
+	{
+		_PRINT_VALUE( bool,           KEYHOLE_BOOL,   this->output.print )
+		_PRINT_VALUE( char,           KEYHOLE_CHAR,   this->printLiteral )
+		_PRINT_VALUE( int8_t,         KEYHOLE_INT8,   this->output.print )
+		_PRINT_VALUE( unsigned char,  KEYHOLE_UCHAR,  this->output.print )
+		_PRINT_VALUE( int,            KEYHOLE_INT,    this->output.print )
+		_PRINT_VALUE( unsigned int,   KEYHOLE_UINT,   this->output.print )
+		_PRINT_VALUE( short,          KEYHOLE_SHORT,  this->output.print )
+		_PRINT_VALUE( unsigned short, KEYHOLE_USHORT, this->output.print )
+		_PRINT_VALUE( long,           KEYHOLE_LONG,   this->output.print )
+		_PRINT_VALUE( unsigned long,  KEYHOLE_ULONG,  this->output.print )
+		_PRINT_VALUE( float,          KEYHOLE_FLOAT,  PRINT_FLOAT )
+		_PRINT_VALUE( double,         KEYHOLE_DOUBLE, PRINT_FLOAT )
+		_PRINT_VALUE( String,         KEYHOLE_STRING, this->printLiteral )
+#if KEYHOLE_STATS
+		case KEYHOLE_STATISTICS: _printStats( address ); break;
+#endif
+	}
+}
+
+void Keyhole::_badValue( const char * key, KeyholeType type, int element, unsigned char count )
+{
+	this->_startError( F( "BadValue" ) );
+	this->output.print( F( "\"failed to interpret argument as " ) );
+	if( count && element >= 0 ) this->output.print( F( "an element of " ) );
+	else if( count ) { this->output.print( F( "a list of " ) ); this->output.print( count ); this->output.print( F( " values of " ) ); }
+	this->output.print( F( "type '" ) );
+	_printName( this->output, _typeNames, type );
+	this->output.print( F( "' when setting the '" ) );
+	this->output.print( key );
+	this->output.println( F( "' variable\"}" ) );
+}
+
+int Keyhole::_expose( const char * key, void * address, KeyholeType type, KeyholeWriteMode mode, unsigned char count )
+{
+	unsigned int keyLength = strlen( key );
+	int variableIndex = _findVariable( key, keyLength ); // exposing the same key again just re-points it
+	if( variableIndex < 0 )
+	{
+		if( mNumberOfVariables - mReservedVariables >= KEYHOLE_MAX_VARIABLES ) return -1;
+		variableIndex = mNumberOfVariables++;
+		unsigned int h = hash( key, keyLength );
+		unsigned int slot = h % sizeof( mVariableIndex ); // probed from here in the same order as _findVariable()
+		while( mVariableIndex[ slot ] ) slot = ( slot + 1 ) % sizeof( mVariableIndex ); // the table is twice the size it needs to be, so there is always a free slot
+		mVariableIndex[ slot ] = variableIndex + 1;
+		mVariables[ variableIndex ].hash = h;
+	}
+	KeyholeVariable & v = mVariables[ variableIndex ];
+	v.key      = key;
+	v.address  = address;
+	v.type     = type;
+	v.mode     = mode;
+	v.count    = count;
+	v.assigned = false;
+	v.echo = false;
+	return variableIndex;
+}
+
+int Keyhole::_findVariable( const char * key, unsigned int keyLength )
+{
+	unsigned int h = hash( key, keyLength );
+	for( unsigned int probe = 0; probe < sizeof( mVariableIndex ); probe++ )
+	{
+		unsigned char entry = mVariableIndex[ ( h % sizeof( mVariableIndex ) + probe ) % sizeof( mVariableIndex ) ]; // (h + probe would wrap for hashes near the top of an unsigned int, which is only 16 bits on AVR)
+		if( !entry ) break;
+		KeyholeVariable & v = mVariables[ entry - 1 ];
+		if( v.hash == h && strncmp( v.key, key, keyLength ) == 0 && !v.key[ keyLength ] ) return entry - 1;
+	}
+	return -1;
+}
+
+int Keyhole::_registeredIndex( const char * command, int * length )
+{
+	// Parse the "@N" at the start of a command: return N if it is a valid index into mVariables, otherwise -1.
+	int n = 0, i = 1;
+	if( !isdigit( command[ i ] ) ) return -1;
+	while( isdigit( command[ i ] ) && n < KEYHOLE_MAX_VARIABLES + KEYHOLE_RESERVED_VARIABLES ) n = n * 10 + command[ i++ ] - '0';
+	if( isdigit( command[ i ] ) || n >= mNumberOfVariables ) return -1;
+	if( length ) *length = i;
+	return n;
+}
+
+int Keyhole::_registeredVariable( const void * address )
+{
+	for( unsigned char i = 0; i < mNumberOfVariables; i++ ) if( mVariables[ i ].address == address ) return i;
+	return -1;
+}
+
+bool Keyhole::assigned( const void * address )
+{
+	for( unsigned char i = 0; i < mNumberOfVariables; i++ ) if( mVariables[ i ].address == address && mVariables[ i ].assigned ) return true;
+	return false;
+}
+
+bool Keyhole::_assigned( const void * address, unsigned char count )
+{
+	for( unsigned char i = 0; i < mNumberOfVariables; i++ ) if( mVariables[ i ].address == address && mVariables[ i ].count == count && mVariables[ i ].assigned ) return true;
+	return false;
+}
+
+void Keyhole::_dispatchRegistered( void )
+{
+	// A "?" listing visits every registered variable; otherwise only the variables that the batch refers to are visited.
+	if( mListAllVariables ) { for( unsigned char i = 0; i < mNumberOfVariables; i++ ) _dispatch( i ); return; }
+	if( mDue ) for( unsigned char i = 0; i < mNumberOfVariables; i++ ) if( _due( mVariables[ i ].hash, false ) ) _dispatch( i );
+	for( unsigned char i = 0; i < mNumberOfCommands; i++ )
+	{
+		if( !mCommands[ i ].pending ) continue; // already handled along with an earlier command for the same key
+		const char * command = _bufferData() + mCommands[ i ].start;
+		int variableIndex;
+		if( *command == '@' ) variableIndex = _registeredIndex( command, NULL ); // no lookup needed
 		else
 		{
-			commandLength--; // remove closing quote
-			// At this point we know parsing has succeeded, so now let's assign directly to `var`, skipping the
-			// intermediate step from `value` that the other variable() polymorphs do. Anyway note that some
-			// boards mess up copying `string2 = string1;` if `string1` contains null characters, and that some
-			// boards do not have a `String(ptr,length)` constructor.
-			assignString( var, commandPtr, commandLength, false );
+			unsigned int keyLength = 0;
+			while( command[ keyLength ] && command[ keyLength ] != '=' && command[ keyLength ] != '[' && !isspace( command[ keyLength ] ) ) keyLength++;
+			variableIndex = _findVariable( command, keyLength );
 		}
+		if( variableIndex >= 0 ) _dispatch( variableIndex );
 	}
-_END_VARIABLE_PROCESSOR(   String,         this->printLiteral( var ), false )
-///////////////////////////////////////////////////////////////////////////////
-_START_VARIABLE_PROCESSOR( char,           this->printLiteral( var ),  true )
-	value = '\0';
-	char quote = '\'';
-	if( *commandPtr == quote )
-	{
-		while( commandLength && isspace( commandPtr[ commandLength - 1 ] ) ) commandLength--; // trim trailing space
-		commandPtr++; commandLength--; // skip opening quote
-		if( commandLength == 2 && commandPtr[ 1 ] == quote ) value = commandPtr[ 0 ]; // check for closing quote and take the payload (it will already have been unescaped, in begin())
-		else remainder = &mBad;
-	}
-	else value = strToSignedInteger( commandPtr, &remainder );
-_END_VARIABLE_PROCESSOR(   char,           this->printLiteral( var ),  true )
-///////////////////////////////////////////////////////////////////////////////
-_START_VARIABLE_PROCESSOR( bool,           this->stream.print( var ),  true )
-	value = strToUnsignedInteger( commandPtr, &remainder );
-	if( remainder )
-	{
-		String s; assignString( s, commandPtr, commandLength, false, true );
-		if(      s == "true"  ) { value = true;  remainder = NULL; }
-		else if( s == "false" ) { value = false; remainder = NULL; }
-	}
-_END_VARIABLE_PROCESSOR(   bool,           this->stream.print( var ),  true )
-///////////////////////////////////////////////////////////////////////////////
-#define PRINT_FLOAT( X )   this->printLiteral( X, this->plotterMode ? '\0' : '"' )
-_START_VARIABLE_PROCESSOR( int8_t,         this->stream.print( var ),  true )   value = strToSignedInteger(   commandPtr, &remainder );   _END_VARIABLE_PROCESSOR(   int8_t,         this->stream.print( var ),       true )
-_START_VARIABLE_PROCESSOR( unsigned char,  this->stream.print( var ),  true )   value = strToUnsignedInteger( commandPtr, &remainder );   _END_VARIABLE_PROCESSOR(   unsigned char,  this->stream.print( var ),       true )
-_START_VARIABLE_PROCESSOR( int,            this->stream.print( var ),  true )   value = strToSignedInteger(   commandPtr, &remainder );   _END_VARIABLE_PROCESSOR(   int,            this->stream.print( var ),       true )
-_START_VARIABLE_PROCESSOR( unsigned int,   this->stream.print( var ),  true )   value = strToUnsignedInteger( commandPtr, &remainder );   _END_VARIABLE_PROCESSOR(   unsigned int,   this->stream.print( var ),       true )
-_START_VARIABLE_PROCESSOR( short,          this->stream.print( var ),  true )   value = strToSignedInteger(   commandPtr, &remainder );   _END_VARIABLE_PROCESSOR(   short,          this->stream.print( var ),       true )
-_START_VARIABLE_PROCESSOR( unsigned short, this->stream.print( var ),  true )   value = strToUnsignedInteger( commandPtr, &remainder );   _END_VARIABLE_PROCESSOR(   unsigned short, this->stream.print( var ),       true )
-_START_VARIABLE_PROCESSOR( long,           this->stream.print( var ),  true )   value = strToSignedInteger(   commandPtr, &remainder );   _END_VARIABLE_PROCESSOR(   long,           this->stream.print( var ),       true )
-_START_VARIABLE_PROCESSOR( unsigned long,  this->stream.print( var ),  true )   value = strToUnsignedInteger( commandPtr, &remainder );   _END_VARIABLE_PROCESSOR(   unsigned long,  this->stream.print( var ),       true )
-_START_VARIABLE_PROCESSOR( float,          PRINT_FLOAT( var ),         true )   value = ( float )strToDouble( commandPtr, &remainder );   _END_VARIABLE_PROCESSOR(   float,          PRINT_FLOAT( var ),              true )
-_START_VARIABLE_PROCESSOR( double,         PRINT_FLOAT( var ),         true )   value = strToDouble(          commandPtr, &remainder );   _END_VARIABLE_PROCESSOR(   double,         PRINT_FLOAT( var ),              true )
-///////////////////////////////////////////////////////////////////////////////
+}
 
+void Keyhole::_dispatch( unsigned char variableIndex )
+{
+	KeyholeVariable & v = mVariables[ variableIndex ];
+	mDispatching = true;
+	mDispatchIndex = variableIndex;
+	bool assigned = this->_variable( v.key, v.address, ( KeyholeType )v.type, v.count, ( KeyholeWriteMode )v.mode );
+	mDispatching = false;
+	if( assigned ) v.assigned = true;
+}
 
 bool Keyhole::end( void )
 {
-	if( mListAllVariables ) { this->stream.println( this->plotterMode ? "" : "}" ); this->stream.flush(); mListAllVariables = 0; }
-	if( mFullCommand.length() ) { this->error( "failed to recognize command", "BadKey" ); mFullCommand = ""; return true; }
-	return false;
+	bool unrecognized = false;
+#if KEYHOLE_STATS
+	unsigned long endMicros = micros();
+	if( mActive ) mDispatchStats.record( endMicros - mDispatchMicros );
+#endif
+	for( unsigned char i = 0; i < mNumberOfCommands; i++ )
+	{
+		int acknowledge = mCommands[ i ].acknowledge;
+		if( acknowledge >= 0 )
+		{
+			// A tagged assignment to a registered variable that the sketch has not reject()ed
+			KeyholeVariable & v = mVariables[ acknowledge ];
+			mTag = mCommands[ i ].tag;
+			if( v.mode == VARIABLE_VERBOSE ) { this->_startTaggedReply( v.key ); _printValue( v.address, ( KeyholeType )v.type, v.count ); this->output.println( F( "}" ) ); }
+			else this->_acknowledgeTag();
+			continue;
+		}
+		if( !mCommands[ i ].pending ) continue;
+		_STAT( mLatencyStats.record( endMicros - mCommands[ i ].receivedMicros ) ); // an unrecognized command is dealt with here
+		mTag = mCommands[ i ].tag;
+		this->_startError( F( "BadKey" ) );
+		this->output.print( F( "\"failed to recognize command\"" ) );
+		this->output.println( F( "}" ) );
+		unrecognized = true;
+	}
+	if( mUnconfirmed ) { _rejectUnconfirmedSubscriptions(); unrecognized = true; }
+	for( ; mOverflows; mOverflows-- )
+	{
+		this->_startError( F( "BufferOverflow" ) );
+		this->output.print( F( "\"command exceeded the " ) );
+		this->output.print( KEYHOLE_BUFFER_SIZE - 1 );
+		this->output.println( F( "-character limit and was discarded\"}" ) );
+		unrecognized = true;
+	}
+	for( unsigned char i = 0; i < mNumberOfVariables; i++ )
+	{
+		if( mVariables[ i ].echo ) _sendValue( i );
+		mVariables[ i ].assigned = mVariables[ i ].echo = false;
+	}
+	if( mListTag >= 0 ) { mTag = mListTag; mListTag = -1; this->_acknowledgeTag(); } // a "?" with nothing to list
+	mListAllVariables = 0;
+	mListIndex = 0;
+	mDue = 0;
+	mFrames = 0;
+	this->_endReply();
+	this->_sendOutput(); // one write(), and at most one flush, for the whole batch
+	this->_discardCommands();
+#if KEYHOLE_STATS
+	if( mActive ) mOutputStats.record( micros() - endMicros );
+#endif
+	mActive = false;
+	return unrecognized;
 }
 
 void Keyhole::error( const String & msg, const String & type )
 {
-	_startError( type );
-	this->printLiteral( msg, '"' );
-	this->stream.println( "}" );
-	this->stream.flush();
+	if( mBinary ) _errorFrame( 0, msg );
+	else
+	{
+		_startError( type );
+		this->printLiteral( msg, '"' );
+		this->output.println( F( "}" ) );
+	}
+	if( !mActive ) this->_sendOutput(); // otherwise end() will send it
+}
+
+void Keyhole::reject( const void * address, const String & msg, const String & type )
+{
+	// Each tagged command that assigned to the variable gets the error under its tag, instead of the acknowledgement
+	// that end() would have sent; if there is none, this is just error() (in the binary protocol, an error frame that
+	// names the variable, instead of the VALUE frame that end() would have sent for a verbose one).
+	bool rejected = false;
+	for( unsigned char i = 0; i < mNumberOfCommands; i++ )
+	{
+		int acknowledge = mCommands[ i ].acknowledge;
+		if( acknowledge < 0 || mVariables[ acknowledge ].address != address ) continue;
+		mCommands[ i ].acknowledge = -1;
+		mTag = mCommands[ i ].tag;
+		this->error( msg, type );
+		rejected = true;
+	}
+	if( rejected ) return;
+	int index = _registeredVariable( address );
+	if( mBinary && index >= 0 )
+	{
+		for( unsigned char i = 0; i < mNumberOfVariables; i++ ) if( mVariables[ i ].address == address ) mVariables[ i ].echo = false;
+		_errorFrame( index, msg );
+		if( !mActive ) this->_sendOutput();
+	}
+	else this->error( msg, type );
+}
+
+void Keyhole::_errorFrame( unsigned char index, const String & msg )
+{
+	// A text line would corrupt the stream of frames: the message goes in the payload of an error frame instead
+	unsigned int length = msg.length();
+	if( length > KEYHOLE_MAX_FRAME - 5 ) length = KEYHOLE_MAX_FRAME - 5;
+	_sendFrame( KEYHOLE_FRAME_ERROR, index, KEYHOLE_FRAME_BAD_VALUE, msg.c_str(), length );
+}
+
+void Keyhole::_startError( const __FlashStringHelper * type )
+{
+	// Keyhole's own error types are plain words, so they need no escaping.
+	this->_openError();
+	this->output.print( '"' );
+	this->output.print( type );
+	this->output.print( F( "\", \"_KEYHOLE_ERROR_MSG\": " ) );
 }
 
 void Keyhole::_startError( const String & type )
 {
-	this->stream.print( "{\"_KEYHOLE_ERROR_TYPE\": ");
+	this->_openError();
 	this->printLiteral( type, '"' );
-	this->stream.print( ", \"_KEYHOLE_ERROR_MSG\": " );
+	this->output.print( F( ", \"_KEYHOLE_ERROR_MSG\": " ) );
+}
+
+void Keyhole::_openError( void )
+{
+	this->_endReply(); // an error gets a line of its own, so close any reply that is still open
+	mOutputPending = true;
+	_STAT( mErrorCount++ );
+	this->output.print( F( "{" ) );
+	if( mTag >= 0 ) { this->output.print( F( "\"_KEYHOLE_TAG\": " ) ); this->output.print( mTag ); this->output.print( F( ", " ) ); mTag = -1; }
+	this->output.print( F( "\"_KEYHOLE_ERROR_TYPE\": " ) );
+}
+
+void Keyhole::_startReplyItem( const char * key )
+{
+	// All the values reported between begin() and end() - whether listed, queried or verbosely assigned - are
+	// gathered into a single JSON dictionary (or a single Serial-Plotter line) which end() closes.
+	mOutputPending = true;
+	if( this->plotterMode ) { if( mReplyItems++ ) this->output.print( ',' ); }
+	else if( mReplyItems++ ) this->output.print( F( ", \"" ) );
+	else if( mListTag >= 0 ) { this->output.print( F( "{\"_KEYHOLE_TAG\": " ) ); this->output.print( mListTag ); this->output.print( F( ", \"" ) ); mListTag = -1; }
+	else                    this->output.print( F( "{\"" ) );
+	this->output.print( key );
+	this->output.print( this->plotterMode ? F( ":" ) : F( "\": " ) );
+}
+
+void Keyhole::_startTaggedReply( const char * key )
+{
+	// Tagged replies are not merged into the combined reply: each one gets a line of its own, so the host can match it up.
+	this->_endReply();
+	mOutputPending = true;
+	this->output.print( F( "{\"_KEYHOLE_TAG\": " ) );
+	this->output.print( mTag );
+	if( key ) { this->output.print( F( ", \"" ) ); this->output.print( key ); this->output.print( F( "\": " ) ); }
+	mTag = -1;
+}
+
+void Keyhole::_startTaggedReply( const __FlashStringHelper * key )
+{
+	this->_startTaggedReply( ( const char * )NULL );
+	this->output.print( F( ", \"" ) );
+	this->output.print( key );
+	this->output.print( F( "\": " ) );
+}
+
+void Keyhole::_acknowledgeTag( void )
+{
+	// If the current command was tagged and nothing has answered it yet, say that it has been accepted.
+	if( mTag < 0 ) return;
+	this->_startTaggedReply( ( const char * )NULL );
+	this->output.println( F( "}" ) );
 }
 
+void Keyhole::_endReply( void )
+{
+	if( !mReplyItems ) return;
+	if( this->plotterMode ) this->output.println();
+	else                    this->output.println( F( "}" ) );
+	mReplyItems = 0;
+}
+
+void Keyhole::_sendOutput( void )
+{
+	if( !this->output.send() )
+	{
+		// Lines of a reply (or automatic report) did not fit in the queue: say so, rather than leave the host waiting for them
+		if( mBinary ) _sendFrame( KEYHOLE_FRAME_ERROR, 0, KEYHOLE_FRAME_TOO_LONG, NULL, 0 );
+		else
+		{
+			this->_startError( F( "BufferOverflow" ) );
+			this->output.print( F( "\"reply overflowed the " ) );
+			this->output.print( KEYHOLE_OUTPUT_SIZE );
+			this->output.println( F( "-byte output queue\"}" ) );
+		}
+		this->output.send();
+	}
+	if( mOutputPending && this->flushAfterReply && this->output.mode == KEYHOLE_OUTPUT_BLOCKING ) this->stream.flush();
+	mOutputPending = false;
+}
+
+void Keyhole::_discardCommands( void )
+{
+	// Keep only the partial command (if any) that follows the last terminator, moving it to the front of the buffer.
+	unsigned int partialLength = _bufferLength() - mPartialStart;
+#if KEYHOLE_BUFFER_SIZE > 0
+	if( mPartialStart ) memmove( mBuffer, mBuffer + mPartialStart, partialLength );
+	mBufferLength = partialLength;
+#else
+	if( mPartialStart ) for( unsigned int i = 0; i < partialLength; i++ ) mBuffer.setCharAt( i, mBuffer[ mPartialStart + i ] );
+	mBuffer.remove( partialLength );
+#endif
+	mPartialStart = 0;
+	mNumberOfCommands = 0;
+}
+
+#if KEYHOLE_BUFFER_SIZE > 0
+// Fixed-capacity buffer: no heap, ever. The last byte is held back so that a command can always be null-terminated.
+bool         Keyhole::_append( char c )              { if( mBufferLength + 1 >= KEYHOLE_BUFFER_SIZE ) { mOverflow = true; return false; } mBuffer[ mBufferLength++ ] = c; return true; }
+void         Keyhole::_terminate( void )              { mBuffer[ mBufferLength++ ] = '\0'; }
+void         Keyhole::_truncate( unsigned int length ) { mBufferLength = length; }
+unsigned int Keyhole::_bufferLength( void )           { return mBufferLength; }
+const char * Keyhole::_bufferData( void )             { return mBuffer; }
+#else
+// Dynamically-growing String buffer (KEYHOLE_BUFFER_SIZE 0): never overflows, but allocates as it grows.
+bool         Keyhole::_append( char c )              { mBuffer += c; return true; }
+void         Keyhole::_terminate( void )              { mBuffer += '\0'; }
+void         Keyhole::_truncate( unsigned int length ) { mBuffer.remove( length ); }
+unsigned int Keyhole::_bufferLength( void )           { return mBuffer.length(); }
+const char * Keyhole::_bufferData( void )             { return mBuffer.c_str(); }
+#endif
 
 unsigned long Keyhole::elapsedMicros( void )
 {
 	// NB: result will not be valid unless you passed a valid micros() reading to .begin()
+	// The figures below predate batching, expose() and the staged output: `make -C host bench` measures the current code on a PC.
 	// With 6 integer variables and 2 commands, on a 2021 Raspberry Pi Pico:
 	// * around 600 microseconds to process and respond to the "?" command and print all variable values
 	// * 230-260 microseconds overhead on a loop in which an integer variable() value was assigned (without verbose response)
@@ -298,89 +1297,116 @@ unsigned long Keyhole::elapsedMicros( void )
 	return micros() - mBeginMicros;
 }
 	
-void Keyhole::printLiteral( double f, char withQuotes )
+void Keyhole::printLiteral( double f, char withQuotes, bool singlePrecision )
 {
-	double z = f;
-	z *= 0.0;
-	const int precision = 4;
-	if( z == 0.0 )
-	{
-		this->stream.print( f, precision ); // still no quotes, that's intentional - we only need them for non-numeric-looking renderings
-		// TODO: a couple of things are missing:
-		//       - support for scientific notation (you get "ovr" if the number gets too large)
-		//       - intelligent variation in precision (like printf %g)
-	}
-	else
+	printLiteral( this->output, f, withQuotes, singlePrecision );
+	if( !mActive ) this->output.send(); // outside begin()/end() nobody else will send it
+}
+void Keyhole::printLiteral( char c, char withQuotes )
+{
+	printLiteral( this->output, c, withQuotes );
+	if( !mActive ) this->output.send(); // outside begin()/end() nobody else will send it
+}
+void Keyhole::printLiteral( const String & s, char withQuotes )
+{
+	printLiteral( this->output, s.c_str(), s.length(), withQuotes );
+	if( !mActive ) this->output.send(); // outside begin()/end() nobody else will send it
+}
+
+void Keyhole::printLiteral( Print & out, double f, char withQuotes, bool singlePrecision )
+{
+	char text[ DECIMAL_BUFFER_SIZE ];
+	formatDecimal( text, f, singlePrecision );
+	if( isinf( f ) || isnan( f ) )
 	{
 		// we're in inf and nan territory now - that's where we need quotes, to keep JSON/Python happy
 		if( ( unsigned char )withQuotes > 127 ) withQuotes = '\0';
-		this->stream.print( withQuotes );
-		if(      f < 0 ) this->stream.print( "-inf" ); // this works around a bug whereby (some architectures?) 
-		else if( f > 0 ) this->stream.print(  "inf" ); // render -inf as just "inf" (even though you can show
-		else this->stream.print( f, precision );       // that they know it is < 0)
-		this->stream.print( withQuotes );
+		if( withQuotes ) out.print( withQuotes );
+		out.print( text );
+		if( withQuotes ) out.print( withQuotes );
 	}
+	else out.print( text ); // still no quotes, that's intentional - we only need them for non-numeric-looking renderings
 }
 
-void Keyhole::printLiteral( char c, char withQuotes )
+void Keyhole::printLiteral( Print & out, char c, char withQuotes )
 {	
 	if( withQuotes == ( char )-1 )
 	{
 		// This option prints 97 rather than  a  or  'a'  or  "a"   and 9 rather than  \t  or  '\t'  or  "\t" 
 		// which is legal everywhere and reflects the fact that char is the same thing as int8_t or uint8_t
-		this->stream.print( ( int )c );
+		out.print( ( int )c );
 	}
 	else
 	{
 		// This option prints  a  or  'a'  or  "a"   and   \t  or  '\t'  or  "\t"  depending on whether you
 		// set withQuotes to '\0' or '\'' or '"'
 		// Note that only the double-quote option is legal in JSON.
-
-		//this->printLiteral( String( &c, 1 ), withQuotes ); return;
-		// but unfortunately the String(ptr,n) constructor is not supported on all architectures, so instead:
-		String s; s += c; this->printLiteral( s, withQuotes );
+		printLiteral( out, &c, 1, withQuotes );
 	}
 	// The default is withQuotes=-1 to avoid problems on the other side: even with the double-quote option
 	// you would be creating a Python or Javascript object that behaves fundamentally differently from the
 	// way a char behaves in a sketch (i.e. as an int8_t or uint8_t, depending on processor architecture).
 }
-void Keyhole::printLiteral( const String & s, char withQuotes )
+
+void Keyhole::printLiteral( Print & out, const char * s, unsigned int length, char withQuotes )
 {
 	if( ( unsigned char )withQuotes > 127 ) withQuotes = '\0';
-	if( withQuotes ) this->stream.print( withQuotes );
-	for( unsigned int i = 0; i < s.length(); i++ )
+	if( withQuotes ) out.print( withQuotes );
+	for( unsigned int i = 0; i < length; i++ )
 	{
 		char c = s[ i ];
-		if(      c == '\t' ) this->stream.print( "\\t" );
-		else if( c == '\r' ) this->stream.print( "\\r" );
-		else if( c == '\n' ) this->stream.print( "\\n" );
-		else if( c == '\0' ) this->stream.print( "\\0" );
-		else if( c == '\\' ) this->stream.print( "\\\\" );
-		else if( c == withQuotes ) { this->stream.print( "\\" ); this->stream.print( withQuotes ); }
-		else if( isprint( c ) ) this->stream.print( c );
+		if(      c == '\t' ) out.print( F( "\\t" ) );
+		else if( c == '\r' ) out.print( F( "\\r" ) );
+		else if( c == '\n' ) out.print( F( "\\n" ) );
+		else if( c == '\0' ) out.print( F( "\\0" ) );
+		else if( c == '\\' ) out.print( F( "\\\\" ) );
+		else if( c == withQuotes ) { out.print( F( "\\" ) ); out.print( withQuotes ); }
+		else if( isprint( c ) ) out.print( c );
 		else
 		{
-			this->stream.print( "\\x" );
-			if( ( unsigned char )c < 16 ) this->stream.print( "0" );
-			this->stream.print( ( unsigned char )c, HEX );
+			out.print( F( "\\x" ) );
+			if( ( unsigned char )c < 16 ) out.print( F( "0" ) );
+			out.print( ( unsigned char )c, HEX );
 		}
 	}
-	if( withQuotes ) this->stream.print( withQuotes );
+	if( withQuotes ) out.print( withQuotes );
 }
 
-const char * Keyhole::_parseVariableCommand( const char * key, unsigned int & commandLength )
+const char * Keyhole::_parseVariableCommand( const char * key, unsigned char commandIndex, unsigned int & commandLength, int * element )
 {
-	commandLength = mFullCommand.length();
-	if( !commandLength ) return NULL;
-	const char * commandPtr = mFullCommand.c_str();
-	int keyLength = strlen( key );
-	if( strncmp( commandPtr, key, keyLength ) != 0 ) return NULL;
+	if( !mCommands[ commandIndex ].pending ) return NULL;
+	commandLength = mCommands[ commandIndex ].length;
+	const char * commandPtr = _bufferData() + mCommands[ commandIndex ].start;
+	int keyLength;
+	if( *commandPtr == '@' )
+	{
+		// "@N" addresses the Nth registered variable, which is only ever reached through _dispatch()
+		if( !mDispatching || _registeredIndex( commandPtr, &keyLength ) != mDispatchIndex ) return NULL;
+	}
+	else
+	{
+		keyLength = strlen( key );
+		if( strncmp( commandPtr, key, keyLength ) != 0 ) return NULL;
+	}
 	commandPtr += keyLength;
 	commandLength -= keyLength;
+	if( element ) *element = -1;
+	if( *commandPtr == '[' )
+	{
+		// "key[i]" addresses one element of an array variable (the caller passes `element` only for arrays)
+		char * end = NULL;
+		unsigned long i = isdigit( commandPtr[ 1 ] ) ? strtoul( commandPtr + 1, &end, 10 ) : 0;
+		if( !element || !end || *end != ']' ) return NULL;
+		*element = ( i < 256 ) ? ( int )i : 256;
+		commandLength -= end + 1 - commandPtr;
+		commandPtr = end + 1;
+	}
 	while( isspace( *commandPtr ) ) { commandPtr++; commandLength--; }
 	if( *commandPtr && *commandPtr++ != '=' ) return NULL;
 	if( commandLength ) commandLength--;
 	while( isspace( *commandPtr ) ) { commandPtr++; commandLength--; }
+	mCommands[ commandIndex ].pending = false; // matched: from here on, the caller deals with it
+	_STAT( mLatencyStats.record( micros() - mCommands[ commandIndex ].receivedMicros ) );
 	return commandPtr;
 }
 
@@ -406,25 +1432,263 @@ void Keyhole::assignString( String & dst, const char *ptr, unsigned int length,
 	}
 }
 
+unsigned int Keyhole::hash( const char * s, unsigned int length )
+{
+	unsigned int h = 5381; // djb2: cheap enough for an 8-bit processor, and good enough for a table of a dozen keys
+	while( length-- ) h = ( h << 5 ) + h + ( unsigned char )*s++;
+	return h;
+}
+
+unsigned int Keyhole::crc16( const uint8_t * data, unsigned int length )
+{
+	uint16_t crc = 0xFFFF; // CRC-16/CCITT-FALSE
+	while( length-- )
+	{
+		crc ^= ( uint16_t )( *data++ ) << 8;
+		for( uint8_t bit = 0; bit < 8; bit++ ) crc = ( crc & 0x8000 ) ? ( crc << 1 ) ^ 0x1021 : ( crc << 1 );
+	}
+	return crc;
+}
+
+bool Keyhole::parseInteger( const char * start, char ** endptr, unsigned long & magnitude, bool & negative )
+{
+	// One pass, no library calls: [whitespace][+|-][0x|0b]digits
+	const char * p = start;
+	while( isspace( *p ) ) p++;
+	negative = ( *p == '-' );
+	if( *p == '-' || *p == '+' ) p++;
+	unsigned char base = 10;
+	if(      p[ 0 ] == '0' && ( p[ 1 ] == 'x' || p[ 1 ] == 'X' ) && isxdigit( p[ 2 ] ) ) { base = 16; p += 2; }
+	else if( p[ 0 ] == '0' && ( p[ 1 ] == 'b' || p[ 1 ] == 'B' ) && ( p[ 2 ] == '0' || p[ 2 ] == '1' ) ) { base = 2; p += 2; }
+	const char * digits = p;
+	bool overflow = false;
+	magnitude = 0;
+	for( ; ; p++ )
+	{
+		unsigned char d;
+		if(      *p >= '0' && *p <= '9' ) d = *p - '0';
+		else if( *p >= 'a' && *p <= 'f' ) d = *p - 'a' + 10;
+		else if( *p >= 'A' && *p <= 'F' ) d = *p - 'A' + 10;
+		else break;
+		if( d >= base ) break;
+		if( magnitude > ( ~0UL - d ) / base ) overflow = true;
+		magnitude = magnitude * base + d;
+	}
+	if( endptr ) *endptr = ( char * )( p == digits ? start : p );
+	return p != digits && !overflow;
+}
+
+static double _scaleByPowerOfTen( double value, int exponent )
+{
+	// Scale by 10^|exponent|, built up from 10^1, 10^2, 10^4, 10^8... Dividing (rather than multiplying by 10^-n,
+	// which is not exactly representable) keeps negative exponents as accurate as positive ones. Exponents too big
+	// for a single power of ten (as needed for subnormals) are applied in two halves.
+	if( exponent > DBL_MAX_10_EXP || exponent < -DBL_MAX_10_EXP ) return _scaleByPowerOfTen( _scaleByPowerOfTen( value, exponent / 2 ), exponent - exponent / 2 );
+	static const double powers[] = { 1e1, 1e2, 1e4, 1e8, 1e16, 1e32
+#if DBL_MAX_10_EXP >= 64
+		, 1e64, 1e128, 1e256
+#endif
+	};
+	unsigned int n = ( exponent < 0 ) ? -exponent : exponent;
+	double scale = 1.0;
+	for( unsigned char i = 0; n; i++, n >>= 1 )
+	{
+		if( i >= sizeof( powers ) / sizeof( powers[ 0 ] ) ) { scale = INFINITY; break; }
+		if( n & 1 ) scale *= powers[ i ];
+	}
+	return ( exponent < 0 ) ? value / scale : value * scale;
+}
+
+bool Keyhole::parseDecimal( const char * start, char ** endptr, double & value )
+{
+	// One pass, no library calls: [whitespace][+|-]digits[.digits][e[+|-]digits], or inf or nan. Digits are gathered in an
+	// unsigned long for as long as they fit (so that typical values need no floating-point arithmetic until the end).
+	const char * p = start;
+	while( isspace( *p ) ) p++;
+	bool negative = ( *p == '-' );
+	if( *p == '-' || *p == '+' ) p++;
+	if( ( p[ 0 ] | 0x20 ) == 'i' && ( p[ 1 ] | 0x20 ) == 'n' && ( p[ 2 ] | 0x20 ) == 'f' ) { value = negative ? -INFINITY : INFINITY; if( endptr ) *endptr = ( char * )p + 3; return true; }
+	if( ( p[ 0 ] | 0x20 ) == 'n' && ( p[ 1 ] | 0x20 ) == 'a' && ( p[ 2 ] | 0x20 ) == 'n' ) { value = NAN; if( endptr ) *endptr = ( char * )p + 3; return true; }
+	unsigned long mantissa = 0;
+	double big = 0.0;
+	bool useBig = false, digits = false, fraction = false;
+	int exponent = 0;
+	for( ; ; p++ )
+	{
+		if( *p == '.' && !fraction ) { fraction = true; continue; }
+		if( *p < '0' || *p > '9' ) break;
+		unsigned char d = *p - '0';
+		digits = true;
+		if( fraction ) exponent--;
+		if( !useBig && mantissa <= ( ~0UL - 9 ) / 10 ) mantissa = mantissa * 10 + d;
+		else { if( !useBig ) { big = mantissa; useBig = true; } big = big * 10.0 + d; }
+	}
+	if( !digits ) { if( endptr ) *endptr = ( char * )start; return false; }
+	if( ( *p == 'e' || *p == 'E' ) )
+	{
+		const char * q = p + 1;
+		bool negativeExponent = ( *q == '-' );
+		if( *q == '-' || *q == '+' ) q++;
+		if( *q >= '0' && *q <= '9' ) // otherwise, like strtod(), stop before the 'e'
+		{
+			int e = 0;
+			for( ; *q >= '0' && *q <= '9'; q++ ) if( e < 10000 ) e = e * 10 + ( *q - '0' );
+			exponent += negativeExponent ? -e : e;
+			p = q;
+		}
+	}
+	if( endptr ) *endptr = ( char * )p;
+	value = useBig ? big : ( double )mantissa;
+	if( value != 0.0 && exponent ) value = _scaleByPowerOfTen( value, exponent );
+	if( negative ) value = -value;
+	return !isinf( value ); // a finite number that came out infinite has overflowed
+}
+
+#if DBL_MANT_DIG > 24
+typedef unsigned long long _KeyholeDigits; // 17 significant digits need more than 32 bits
+#else
+typedef unsigned long      _KeyholeDigits; // on AVR, double is float, and 9 digits are all it ever needs
+#endif
+
+static char * _writeDigits( char * p, _KeyholeDigits x )
+{
+	char reversed[ 20 ];
+	unsigned char n = 0;
+	do { reversed[ n++ ] = '0' + ( char )( x % 10 ); x /= 10; } while( x );
+	while( n ) *p++ = reversed[ --n ];
+	return p;
+}
+
+// Finds the `precision`-digit number nearest to `value` (> 0), whose first digit has the decimal exponent `e10`, and
+// says whether it reads back as `value`: its digits go to `digits` and their count to `nDigits`, and `exponent` is the
+// decimal exponent of the first one (which rounding up can make e10 + 1).
+static bool _readsBack( double value, bool singlePrecision, unsigned char precision, int e10, char * digits, unsigned char & nDigits, int & exponent )
+{
+	int shift = precision - 1 - e10; // value * 10^shift has `precision` digits before the point
+	_KeyholeDigits mantissa = ( _KeyholeDigits )( _scaleByPowerOfTen( value, shift ) + 0.5 );
+	// The scaling above can be out by a few units in the last digit, so if the candidate misses, measure how far off it
+	// reads back and jump to the nearest `precision`-digit number, then step one unit at a time if need be.
+	for( unsigned char attempt = 0; attempt < 4 && mantissa; attempt++ )
+	{
+		char * end = _writeDigits( digits, mantissa );
+		nDigits = end - digits;
+		exponent = nDigits - 1 - shift;
+		*end++ = 'e';
+		if( shift > 0 ) *end++ = '-';
+		*_writeDigits( end, ( shift > 0 ) ? shift : -shift ) = '\0';
+		double back;
+#if DBL_MANT_DIG > 24
+		// parseDecimal() rounds twice when a 17-digit mantissa does not fit in a double, so it can be an ulp out: a
+		// 64-bit double is read back with strtod(), which is correctly rounded, as the host's float() or JSON.parse() are
+		if( !singlePrecision ) back = strtod( digits, NULL ); else
+#endif
+		Keyhole::parseDecimal( digits, NULL, back ); // (exact for anything that fits in a float)
+		if( singlePrecision ) back = ( float )back;
+		if( back == value ) return true;
+		double error = attempt ? ( ( back < value ) ? 1.0 : -1.0 ) : _scaleByPowerOfTen( value - back, shift ); // in units of the last digit
+		if(      error >=  0.5 ) mantissa += ( _KeyholeDigits )(  error + 0.5 );
+		else if( error <= -0.5 ) mantissa -= ( _KeyholeDigits )( -error + 0.5 );
+		else break; // the nearest candidate already misses, so this precision is not enough
+	}
+	return false;
+}
+
+unsigned char Keyhole::formatDecimal( char * buffer, double value, bool singlePrecision )
+{
+	// Shortest round trip: the fewest significant digits that read back as exactly the same value. No sprintf(), no heap,
+	// and for a float (which is all there is on AVR) no library calls beyond frexp().
+	char * p = buffer;
+	if( singlePrecision ) value = ( float )value;
+	if( isnan( value ) ) { strcpy_P( buffer, PSTR( "nan" ) ); return 3; }
+	if( signbit( value ) ) { *p++ = '-'; value = -value; } // (signbit(), not value < 0, so that -0.0 keeps its sign)
+	if( isinf( value ) ) { strcpy_P( p, PSTR( "inf" ) ); return p + 3 - buffer; }
+	
+	char digits[ 30 ];
+	unsigned char nDigits = 1;
+	int exponent = 0; // decimal exponent of the first digit
+	digits[ 0 ] = '0';
+	if( value != 0.0 )
+	{
+		int e2;
+		frexp( value, &e2 ); // value = m * 2^e2, 0.5 <= m < 1
+		int e10 = ( int )( ( e2 - 1 ) * 30103L / 100000L ); // log10(2) = 0.30103: near enough, and corrected below
+		double first = _scaleByPowerOfTen( value, -e10 );
+		while( first >= 10.0 ) { e10++; first /= 10.0; }
+		while( first < 1.0 ) { e10--; first *= 10.0; }
+		// If n digits read back, so do n + 1 (the nearest n + 1-digit number is at least as near), so rather than trying
+		// every length in turn, try 1, 2, 4, 8... digits and then bisect: a short value like 0.25 still takes one or two
+		// tries, and the longest takes 5 for a float (rather than 9) and 6 for a double (rather than 17).
+		unsigned char low = 1, high = ( singlePrecision || DBL_MANT_DIG <= 24 ) ? 9 : 17; // enough to tell any two values apart
+		bool current = false; // true while `digits` holds the result for `high`
+		for( unsigned char precision = 1; precision < high; precision *= 2 )
+		{
+			current = _readsBack( value, singlePrecision, precision, e10, digits, nDigits, exponent );
+			if( current ) { high = precision; break; }
+			low = precision + 1;
+		}
+		while( low < high )
+		{
+			unsigned char middle = ( low + high ) / 2;
+			current = _readsBack( value, singlePrecision, middle, e10, digits, nDigits, exponent );
+			if( current ) high = middle; else low = middle + 1;
+		}
+		if( !current ) _readsBack( value, singlePrecision, high, e10, digits, nDigits, exponent );
+		while( nDigits > 1 && digits[ nDigits - 1 ] == '0' ) nDigits--;
+	}
+	
+	// Lay it out the way Python's repr() does: positional notation for 1e-4 <= |value| < 1e16, scientific otherwise,
+	// and always with a '.' or an 'e' so that ast.literal_eval() gives back a float rather than an int.
+	if( exponent >= 16 || exponent < -4 )
+	{
+		*p++ = digits[ 0 ];
+		if( nDigits > 1 ) { *p++ = '.'; memcpy( p, digits + 1, nDigits - 1 ); p += nDigits - 1; }
+		*p++ = 'e';
+		*p++ = ( exponent < 0 ) ? '-' : '+';
+		p = _writeDigits( p, ( exponent < 0 ) ? -exponent : exponent );
+	}
+	else if( exponent < 0 )
+	{
+		*p++ = '0'; *p++ = '.';
+		for( int i = exponent + 1; i < 0; i++ ) *p++ = '0';
+		memcpy( p, digits, nDigits ); p += nDigits;
+	}
+	else
+	{
+		for( int i = 0; i <= exponent; i++ ) *p++ = ( i < nDigits ) ? digits[ i ] : '0';
+		*p++ = '.';
+		if( nDigits > exponent + 1 ) { memcpy( p, digits + exponent + 1, nDigits - exponent - 1 ); p += nDigits - exponent - 1; }
+		else *p++ = '0';
+	}
+	*p = '\0';
+	return p - buffer;
+}
+
 unsigned long Keyhole::strToUnsignedInteger( const char * start, char ** endptr )
 {
-	if( start && start[ 0 ] == '0' && ( start[ 1 ] == 'x' || start[ 1 ] == 'X' ) && start[ 2 ] ) return strtoul( start + 2, endptr, 16 );
-	if( start && start[ 0 ] == '0' && ( start[ 1 ] == 'b' || start[ 1 ] == 'B' ) && start[ 2 ] ) return strtoul( start + 2, endptr,  2 );
-	/******************************************************************************************/ return strtoul( start,     endptr, 10 );
+	unsigned long magnitude;
+	bool negative;
+	if( !parseInteger( start, endptr, magnitude, negative ) && endptr && *endptr != start ) magnitude = ~0UL; // overflow: saturate, like strtoul()
+	return negative ? 0UL - magnitude : magnitude;
 }
 
 long Keyhole::strToSignedInteger( const char * start, char ** endptr )
 {
-	if( start && start[ 0 ] == '0' && ( start[ 1 ] == 'x' || start[ 1 ] == 'X' ) && start[ 2 ] ) return strtol( start + 2, endptr, 16 );
-	if( start && start[ 0 ] == '0' && ( start[ 1 ] == 'b' || start[ 1 ] == 'B' ) && start[ 2 ] ) return strtol( start + 2, endptr,  2 );
-	/******************************************************************************************/ return strtol( start,     endptr, 10 );
+	unsigned long magnitude;
+	bool negative;
+	bool ok = parseInteger( start, endptr, magnitude, negative );
+	unsigned long limit = negative ? ( ~0UL >> 1 ) + 1 : ( ~0UL >> 1 );
+	if( !ok || magnitude > limit ) magnitude = ( endptr && *endptr == start ) ? 0 : limit; // overflow: saturate, like strtol()
+	return negative ? ( long )( 0UL - magnitude ) : ( long )magnitude;
 }
 
 double Keyhole::strToDouble( const char * start, char ** endptr )
 {
-	if( start && start[ 0 ] == '0' && ( start[ 1 ] == 'x' || start[ 1 ] == 'X' ) && start[ 2 ] ) return ( double )strtol( start + 2, endptr, 16 );
-	if( start && start[ 0 ] == '0' && ( start[ 1 ] == 'b' || start[ 1 ] == 'B' ) && start[ 2 ] ) return ( double )strtol( start + 2, endptr,  2 );
-	return ( double )strtod( start, endptr );
+	const char * p = start;
+	while( isspace( *p ) ) p++;
+	if( p[ 0 ] == '0' && ( p[ 1 ] == 'x' || p[ 1 ] == 'X' || p[ 1 ] == 'b' || p[ 1 ] == 'B' ) ) return ( double )strToSignedInteger( start, endptr );
+	double value = 0.0;
+	parseDecimal( start, endptr, value );
+	return value;
 }
 
 void Keyhole::flicker( int ledPin, unsigned long millisOn, unsigned long millisOff, unsigned long millisTotal )
@@ -440,8 +1704,8 @@ void Keyhole::flicker( int ledPin, unsigned long millisOn, unsigned long millisO
 	digitalWrite( ledPin, LOW );
 }
 
-Kout::Kout( Stream  & s ):        stream( s ),            mArmed( true ), mFloatPrecision( 2 ),                     mQuoteChar( ( char )Kfmt::DO_NOT_ESCAPE ), mClosingString( NULL ) {}
-Kout::Kout( Keyhole & k ):        stream( k.stream ),     mArmed( true ), mFloatPrecision( 2 ),                     mQuoteChar( ( char )Kfmt::DO_NOT_ESCAPE ), mClosingString( NULL ) {}
+Kout::Kout( Stream  & s ):        stream( s ),            mArmed( true ), mFloatPrecision( Kfmt::SHORTEST ),       mQuoteChar( ( char )Kfmt::DO_NOT_ESCAPE ), mClosingString( NULL ) {}
+Kout::Kout( Keyhole & k ):        stream( k.stream ),     mArmed( true ), mFloatPrecision( Kfmt::SHORTEST ),       mQuoteChar( ( char )Kfmt::DO_NOT_ESCAPE ), mClosingString( NULL ) {}
 Kout::Kout( const Kout & other ): stream( other.stream ), mArmed( true ), mFloatPrecision( other.mFloatPrecision ), mQuoteChar( other.mQuoteChar ),              mClosingString( other.mClosingString ) {}
 Kout::Kout( Kout && other ):      stream( other.stream ), mArmed( true ), mFloatPrecision( other.mFloatPrecision ), mQuoteChar( other.mQuoteChar ),              mClosingString( other.mClosingString ) { other.mArmed = false; }
 Kout::~Kout()
@@ -451,9 +1715,9 @@ Kout::~Kout()
 	this->stream.println();
 	this->stream.flush();
 }
-Kout & Kout::operator<<( const char *           x ) { return x ? ( *this << String( x ) ) : *this; }
-Kout & Kout::operator<<( const String         & x ) { if( mQuoteChar == ( char )Kfmt::DO_NOT_ESCAPE ) this->stream.print( x ); else Keyhole( this->stream ).printLiteral( x, mQuoteChar ); return *this; }
-Kout & Kout::operator<<( const char           & x ) { if( mQuoteChar == ( char )Kfmt::DO_NOT_ESCAPE ) this->stream.print( x ); else Keyhole( this->stream ).printLiteral( x, mQuoteChar ); return *this; }
+Kout & Kout::operator<<( const char *           x ) { if( !x ) return *this; if( mQuoteChar == ( char )Kfmt::DO_NOT_ESCAPE ) this->stream.print( x ); else Keyhole::printLiteral( this->stream, x, strlen( x ), mQuoteChar ); return *this; }
+Kout & Kout::operator<<( const String         & x ) { if( mQuoteChar == ( char )Kfmt::DO_NOT_ESCAPE ) this->stream.print( x ); else Keyhole::printLiteral( this->stream, x.c_str(), x.length(), mQuoteChar ); return *this; }
+Kout & Kout::operator<<( const char           & x ) { if( mQuoteChar == ( char )Kfmt::DO_NOT_ESCAPE ) this->stream.print( x ); else Keyhole::printLiteral( this->stream, x, mQuoteChar ); return *this; }
 Kout & Kout::operator<<( const unsigned char  & x ) { this->stream.print( x ); return *this; }
 Kout & Kout::operator<<( const bool           & x ) { this->stream.print( x ); return *this; }
 Kout & Kout::operator<<( const int            & x ) { this->stream.print( x ); return *this; }
@@ -462,8 +1726,8 @@ Kout & Kout::operator<<( const short          & x ) { this->stream.print( x ); r
 Kout & Kout::operator<<( const unsigned short & x ) { this->stream.print( x ); return *this; }
 Kout & Kout::operator<<( const long           & x ) { this->stream.print( x ); return *this; }
 Kout & Kout::operator<<( const unsigned long  & x ) { this->stream.print( x ); return *this; }
-Kout & Kout::operator<<( const float          & x ) { this->stream.print( x, mFloatPrecision ); return *this; }
-Kout & Kout::operator<<( const double         & x ) { this->stream.print( x, mFloatPrecision ); return *this; }
+Kout & Kout::operator<<( const float          & x ) { if( mFloatPrecision >= 0 ) this->stream.print( x, mFloatPrecision ); else { char text[ Keyhole::DECIMAL_BUFFER_SIZE ]; Keyhole::formatDecimal( text, x, true  ); this->stream.print( text ); } return *this; }
+Kout & Kout::operator<<( const double         & x ) { if( mFloatPrecision >= 0 ) this->stream.print( x, mFloatPrecision ); else { char text[ Keyhole::DECIMAL_BUFFER_SIZE ]; Keyhole::formatDecimal( text, x, false ); this->stream.print( text ); } return *this; }
 Kout & Kout::operator<<( const int8_t         & x ) { this->stream.print( x ); return *this; }
 Kout & Kout::operator<<( const Kfmt & x )
 {
@@ -481,11 +1745,151 @@ Kfmt::~Kfmt() {}
 Kout Keyhole::errorStream( const String & errorType )
 {
 	_startError( errorType ); // start the JSON dictionary using standardized error-related keys
-	this->stream.print( '"' ); // manually open the quotes for the error message
+	this->output.print( '"' ); // manually open the quotes for the error message
+	this->output.sendAll(); // everything so far must reach the stream before the caller's Kout output does
 	Kout s( this->stream ); // open a Kout instance into which the caller can then feed pieces of the error message using a chain of << operators
 	s << KFMT.quote( '\0' ); // set it to escape any non-printables, but not to put actual quotes around every string the caller feeds in 
 	s << KFMT.closingString( "\"}" ); // set a flag to manually close the quotes as well as the JSON dictionary, before the automatic line-ending
 	return s;
 }
 
+Kbuf::Kbuf( Stream & s ) :
+	stream( s ),
+	mode( KEYHOLE_OUTPUT_BLOCKING ),
+	highWater( 0 ),
+	dropped( 0 ),
+	sent( 0 ),
+	delimiter( '\n' ),
+	mHead( 0 ),
+	mLength( 0 ),
+	mCommitted( 0 ),
+	mOlder( 0 ),
+	mMidLine( false ),
+	mDropping( false ),
+	mLost( false )
+{
+}
+
+size_t Kbuf::write( uint8_t c )
+{
+	if( mDropping ) // the rest of a line that has already been dropped
+	{
+		if( c == delimiter ) mDropping = false;
+		return 1;
+	}
+	if( mLength >= KEYHOLE_OUTPUT_SIZE )
+	{
+		// In blocking mode a long reply (e.g. a "?" listing) goes out in buffer-sized chunks. The non-blocking modes
+		// never wait: they make room by sending what the Stream can take right now, then by dropping queued lines
+		// (DROP_OLDEST), and failing that they drop the line being formatted - so a line longer than the whole
+		// buffer is always dropped.
+		if( mode == KEYHOLE_OUTPUT_BLOCKING ) sendAll();
+		else
+		{
+			drain();
+			if( mLength < KEYHOLE_OUTPUT_SIZE ) {}
+			else if( mode == KEYHOLE_OUTPUT_DROP_OLDEST && _dropOldestLine() ) {}
+			else
+			{
+				mLength = mCommitted;
+				mDropping = ( c != delimiter );
+				mLost = true;
+				dropped++;
+				return 1;
+			}
+		}
+	}
+	mBuffer[ ( mHead + mLength++ ) % KEYHOLE_OUTPUT_SIZE ] = c;
+	if( c == delimiter && mode != KEYHOLE_OUTPUT_BLOCKING ) _commit(); // a finished line is queued at once, so dropping a later line of the same reply cannot take it along
+	return 1;
+}
+
+size_t Kbuf::write( const uint8_t * buffer, size_t size )
+{
+	for( size_t i = 0; i < size; i++ ) write( buffer[ i ] );
+	return size;
+}
+
+bool Kbuf::send( void )
+{
+	if( mode == KEYHOLE_OUTPUT_BLOCKING ) { sendAll(); return true; }
+	bool lost = mLost;
+	mDropping = mLost = false;
+	_commit();
+	mOlder = mLength;
+	return !lost;
+}
+
+void Kbuf::sendAll( void )
+{
+	mCommitted = mLength;
+	mDropping = mLost = false;
+	_writeOut( mLength );
+	mHead = 0; // the ring is empty, so start again from the beginning: that way a reply normally needs only one write()
+}
+
+void Kbuf::drain( void )
+{
+	while( mCommitted )
+	{
+		int room = this->stream.availableForWrite();
+		if( room <= 0 ) break;
+		_writeOut( ( unsigned int )room < mCommitted ? room : mCommitted );
+	}
+}
+
+unsigned int Kbuf::queued( void )
+{
+	return mCommitted;
+}
+
+void Kbuf::_commit( void )
+{
+	if( mLength > highWater ) highWater = mLength;
+	mCommitted = mLength;
+	drain();
+}
+
+void Kbuf::_writeOut( unsigned int n )
+{
+	while( n )
+	{
+		unsigned int chunk = KEYHOLE_OUTPUT_SIZE - mHead; // contiguous bytes before the ring wraps around
+		if( chunk > n ) chunk = n;
+		this->stream.write( mBuffer + mHead, chunk );
+		sent += chunk;
+		mMidLine = ( mBuffer[ mHead + chunk - 1 ] != delimiter );
+		mHead = ( mHead + chunk ) % KEYHOLE_OUTPUT_SIZE;
+		mLength -= chunk;
+		mCommitted -= chunk;
+		mOlder -= ( chunk < mOlder ) ? chunk : mOlder;
+		n -= chunk;
+	}
+}
+
+bool Kbuf::_dropOldestLine( void )
+{
+	// Lines (frames, in the binary protocol) are only ever dropped whole, so if the oldest has started going out it
+	// has to stay, and the one after it goes instead.
+	unsigned int start = mMidLine ? _lineLength( 0 ) : 0;
+	if( start >= mCommitted ) return false;
+	unsigned int n = _lineLength( start );
+	for( unsigned int i = start; i-- > 0; ) mBuffer[ ( mHead + i + n ) % KEYHOLE_OUTPUT_SIZE ] = mBuffer[ ( mHead + i ) % KEYHOLE_OUTPUT_SIZE ];
+	mHead = ( mHead + n ) % KEYHOLE_OUTPUT_SIZE;
+	mLength -= n;
+	mCommitted -= n;
+	if( start + n > mOlder ) mLost = true; // a line of the reply being formatted
+	if( start < mOlder ) mOlder -= ( n < mOlder - start ) ? n : mOlder - start;
+	dropped++;
+	return true;
+}
+
+unsigned int Kbuf::_lineLength( unsigned int start )
+{
+	unsigned int n = start;
+	while( n < mCommitted && mBuffer[ ( mHead + n ) % KEYHOLE_OUTPUT_SIZE ] != delimiter ) n++;
+	if( n < mCommitted ) n++; // include the line-ending
+	return n - start;
+}
+
 #endif // __Keyhole_CPP__
@@ -81,6 +81,14 @@ Provided the variable is not designated as `VARIABLE_READ_ONLY`, you can
 also set its value, e.g. by sending the command `foo = 2`.  (If you have
 designated the variable as `VARIABLE_VERBOSE` then this will also trigger
 a JSON output, as if you had queried `foo` immediately after setting it.)
+Integers can be given in decimal, or in hex or binary with a `0x` or `0b`
+prefix. A `bool` variable takes only `0`, `1`, `true` or `false` (in any
+case).
+A value that is out of range for the variable's type, such as `70000` for
+a `short`, is rejected with a `BadValue` error instead of wrapping around.
+Floating-point values are reported with as few digits as it takes to read
+them back exactly (`0.1` rather than `0.1000`, `1e+20` rather than `ovr`),
+switching to scientific notation outside the range 1e-4 to 1e16.
 
 You can send the simple command `?` to receive a JSON output containing all
 the variables that are accessible in this manner.
@@ -99,6 +107,194 @@ exposing the `autoSeconds` member itself as a variable::
         keyhole.end();
       }
 
+Everything waiting in the serial buffer is handled in one go: `begin()`
+collects up to `KEYHOLE_BATCH_SIZE` complete commands (so `fan1=1;fan2=2`
+is a single batch), each `variable()` or `command()` call looks at every
+command in the batch, and `end()` prints one combined JSON reply for all
+the values that were queried or verbosely assigned (errors still get a
+line each). The reply is staged in a buffer of `KEYHOLE_OUTPUT_SIZE` bytes
+and handed to the stream with a single `write()` (longer replies, such as
+`?` listings, go out in buffer-sized chunks). Then `end()` flushes the
+stream once, unless you set the `.flushAfterReply` member to `false`.
+Anything your sketch prints directly to the stream between `begin()` and
+`end()` will therefore appear before the reply.
+
+On a slow link, waiting for a reply to be transmitted can stall the
+sketch. To avoid that, set `keyhole.output.mode` to
+`KEYHOLE_OUTPUT_DROP_NEWEST` or `KEYHOLE_OUTPUT_DROP_OLDEST`. Replies then
+wait in the same buffer, which works as a ring-buffer queue. Each call to
+`begin()` writes only as much of the queue as the stream's
+`availableForWrite()` says it can take without blocking. Each line is
+queued as soon as it is finished, so if the queue fills up only the line
+that does not fit, or the oldest queued lines, are dropped (counted in
+`keyhole.output.dropped`); the other lines of a reply still go out.
+Nothing waits for the stream in these modes, so a line that is longer
+than the whole buffer is dropped too. If any line of a reply was dropped,
+the host gets a `BufferOverflow` error after what is left of it (in the
+binary protocol, a `KEYHOLE_FRAME_TOO_LONG` error frame). The default
+`KEYHOLE_OUTPUT_SIZE` is 128 bytes on boards with 2 KB of SRAM (an Uno),
+which is too small for a `?` listing of many variables, and 1280 bytes
+elsewhere (a Mega), which holds a `schema` listing of 24 variables. An
+automatic report that falls due while the previous one is still queued
+is skipped. The largest queue length seen so far is in
+`keyhole.output.highWater`, which you can expose as a read-only variable.
+(`errorStream()` and the `baud` command still write straight to the
+stream, and wait for it.)
+
+Incoming commands are stored, and parsed in place, in a fixed buffer of
+`KEYHOLE_BUFFER_SIZE` bytes (default 64) so that no heap allocation takes
+place. A longer command is discarded and reported as a `BufferOverflow`
+error. Define `KEYHOLE_BUFFER_SIZE` as 0 to get the old dynamically-
+growing `String` buffer instead.
+
+If the sketch exposes many variables, it is cheaper to register them once
+in `setup()` with `expose()`, which takes the same arguments as
+`variable()`. Each registered key is hashed into a small table, so that
+`begin()` can look up and process each incoming command directly, instead
+of every `variable()` call comparing its key against the command::
+
+    void setup()
+    {
+      Serial.begin(9600);
+      keyhole.expose("foo", foo);
+      keyhole.expose("bar", bar, VARIABLE_VERBOSE);
+    }
+    
+    void loop()
+    {
+      if( keyhole.begin() )
+      {
+        if(keyhole.assigned(&foo)) Serial.println("assigned to foo");
+        if(keyhole.variable("bar", bar)) Serial.println("assigned to bar"); // still works
+        keyhole.end();
+      }
+    }
+
+Up to `KEYHOLE_MAX_VARIABLES` (default 24) variables can be registered.
+Calling `variable()` on a registered variable simply returns whether it
+was assigned, so existing sketches keep working unchanged.
+
+Automatic reports can also be restricted to the values that have changed
+since the previous report, by setting the `.deltaReports` member to N > 0.
+Every Nth report is then still a full report (a "keyframe") so that a
+host that has only just started listening can catch up. In the
+non-blocking output modes the next report is also a keyframe whenever
+output has been dropped since the last one, since the host may have
+missed the values that a delta would build on. A `?` always gets
+the full listing. Each value is remembered only as a hash (of
+`sizeof(unsigned int)` bytes) so a change that happens to produce the same
+hash will not show up until the next keyframe. Delta reports are not used
+in plotter mode, where every line needs every column.
+
+The host can also subscribe to individual variables at individual rates,
+by sending `sub KEY PERIOD` (e.g. `sub foo 50ms`, `sub bar 2s`; a bare
+number means milliseconds). Variables that fall due together are reported
+together on one line. `sub KEY 0` or `unsub KEY` cancels a subscription,
+and `unsub` on its own cancels all of them. Subscribing to a key that is
+neither registered nor passed to `variable()` is a `BadValue` error. Up to
+`KEYHOLE_MAX_SUBSCRIPTIONS` (default 8) subscriptions can be active, and
+periods are rounded up to `KEYHOLE_WHEEL_TICK_MS` (default 10 ms). A
+negative period, or one longer than 65535 ticks (655350 ms by default), is
+a `BadValue` error.
+
+Fixed-size arrays can be exposed too, with `variable()` or `expose()`.
+An array is reported as a JSON list (`{"fans": [100, 120, 90]}`) and can
+be set either all at once, with `fans=[100, 120, 90]`, or one element at a
+time, with `fans[1]=120`. A whole-array assignment is checked completely
+before any element is changed, so the sketch never sees half of it.
+Arrays of `String` are not supported, and arrays are left out of Serial
+Plotter output.
+
+A host that talks to the same sketch over and over can save itself the
+trouble of sending whole keys. The built-in command `schema` replies with
+one line describing every variable registered with `expose()`::
+
+    {"_KEYHOLE_SCHEMA_VERSION": 40721, "_KEYHOLE_SCHEMA": [[0, "foo", "double", "silent"], [1, "bar", "String", "verbose"]]}
+
+Each entry gives the variable's index, key, type and write mode. From then
+on the host can address a variable by its index: `@0=2` is the same as
+`foo=2`, and `@1` queries `bar` (replies still use the key). Such commands
+go straight to the variable, without any key lookup. The version is a
+hash of the whole schema, so a host that has cached the schema can send
+`schema?` (which replies with just the version) to check that it is
+still valid after reconnecting.
+
+To keep several requests in flight at once, the host can tag any command
+with a number, e.g. `#17 fan1=200` or `#18 fan2`. A tagged command always
+gets exactly one line in reply, carrying its tag: its value
+(`{"_KEYHOLE_TAG": 18, "fan2": 0}`) if it was a query or a verbose
+assignment, an error (with a `"_KEYHOLE_TAG"` entry before the usual
+error entries), or otherwise a bare acknowledgement
+(`{"_KEYHOLE_TAG": 17}`). Tagged replies are never merged into the
+combined reply line, so the host can match them up in any order. The
+exception is a tagged `?`, whose tag goes on the line that opens the
+listing instead. Built-in commands with replies of their own (`baud`,
+`binary`, `schema`) carry the tag in that reply. Tags are
+meant for JSON mode, not plotter mode.
+
+An assignment to a registered variable is acknowledged only by `end()`,
+so a sketch that will not accept the new value can put the old one back
+and call `reject()` in between, e.g.
+
+        if(keyhole.assigned(&speed) && speed > 100) { speed = oldSpeed; keyhole.reject(&speed, "speed must be 0 to 100"); }
+
+and `#5 speed=300` gets `{"_KEYHOLE_TAG": 5, "_KEYHOLE_ERROR_TYPE": ...}`
+as its one line of reply instead of an acknowledgement.
+
+For hosts that care more about bandwidth than readability, the text
+command `binary` switches the keyhole into a compact binary protocol
+(acknowledged with `{"_KEYHOLE_PROTOCOL": "binary"}`). From then on,
+every message in both directions is a COBS-encoded frame terminated by a
+zero byte. Decoded, a frame consists of an op code (see `KeyholeFrameOp`),
+the index of a variable registered with `expose()`, its `KeyholeType`
+code, the raw little-endian value, and a CRC-16/CCITT-FALSE of all of
+that. Only registered variables can be reached this way. Automatic
+reports and subscriptions are paused while the binary protocol is in
+use. Errors are error frames too: `error()` sends its message as the
+payload of a `KEYHOLE_FRAME_BAD_VALUE` error frame (`errorStream()`,
+which writes text straight to the stream, is for the text protocol
+only). A `KEYHOLE_FRAME_TEXT` frame switches back to text. A host-side
+encoder/decoder is in `py-controller/keyhole_binary.py`.
+
+The host can also raise the serial rate at run time, without reflashing,
+if the sketch supplies a function that restarts the stream at a given
+rate (e.g. one that calls `Serial.begin(baud)`) in the `.setBaud` member.
+The host sends `baud 115200`, and the keyhole replies
+`{"_KEYHOLE_BAUD": 115200}` at the old rate, waits for that to be
+transmitted, and switches. The host then switches too, and confirms by
+sending `baud` on its own, which is answered at the new rate. If no such
+confirmation arrives within `KEYHOLE_BAUD_TIMEOUT_MS` (default 2000) the
+keyhole goes back to `KEYHOLE_FALLBACK_BAUD` (default 9600), so the sketch
+should start the stream at that rate. Without `.setBaud`, the `baud`
+command replies with an `Unsupported` error.
+
+To see how the keyhole itself is performing, read `_stats`:
+
+    _stats
+    {"_stats": {"commands": 12, "errors": 1, "bytes_in": 150, "bytes_out": 612, "dropped": 0, "max_loop_us": 1480}}
+
+counts the commands, errors, and bytes received and sent since the last
+reset, and gives the longest interval between `begin()` calls. Four more
+variables each hold a histogram of one timing, with its maximum: from
+reading a command's terminator to the command being matched
+(`_latency_us`), the reading and splitting of commands in `begin()`
+(`_parse_us`), from the end of `begin()` to `end()` (`_dispatch_us`), and
+writing out the replies in `end()` (`_output_us`):
+
+    _latency_us
+    {"_latency_us": {"max": 212, "counts": [0, 3, 9, 0, 0, 0, 0, 0]}}
+
+The first bucket counts times under 16 microseconds, and each bucket after
+it reaches four times as far (64, 256, 1024 ...), the last one taking
+everything longer. Keyhole registers these five variables itself, after
+the sketch's own (and on top of `KEYHOLE_MAX_VARIABLES`), the first time
+`begin()` is called: they appear in `schema` with the type `stats`, and
+can be read, tagged and subscribed to like any other variable, but `?`
+listings and automatic reports leave them out, and the binary protocol
+answers them with a `KEYHOLE_FRAME_BAD_TYPE` error. Setting `_stats=0`
+resets everything, and setting a histogram to 0 resets just that one.
+Compile with `KEYHOLE_STATS` set to 0 to leave all of this out.
+
 Under the hood: `keyhole` is an instance of the class `Keyhole`. Such
 instances must either be global variables, or declared `static`. The
 `KEYHOLE` macro can be used inside or outside of `loop()` - it simply
@@ -110,13 +306,80 @@ user-friendly keyword `static` from users who are not familiar with it).
 #ifndef   __Keyhole_H__
 #define   __Keyhole_H__
 
-#include "Arduino.h" // for Stream and String
+#include "Arduino.h" // for Stream, Print, String, millis() and micros() - which is all that Keyhole needs from the board
 #include <stdint.h>  // for int8_t
 
+// The Stream that a Keyhole uses if none is passed to its constructor (define this yourself on a board, or an
+// off-target build, that has no global `Serial`):
+#ifndef KEYHOLE_DEFAULT_STREAM
+#	define KEYHOLE_DEFAULT_STREAM Serial
+#endif
+
+// Maximum number of commands that one begin()/end() cycle will collect and process:
+#ifndef KEYHOLE_BATCH_SIZE
+#	define KEYHOLE_BATCH_SIZE 4
+#endif
+// Capacity, in bytes, of the fixed buffer that holds incoming commands (including a partial command still being
+// received). Set to 0 to use a dynamically-growing String instead, which has no length limit but allocates on the heap.
+#ifndef KEYHOLE_BUFFER_SIZE
+#	define KEYHOLE_BUFFER_SIZE 64
+#endif
+// Maximum number of variables that can be registered with expose():
+#ifndef KEYHOLE_MAX_VARIABLES
+#	define KEYHOLE_MAX_VARIABLES 24
+#endif
+// Maximum number of variables that the host can subscribe to with the `sub` command (at most 16):
+#ifndef KEYHOLE_MAX_SUBSCRIPTIONS
+#	define KEYHOLE_MAX_SUBSCRIPTIONS 8
+#endif
+// Resolution of subscription periods, and the number of slots on the timer wheel that schedules them:
+#ifndef KEYHOLE_WHEEL_TICK_MS
+#	define KEYHOLE_WHEEL_TICK_MS 10
+#endif
+#ifndef KEYHOLE_WHEEL_SLOTS
+#	define KEYHOLE_WHEEL_SLOTS 16
+#endif
+// Largest binary-protocol frame (before COBS encoding) that will be sent; String values longer than this minus 5 cannot be sent:
+#ifndef KEYHOLE_MAX_FRAME
+#	define KEYHOLE_MAX_FRAME 48
+#endif
+// Rate to which the `baud` command falls back if the host does not confirm a new rate within KEYHOLE_BAUD_TIMEOUT_MS:
+#ifndef KEYHOLE_FALLBACK_BAUD
+#	define KEYHOLE_FALLBACK_BAUD 9600
+#endif
+#ifndef KEYHOLE_BAUD_TIMEOUT_MS
+#	define KEYHOLE_BAUD_TIMEOUT_MS 2000
+#endif
+// Capacity, in bytes, of the buffer in which replies are staged before being handed to the Stream (in the non-blocking
+// output modes, also the longest line that can be sent). Boards with 2 KB of SRAM or less get 128; the rest get room
+// for a `schema` listing of KEYHOLE_MAX_VARIABLES variables:
+#ifndef KEYHOLE_OUTPUT_SIZE
+#	if defined( RAMEND ) && RAMEND < 0x1000
+#		define KEYHOLE_OUTPUT_SIZE 128
+#	else
+#		define KEYHOLE_OUTPUT_SIZE 1280
+#	endif
+#endif
+// Set this to 0 to leave out the `_stats` counters and the timing histograms (and their micros() calls):
+#ifndef KEYHOLE_STATS
+#	define KEYHOLE_STATS 1
+#endif
+// Number of buckets in each timing histogram (`_latency_us` and so on): the first counts durations under 16 microseconds, each one after that
+// covers four times the range of the one before, and the last counts everything longer (so 8 buckets reach 65 ms):
+#ifndef KEYHOLE_STATS_BUCKETS
+#	define KEYHOLE_STATS_BUCKETS 8
+#endif
+// Variables that Keyhole registers for itself (`_stats` and the four histograms), on top of KEYHOLE_MAX_VARIABLES:
+#if KEYHOLE_STATS
+#	define KEYHOLE_RESERVED_VARIABLES 5
+#else
+#	define KEYHOLE_RESERVED_VARIABLES 0
+#endif
+
 // Debugging macros:
 #ifdef DBSTREAM
-#	define REPORT( X )  { DBSTREAM.print( "{\"" #X "\" : " ); DBSTREAM.print( X );                         DBSTREAM.println( "}" ); DBSTREAM.flush(); }
-#	define REPORTS( X ) { DBSTREAM.print( "{\"" #X "\" : " ); Keyhole( DBSTREAM ).printStringLiteral( X ); DBSTREAM.println( "}" ); DBSTREAM.flush(); }
+#	define REPORT( X )  { DBSTREAM.print( "{\"" #X "\" : " ); Kout( DBSTREAM ) << KFMT.closingString( "}" )              << X; }
+#	define REPORTS( X ) { DBSTREAM.print( "{\"" #X "\" : " ); Kout( DBSTREAM ) << KFMT.closingString( "}" ).quote( '"' ) << X; }
 #else
 #	define REPORT( X )
 #	define REPORTS( X )
@@ -133,52 +396,163 @@ typedef enum
 	VARIABLE_VERBOSE   = 2
 } KeyholeWriteMode;
 
+typedef enum
+{
+	KEYHOLE_BOOL,
+	KEYHOLE_CHAR,
+	KEYHOLE_INT8,
+	KEYHOLE_UCHAR,
+	KEYHOLE_INT,
+	KEYHOLE_UINT,
+	KEYHOLE_SHORT,
+	KEYHOLE_USHORT,
+	KEYHOLE_LONG,
+	KEYHOLE_ULONG,
+	KEYHOLE_FLOAT,
+	KEYHOLE_DOUBLE,
+	KEYHOLE_STRING,
+	KEYHOLE_STATISTICS // Keyhole's own `_stats` counters and timing histograms (which the sketch cannot expose)
+} KeyholeType;
+
+// KeyholeTraits< T >::type is the KeyholeType of a variable of type T. Types without a specialization here cannot be
+// exposed: the compiler will complain about an incomplete type. (`elementType` is the same, except that it leaves out
+// String, which cannot be an array element.)
+template< typename T > struct KeyholeTraits;
+#define _KEYHOLE_TRAITS( TYPE, TYPE_CODE )  template<> struct KeyholeTraits< TYPE > { static const KeyholeType type = TYPE_CODE; static const KeyholeType elementType = TYPE_CODE; };
+_KEYHOLE_TRAITS( bool,           KEYHOLE_BOOL   )
+_KEYHOLE_TRAITS( char,           KEYHOLE_CHAR   )
+_KEYHOLE_TRAITS( int8_t,         KEYHOLE_INT8   )
+_KEYHOLE_TRAITS( unsigned char,  KEYHOLE_UCHAR  )
+_KEYHOLE_TRAITS( int,            KEYHOLE_INT    )
+_KEYHOLE_TRAITS( unsigned int,   KEYHOLE_UINT   )
+_KEYHOLE_TRAITS( short,          KEYHOLE_SHORT  )
+_KEYHOLE_TRAITS( unsigned short, KEYHOLE_USHORT )
+_KEYHOLE_TRAITS( long,           KEYHOLE_LONG   )
+_KEYHOLE_TRAITS( unsigned long,  KEYHOLE_ULONG  )
+_KEYHOLE_TRAITS( float,          KEYHOLE_FLOAT  )
+_KEYHOLE_TRAITS( double,         KEYHOLE_DOUBLE )
+template<> struct KeyholeTraits< String > { static const KeyholeType type = KEYHOLE_STRING; };
+
+typedef enum
+{
+	KEYHOLE_OUTPUT_BLOCKING    = 0, // write everything out, waiting for the Stream if necessary (the default)
+	KEYHOLE_OUTPUT_DROP_NEWEST = 1, // never wait: if the queue is full, drop the reply that does not fit
+	KEYHOLE_OUTPUT_DROP_OLDEST = 2  // never wait: if the queue is full, drop the oldest complete line(s) (or binary frames) to make room
+} KeyholeOutputMode;
+
+// Kbuf is a helper class used inside Keyhole: a Print that queues text in a fixed ring buffer. In the default
+// KEYHOLE_OUTPUT_BLOCKING mode, send() hands everything to the Stream with a single write() (and a long reply goes
+// out in buffer-sized chunks). In the non-blocking modes, nothing ever waits for the Stream: each line is queued as
+// soon as it is finished, only as much as its availableForWrite() allows is written, the rest is drained by
+// subsequent calls to Keyhole::begin(), and a line that does not fit in the buffer is dropped.
+class Kbuf : public Print
+{
+	public:
+		Kbuf( Stream & s );
+		size_t       write( uint8_t c );
+		size_t       write( const uint8_t * buffer, size_t size );
+		using        Print::write;
+		bool         send( void );    // finish the current reply: write it out (blocking mode) or queue it (non-blocking modes); false if any line of it was dropped
+		void         sendAll( void ); // write out everything, including the current reply, whatever the mode
+		void         drain( void );   // write as much of the queue as the Stream can take without blocking
+		unsigned int queued( void );  // number of bytes waiting in the queue
+	
+		Stream &          stream;
+		KeyholeOutputMode mode;
+		unsigned int      highWater; // the largest number of bytes that have been waiting in the queue in the non-blocking modes (dropped replies do not count)
+		unsigned long     dropped;   // the number of replies or lines that have been dropped in the non-blocking modes
+		unsigned long     sent;      // the number of bytes that have been handed to the Stream
+		uint8_t           delimiter; // the byte that ends each line, which DROP_OLDEST drops whole: '\n', or 0 (the end of a frame) in the binary protocol
+		
+	private:
+		uint8_t      mBuffer[ KEYHOLE_OUTPUT_SIZE ];
+		unsigned int mHead;      // index of the next byte to go out
+		unsigned int mLength;    // number of bytes in the ring, counting from mHead...
+		unsigned int mCommitted; // ...of which this many belong to finished lines (the rest is the line being formatted)...
+		unsigned int mOlder;     // ...and this many to replies before the current one
+		bool         mMidLine;   // true if part of the line at mHead has already gone out
+		bool         mDropping;  // true if the line being formatted did not fit and is being discarded
+		bool         mLost;      // true if any line of the current reply has been dropped
+		bool         _dropOldestLine( void );
+		unsigned int _lineLength( unsigned int start ); // length, with its delimiter, of the finished line that starts `start` bytes after mHead
+		void         _commit( void );
+		void         _writeOut( unsigned int n );
+};
+
+#if KEYHOLE_STATS
+// KeyholeHistogram is a helper used inside Keyhole to keep the timings reported in `_latency_us` and so on: the longest
+// duration seen, and a count of durations in each of KEYHOLE_STATS_BUCKETS log-scaled buckets (see above).
+struct KeyholeHistogram
+{
+	unsigned long maxMicros;
+	unsigned int  counts[ KEYHOLE_STATS_BUCKETS ];
+	void          record( unsigned long micros );
+};
+#endif
+
+// Binary protocol (see the `binary` command): values of the first byte of each frame...
+typedef enum
+{
+	KEYHOLE_FRAME_GET   = 0x01, // host -> device: [GET][index]                      device replies with a VALUE frame
+	KEYHOLE_FRAME_SET   = 0x02, // host -> device: [SET][index][type][payload]       device replies only if the variable is VARIABLE_VERBOSE
+	KEYHOLE_FRAME_LIST  = 0x03, // host -> device: [LIST][0]                         device replies with one VALUE frame per variable
+	KEYHOLE_FRAME_TEXT  = 0x7F, // host -> device: [TEXT][0]                         device switches back to the text protocol
+	KEYHOLE_FRAME_VALUE = 0x81, // device -> host: [VALUE][index][type][payload]
+	KEYHOLE_FRAME_ERROR = 0xEE  // device -> host: [ERROR][index][error code]
+} KeyholeFrameOp;
+// ...and the error codes carried by KEYHOLE_FRAME_ERROR frames:
+typedef enum
+{
+	KEYHOLE_FRAME_BAD_FRAME = 1, // COBS or CRC failure, or the frame was too long
+	KEYHOLE_FRAME_BAD_OP    = 2,
+	KEYHOLE_FRAME_BAD_INDEX = 3,
+	KEYHOLE_FRAME_BAD_TYPE  = 4, // type code or payload length does not match the variable
+	KEYHOLE_FRAME_READ_ONLY = 5,
+	KEYHOLE_FRAME_TOO_LONG  = 6, // the value is too long to fit into KEYHOLE_MAX_FRAME, or frames of the reply were dropped from a full output queue
+	KEYHOLE_FRAME_BAD_VALUE = 7  // the sketch rejected a value (see error()): the payload is its message
+} KeyholeFrameError;
+
+typedef void ( * KeyholeBaudFunction )( unsigned long baud );
+
 #define KEYHOLE       static Keyhole
 class Keyhole
 {
 	public:
 		// Typically, you should declare instances of the Keyhole class as static (the KEYHOLE macro does this for you).
-		Keyhole( Stream & stream=Serial, float autoSeconds=0.0, bool plotterMode=false );
+		Keyhole( Stream & stream=KEYHOLE_DEFAULT_STREAM, float autoSeconds=0.0, bool plotterMode=false );
 		~Keyhole();
 	
-		// begin() returns true if a command (terminated by an unquoted semicolon or newline) is ready for processing.
+		// begin() returns true if one or more commands (each terminated by an unquoted semicolon or newline) are ready for processing.
 		bool begin( void );
-		// begin() returns true if a command (terminated by an unquoted semicolon or newline) is ready for processing.
+		// begin() returns true if one or more commands (each terminated by an unquoted semicolon or newline) are ready for processing.
 		bool begin( unsigned long microsecondTimestamp );
+		
+		// numberOfCommands() returns how many commands begin() has collected into the current batch.
+		unsigned int numberOfCommands( void );
 	
 		// command() returns true if the specified command has been received (do not include the semicolon or newline terminator).
 		bool command( const char * cmd );
 	
 		// variable() exposes a sketch variable under the specified key (default mode is VARIABLE_SILENT, other possibilities are VARIABLE_VERBOSE and VARIABLE_READ_ONLY) and returns true if an incoming command has assigned a value to the variable.
-		bool variable( const char * key, bool &           referenceToVariable,  KeyholeWriteMode mode=VARIABLE_SILENT );
-		// variable() exposes a sketch variable under the specified key (default mode is VARIABLE_SILENT, other possibilities are VARIABLE_VERBOSE and VARIABLE_READ_ONLY) and returns true if an incoming command has assigned a value to the variable.
-		bool variable( const char * key, char &           referenceToVariable,  KeyholeWriteMode mode=VARIABLE_SILENT );
-		// variable() exposes a sketch variable under the specified key (default mode is VARIABLE_SILENT, other possibilities are VARIABLE_VERBOSE and VARIABLE_READ_ONLY) and returns true if an incoming command has assigned a value to the variable.
-		bool variable( const char * key, unsigned char &  referenceToVariable,  KeyholeWriteMode mode=VARIABLE_SILENT );
-		// variable() exposes a sketch variable under the specified key (default mode is VARIABLE_SILENT, other possibilities are VARIABLE_VERBOSE and VARIABLE_READ_ONLY) and returns true if an incoming command has assigned a value to the variable.
-		bool variable( const char * key, int &            referenceToVariable,  KeyholeWriteMode mode=VARIABLE_SILENT );
-		// variable() exposes a sketch variable under the specified key (default mode is VARIABLE_SILENT, other possibilities are VARIABLE_VERBOSE and VARIABLE_READ_ONLY) and returns true if an incoming command has assigned a value to the variable.
-		bool variable( const char * key, unsigned int &   referenceToVariable,  KeyholeWriteMode mode=VARIABLE_SILENT );
-		// variable() exposes a sketch variable under the specified key (default mode is VARIABLE_SILENT, other possibilities are VARIABLE_VERBOSE and VARIABLE_READ_ONLY) and returns true if an incoming command has assigned a value to the variable.
-		bool variable( const char * key, short &          referenceToVariable,  KeyholeWriteMode mode=VARIABLE_SILENT );
-		// variable() exposes a sketch variable under the specified key (default mode is VARIABLE_SILENT, other possibilities are VARIABLE_VERBOSE and VARIABLE_READ_ONLY) and returns true if an incoming command has assigned a value to the variable.
-		bool variable( const char * key, unsigned short & referenceToVariable,  KeyholeWriteMode mode=VARIABLE_SILENT );
-		// variable() exposes a sketch variable under the specified key (default mode is VARIABLE_SILENT, other possibilities are VARIABLE_VERBOSE and VARIABLE_READ_ONLY) and returns true if an incoming command has assigned a value to the variable.
-		bool variable( const char * key, long &           referenceToVariable,  KeyholeWriteMode mode=VARIABLE_SILENT );
-		// variable() exposes a sketch variable under the specified key (default mode is VARIABLE_SILENT, other possibilities are VARIABLE_VERBOSE and VARIABLE_READ_ONLY) and returns true if an incoming command has assigned a value to the variable.
-		bool variable( const char * key, unsigned long &  referenceToVariable,  KeyholeWriteMode mode=VARIABLE_SILENT );
-		// variable() exposes a sketch variable under the specified key (default mode is VARIABLE_SILENT, other possibilities are VARIABLE_VERBOSE and VARIABLE_READ_ONLY) and returns true if an incoming command has assigned a value to the variable.
-		bool variable( const char * key, float &          referenceToVariable,  KeyholeWriteMode mode=VARIABLE_SILENT );
-		// variable() exposes a sketch variable under the specified key (default mode is VARIABLE_SILENT, other possibilities are VARIABLE_VERBOSE and VARIABLE_READ_ONLY) and returns true if an incoming command has assigned a value to the variable.
-		bool variable( const char * key, double &         referenceToVariable,  KeyholeWriteMode mode=VARIABLE_SILENT );
-		// variable() exposes a sketch variable under the specified key (default mode is VARIABLE_SILENT, other possibilities are VARIABLE_VERBOSE and VARIABLE_READ_ONLY) and returns true if an incoming command has assigned a value to the variable.
-		bool variable( const char * key, String &         referenceToVariable,  KeyholeWriteMode mode=VARIABLE_SILENT );
-		// variable() exposes a sketch variable under the specified key (default mode is VARIABLE_SILENT, other possibilities are VARIABLE_VERBOSE and VARIABLE_READ_ONLY) and returns true if an incoming command has assigned a value to the variable.
-		bool variable( const char * key, int8_t &         referenceToVariable,  KeyholeWriteMode mode=VARIABLE_SILENT ); 
+		// The variable can be a bool, char, int8_t, unsigned char, int, unsigned int, short, unsigned short, long, unsigned long, float, double or String (see KeyholeTraits).
+		template< typename T > bool variable( const char * key, T & referenceToVariable, KeyholeWriteMode mode=VARIABLE_SILENT ) { return _variable( key, &referenceToVariable, KeyholeTraits< T >::type, 0, mode ); }
 		// Note: a char may be considered signed or unsigned, depending on architecture.
-		// So, in case it is unsigned, we needed an explicit signed-8-bit polymorph.
+		// So, in case it is unsigned, we needed an explicit signed-8-bit type (int8_t).
 		// The rest of the stdint types should take care of themselves via the usual builtin types.
 		
+		// variable() also exposes a fixed-size array (of up to 255 elements of any of the above types except String), which is reported as a JSON list and can be set all at once with `key=[1,2,3]` or one element at a time with `key[1]=2`.
+		template< typename T, unsigned int N > bool variable( const char * key, T ( &referenceToArray )[ N ], KeyholeWriteMode mode=VARIABLE_SILENT ) { static_assert( N > 0 && N < 256, "a Keyhole array must have 1 to 255 elements" ); return _variable( key, referenceToArray, KeyholeTraits< T >::elementType, N, mode ); }
+		
+		// expose() registers a sketch variable once (typically in setup()) so that begin() can dispatch commands to it directly; returns its index, or -1 if the table is full.
+		template< typename T > int  expose( const char * key, T & referenceToVariable, KeyholeWriteMode mode=VARIABLE_SILENT ) { return _expose( key, &referenceToVariable, KeyholeTraits< T >::type, mode ); }
+		// expose() registers a fixed-size array in the same way (see the array polymorph of variable()).
+		template< typename T, unsigned int N > int  expose( const char * key, T ( &referenceToArray )[ N ], KeyholeWriteMode mode=VARIABLE_SILENT ) { static_assert( N > 0 && N < 256, "a Keyhole array must have 1 to 255 elements" ); return _expose( key, referenceToArray, KeyholeTraits< T >::elementType, mode, N ); }
+		
+		// assigned() returns true if a command in the current batch has assigned a value to the registered variable at the specified address (or to any of them, if an array and its first element are both registered).
+		bool assigned( const void * addressOfVariable );
+		// assigned() of a whole registered array looks only at the array itself, e.g. `fans=[1,2,3]` but not `fan1=1` when fan1 is its first element.
+		template< typename T, unsigned int N > bool assigned( T ( &referenceToArray )[ N ] ) { static_assert( N > 0 && N < 256, "a Keyhole array must have 1 to 255 elements" ); return _assigned( referenceToArray, N ); }
+		
 #		define variableAssigned variable // so you can express it like this if the semantics appeal to you more:
 		                                 //     if( keyhole.variableAssigned("foo", foo) ) doWhatever(foo);
 	
@@ -187,6 +561,9 @@ class Keyhole
 	
 		// error() lets you print your own error message in JSON format using the customary Keyhole keys.
 		void error( const String & msg, const String & type="BadValue" );
+		// reject() is error() for a value that the host has just assigned to the registered variable at the specified address and that the sketch will not accept
+		// (put the old value back yourself): call it between begin() and end(), and a tagged assignment gets the error under its own tag instead of being acknowledged.
+		void reject( const void * addressOfVariable, const String & msg, const String & type="BadValue" );
 	
 		// elapsedMicros() returns the microseconds elapsed since begin() (but only if you passed micros() as an argument to .begin(), or if .autoSeconds is set > 0.0).
 		unsigned long elapsedMicros( void );
@@ -194,6 +571,10 @@ class Keyhole
 		Stream &      stream;      // a reference to the Stream (e.g. Serial) used for text input and output
 		float         autoSeconds; // set this >0.0 to receive periodic automatic output
 		int           plotterMode; // set this to true to make the output format compatible with the Serial Plotter in the Arduino IDE
+		unsigned int  deltaReports; // set this >0 to make automatic reports list only the variables that have changed, with a full report every `deltaReports` reports
+		bool          flushAfterReply; // set this to false if end() should not wait for the Stream to finish transmitting
+		KeyholeBaudFunction setBaud; // set this to a function that restarts the Stream at the given rate, to allow the host to change it with the `baud` command
+		Kbuf          output;      // the queue through which all replies go: set .output.mode to one of the non-blocking KeyholeOutputModes to stop replies stalling the sketch
 		
 		// Use  k << x << "y" << z;  to print a sequence of things followed by an automatic line-ending and flush.
 		Kout operator<<( const char *           x );
@@ -216,26 +597,153 @@ class Keyhole
 		Kout errorStream( const String & errorType );
 		
 	private: // nothing to see here
-		unsigned long mBeginMicros;
-		String        mFullCommand;
-		int           mListAllVariables;
-		String        mPartialCommand;
-		bool          mBackslash;
-		int           mHexEscape;
-		char          mHexValue;
-		char          mQuote;
-		unsigned long mTimestampOfLastAutoReport;
-		char          mBad;
-
-		const char *  _parseVariableCommand( const char * key, unsigned int & commandLength );
-		void          _startError( const String & type );	
+		struct KeyholeCommand
+		{
+			unsigned int start;   // offset of the (null-terminated) command within mBuffer
+			unsigned int length;  // length of the command, which may itself contain escaped null characters
+			bool         pending; // true until a variable() or command() call has matched the command
+			long         tag;     // the number N from a leading "#N", or -1 if the command was not tagged
+			int          acknowledge; // index of the registered variable whose assignment end() is to acknowledge under `tag`, or -1
+#if KEYHOLE_STATS
+			unsigned long receivedMicros; // when the command's terminator was read
+#endif
+		};
+		struct KeyholeVariable
+		{
+			const char *   key;
+			void *         address;
+			unsigned int   hash;
+			unsigned char  type;     // a KeyholeType
+			unsigned char  mode;     // a KeyholeWriteMode
+			unsigned char  count;    // number of elements if the variable is an array, otherwise 0
+			bool           assigned; // set by begin() when a command in the current batch has assigned to the variable
+			bool           echo;     // set by a binary SET of a VARIABLE_VERBOSE variable, whose VALUE frame end() then sends
+		};
+		struct KeyholeSubscription
+		{
+			unsigned int keyHash;
+			unsigned int periodTicks;
+			unsigned int rounds;  // full turns of the timer wheel still to go before the subscription is due
+			long         tag;     // while the subscription is unconfirmed, the tag of the `sub` command (-1 if none)
+		};
+		unsigned long  mBeginMicros;
+#if KEYHOLE_BUFFER_SIZE > 0
+		char           mBuffer[ KEYHOLE_BUFFER_SIZE ];
+		unsigned int   mBufferLength;
+#else
+		String         mBuffer;
+#endif
+		unsigned int   mPartialStart;
+		KeyholeCommand mCommands[ KEYHOLE_BATCH_SIZE ];
+		unsigned char  mNumberOfCommands;
+		long           mTag;    // tag of the command being processed, until a tagged reply or error has used it up (-1 if none)
+		long           mListTag; // tag of a "?" command, which the line that opens the listing carries (-1 if none)
+		int            mListAllVariables; // 0: no listing, 1: list every variable, 2: list only the variables that have changed
+		unsigned char  mListIndex;
+		unsigned long  mDroppedAtLastReport; // output.dropped as of the last automatic report
+		unsigned int   mAutoReportCount;
+		unsigned int   mShadow[ KEYHOLE_MAX_VARIABLES ]; // a hash of each variable's value as of the last listing
+		int            mReplyItems;
+		bool           mOutputPending;
+		bool           mActive;
+		bool           mOverflow;
+		unsigned char  mOverflows;
+		bool           mBackslash;
+		int            mHexEscape;
+		char           mHexValue;
+		char           mQuote;
+		unsigned long  mTimestampOfLastAutoReport;
+		char           mBad;
+		KeyholeSubscription mSubscriptions[ KEYHOLE_MAX_SUBSCRIPTIONS ];
+		unsigned int   mSubscribed; // bitmask of the entries of mSubscriptions that are in use
+		unsigned int   mDue;        // bitmask of the subscriptions that are due to be reported in the current batch
+		unsigned int   mUnconfirmed; // bitmask of new subscriptions to keys that are not registered, and not yet seen by variable()
+		unsigned int   mWheel[ KEYHOLE_WHEEL_SLOTS ]; // for each slot, a bitmask of the subscriptions that expire there
+		unsigned char  mWheelCursor;
+		unsigned long  mWheelMillis;
+		KeyholeVariable mVariables[ KEYHOLE_MAX_VARIABLES + KEYHOLE_RESERVED_VARIABLES ];
+		unsigned char  mNumberOfVariables;
+		unsigned char  mReservedVariables; // how many of them are Keyhole's own (registered by the first begin())
+		unsigned char  mVariableIndex[ 2 * ( KEYHOLE_MAX_VARIABLES + KEYHOLE_RESERVED_VARIABLES ) ]; // open-addressed hash table of mVariables indices + 1 (0 means empty)
+		bool           mDispatching;
+		unsigned char  mDispatchIndex; // while mDispatching, the index of the registered variable being dispatched
+		bool           mBinary;
+		unsigned char  mFrames;
+		unsigned long  mBaud;
+		bool           mBaudPending;      // true from a `baud RATE` command until the host confirms the new rate
+		unsigned long  mBaudChangeMillis;
+#if KEYHOLE_STATS
+		KeyholeHistogram mLatencyStats;  // from reading a command's terminator to the command being matched
+		KeyholeHistogram mParseStats;    // time spent reading and splitting commands in begin()
+		KeyholeHistogram mDispatchStats; // from the end of begin() to the start of end()
+		KeyholeHistogram mOutputStats;   // time spent in end() writing out the replies
+		unsigned long  mBytesIn;
+		unsigned long  mCommandCount;
+		unsigned long  mErrorCount;
+		unsigned long  mMaxLoopMicros;   // the longest interval between successive begin() calls
+		unsigned long  mLastBeginMicros;
+		unsigned long  mDispatchMicros;  // when the current batch's dispatch started
+#endif
+
+		bool           _append( char c );
+		void           _terminate( void );
+		void           _truncate( unsigned int length );
+		unsigned int   _bufferLength( void );
+		const char *   _bufferData( void );
+		int            _expose( const char * key, void * address, KeyholeType type, KeyholeWriteMode mode, unsigned char count=0 );
+		int            _findVariable( const char * key, unsigned int keyLength );
+		int            _registeredVariable( const void * address );
+		bool           _assigned( const void * address, unsigned char count );
+		int            _registeredIndex( const char * command, int * length );
+		void           _dispatch( unsigned char variableIndex );
+		void           _dispatchRegistered( void );
+		void           _finishCommand( void );
+		bool           _builtinCommand( const char * command, unsigned int length );
+		void           _subscribe( const char * arguments );
+		void           _unsubscribe( const char * arguments );
+		void           _schedule( unsigned char subscription );
+		void           _unschedule( unsigned char subscription );
+		void           _advanceWheel( void );
+		bool           _due( unsigned int keyHash, bool consume=true );
+		void           _confirmSubscription( unsigned int keyHash );
+		void           _rejectUnconfirmedSubscriptions( void );
+		void           _switchProtocol( bool binary );
+		void           _changeBaud( const char * arguments );
+		void           _printSchema( bool full );
+		void           _exposeStats( void );
+		bool           _resetStats( const void * address, const char * text );
+		void           _printStats( const void * address );
+		unsigned int   _schemaVersion( void );
+		void           _finishFrame( void );
+		void           _binaryCommand( const uint8_t * frame, unsigned int length );
+		void           _sendValue( unsigned char variableIndex );
+		void           _sendFrame( unsigned char op, unsigned char index, unsigned char type, const void * payload, unsigned int payloadLength );
+		void           _discardCommands( void );
+		const char *   _parseVariableCommand( const char * key, unsigned char commandIndex, unsigned int & commandLength, int * element=NULL );
+		bool           _variable( const char * key, void * address, KeyholeType type, unsigned char count, KeyholeWriteMode mode );
+		bool           _parseValue( const char * text, unsigned int length, void * address, KeyholeType type, int element, unsigned char count );
+		bool           _parseArray( const char * text, void * array, KeyholeType type, unsigned char count );
+		bool           _parseElement( const char * text, char ** remainder, void * array, KeyholeType type, unsigned char i );
+		void           _printValue( const void * address, KeyholeType type, unsigned char count );
+		void           _badValue( const char * key, KeyholeType type, int element, unsigned char count );
+		bool           _listing( unsigned int valueHash );
+		void           _startReplyItem( const char * key );
+		void           _startTaggedReply( const char * key );
+		void           _startTaggedReply( const __FlashStringHelper * key );
+		void           _acknowledgeTag( void );
+		void           _errorFrame( unsigned char index, const String & msg );
+		void           _endReply( void );
+		void           _sendOutput( void );
+		void           _startError( const __FlashStringHelper * type );
+		void           _startError( const String & type );
+		void           _openError( void );
 	
 	public:
-		// General-purpose helper method (an instance method only because it accesses `this->stream`)
+		// General-purpose helper method (an instance method only because it goes through `this->output`; see the static versions below)
 		void          printLiteral( const String & s, char withQuotes='"' );
-		// General-purpose helper method (an instance method only because it accesses `this->stream`)
-		void          printLiteral( double f,         char withQuotes='"' );
-		// General-purpose helper method (an instance method only because it accesses `this->stream`)
+		// General-purpose helper method (an instance method only because it goes through `this->output`; see the static versions below). Prints the shortest text that reads back as exactly `f` (or, if `singlePrecision`, as exactly `(float)f`).
+		void          printLiteral( double f,         char withQuotes='"', bool singlePrecision=false );
+		// General-purpose helper method (an instance method only because it goes through `this->output`; see the static versions below)
 		void          printLiteral( char c,           char withQuotes=(char)-1 );
 		// * withQuotes=0 means print characters (or escape codes) unquoted, and don't escape any quotes.
 		// * withQuotes='\'' or withQuotes='"' means print the content wrapped in the specified type of quote, and
@@ -247,12 +755,30 @@ class Keyhole
 	
 		////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 		// And finally some general-purpose static helper functions (but let's keep them inside the Keyhole:: namespace):
+		
+		// Stateless versions of printLiteral(), which format straight into any Print (a Stream, or a Keyhole's .output) without a Keyhole instance or a String copy. These are what Kout, errorStream() and the REPORT macros use.
+		static void          printLiteral( Print & out, const char * s, unsigned int length, char withQuotes='"' );
+		static void          printLiteral( Print & out, double f,                            char withQuotes='"', bool singlePrecision=false );
+		static void          printLiteral( Print & out, char c,                              char withQuotes=(char)-1 );
 	
 		// This is needed because some boards' standard libraries don't have a String(ptr,length) constructor 
 		static void          assignString( String & dst, const char *ptr, unsigned int length, bool trim=false, bool lowercase=false );
 		// This is needed because some boards' standard libraries may mess up copying `string2=string1;` if `string1` contains '\0'
 		static void          assignString( String & dst, const String & src,                   bool trim=false, bool lowercase=false );
 		
+		// Hash used to index registered variables by key (the same function is applied to the key part of each incoming command)
+		static unsigned int  hash( const char * s, unsigned int length );
+		
+		// CRC-16/CCITT-FALSE, as used to check binary-protocol frames
+		static unsigned int  crc16( const uint8_t * data, unsigned int length );
+		
+		// Single-pass integer parser, with no library calls: optional whitespace, optional sign, optional 0x or 0b prefix, then digits. Returns false if there are no digits (in which case *endptr is set to start) or if the magnitude does not fit in an unsigned long.
+		static bool          parseInteger( const char * start, char ** endptr, unsigned long & magnitude, bool & negative );
+		// Single-pass decimal floating-point parser, with no library calls: like `strtod` but without hex floats. Returns false if there are no digits or if a finite number overflows.
+		static bool          parseDecimal( const char * start, char ** endptr, double & value );
+		// The reverse of parseDecimal(), with no sprintf() or heap: writes the fewest significant digits that read back as exactly `value` (or, if `singlePrecision`, as exactly `(float)value`), laid out like Python's repr() (e.g. 0.1, 100.0, 1e+16, 2.5e-7, inf, nan). `buffer` needs DECIMAL_BUFFER_SIZE bytes. Returns the length.
+		static unsigned char formatDecimal( char * buffer, double value, bool singlePrecision=false );
+		static const unsigned int DECIMAL_BUFFER_SIZE = 25; // e.g. "-1.2345678901234567e-308" plus its null terminator
 		// Works the same as the standard library function `strtoul` except optional prefixes 0x and 0b are recognized and the base (16, 2 or 10) is inferred.
 		static unsigned long strToUnsignedInteger( const char * start, char ** endptr );
 		// Works the same as the standard library function `strtol` except optional prefixes 0x and 0b are recognized and the base (16, 2 or 10) is inferred.
@@ -282,6 +808,7 @@ class Kfmt
 		static const int CHAR_AS_NUMERIC = -1; // understood by Keyhole::printLiteral()
 		static const int DO_NOT_ESCAPE   = -2;
 		static const int NO_CHANGE       = -3;
+		static const int SHORTEST        = -4; // the default float precision: as many digits as it takes to read back exactly
 	
 		 Kfmt();
 		~Kfmt();
@@ -308,7 +835,7 @@ class Kfmt
 class Kout
 {
 	public:
-		 Kout( Stream  & s=Serial );
+		 Kout( Stream  & s=KEYHOLE_DEFAULT_STREAM );
 		 Kout( Keyhole & k        );
 		 Kout( const Kout &  other );
 		 Kout( Kout && other );
@@ -337,7 +864,7 @@ class Kout
 		char         mQuoteChar;
 		const char * mClosingString;
 };
-#define KOUT  Kout( Serial )
+#define KOUT  Kout( KEYHOLE_DEFAULT_STREAM )
 
 #define KTIME( X ) { unsigned long _t0 = micros(); X; KOUT << micros() - _t0 << "us elapsed for  " << #X; }
 
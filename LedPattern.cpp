@@ -0,0 +1,60 @@
+#include "LedPattern.h"
+
+#define LED_RESTART_MS 60000UL // after a stall this long, start the pattern over rather than catch up step by step
+
+static const LedStep HEARTBEAT[] = { { 255, false,  500 }, {   0, false,  500 } };
+static const LedStep PULSES[]    = { { 255, false,  150 }, {   0, false,  250 }, { 0, false, 1250 } };
+static const LedStep BREATHE[]   = { { 255, true,  1500 }, {   0, true,  1500 } };
+static const LedStep LOCATE[]    = { { 255, false,  100 }, {   0, false,  100 } };
+
+LedPattern::LedPattern(void) :
+  pattern(LED_PATTERN_NONE),
+  mSelected(LED_PATTERN_NONE),
+  mSteps(HEARTBEAT),
+  mLength(2),
+  mRepeats(1),
+  mStep(0),
+  mPass(0),
+  mFrom(0),
+  mStepStart(0)
+{
+}
+
+bool LedPattern::select(unsigned long now)
+{
+  const LedStep * steps;
+  unsigned char length;
+  unsigned char repeats = 1;
+  if (pattern >= 1 && pattern <= LED_PATTERN_PULSES_MAX) { steps = PULSES; length = 3; repeats = pattern; }
+  else if (pattern == LED_PATTERN_BREATHE) { steps = BREATHE; length = 2; }
+  else if (pattern == LED_PATTERN_LOCATE)  { steps = LOCATE;  length = 2; }
+  else if (pattern == LED_PATTERN_NONE)    { steps = HEARTBEAT; length = 2; }
+  else { pattern = mSelected; return false; } // unknown: carry on with the current pattern, undisturbed
+  mSelected = pattern;
+  mSteps = steps;
+  mLength = length;
+  mRepeats = repeats;
+  mStep = 0;
+  mPass = 0;
+  mFrom = 0;
+  mStepStart = now;
+  return true;
+}
+
+unsigned char LedPattern::update(unsigned long now)
+{
+  unsigned long elapsed = now - mStepStart;
+  if (elapsed >= LED_RESTART_MS) { select(now); elapsed = 0; }
+  while (elapsed >= mSteps[mStep].ms)
+  {
+    elapsed -= mSteps[mStep].ms;
+    mStepStart += mSteps[mStep].ms;
+    mFrom = mSteps[mStep].level;
+    if (mStep + 2 < mLength) mStep++;
+    else if (mStep + 2 == mLength) mStep = (++mPass < mRepeats) ? 0 : mStep + 1;
+    else { mStep = 0; mPass = 0; }
+  }
+  const LedStep & step = mSteps[mStep];
+  if (!step.fade) return step.level;
+  return mFrom + ((long)step.level - mFrom) * (long)elapsed / (long)step.ms;
+}
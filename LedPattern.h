@@ -0,0 +1,50 @@
+// LED pattern sequencer for the controller sketch.
+//
+// A pattern is a short table of steps, each holding (or fading to) a
+// brightness for a number of milliseconds. update() works out where in
+// the table `now` falls and returns the brightness, so it can be called
+// from any periodic task and never waits; late calls simply land further
+// along the pattern. Like FanController it is plain C++: the sketch
+// supplies the time and applies the result.
+
+#ifndef __LedPattern_H__
+#define __LedPattern_H__
+
+#define LED_PATTERN_NONE       0  // no pattern: the LED channel follows `led`, LED_BUILTIN blinks the heartbeat
+#define LED_PATTERN_PULSES_MAX 9  // 1..9: identify, N short pulses and a pause (e.g. the node number)
+#define LED_PATTERN_BREATHE    10 // slow fade up and down
+#define LED_PATTERN_LOCATE     11 // fast even blink
+
+struct LedStep
+{
+  unsigned char level; // brightness at the end of the step (0..255)
+  bool          fade;  // fade to `level` from the previous step's level, instead of holding it
+  unsigned int  ms;    // duration (must not be 0)
+};
+
+class LedPattern
+{
+  public:
+    LedPattern(void);
+
+    // Starts whatever `pattern` now holds from its first step; returns false for an unknown value, and puts back the pattern that was playing.
+    bool select(unsigned long now);
+    // Brightness (0..255) at `now`. With LED_PATTERN_NONE this is the heartbeat, meant for LED_BUILTIN only.
+    unsigned char update(unsigned long now);
+    // True while a pattern, rather than the host, owns the LED channel.
+    bool active(void) const { return pattern != LED_PATTERN_NONE; }
+
+    short pattern; // one of the LED_PATTERN_ values; call select() after changing it
+
+  private:
+    short         mSelected;  // the pattern that is playing, which an unknown `pattern` falls back to
+    const LedStep * mSteps;
+    unsigned char mLength;    // steps in the table; the last one closes each cycle
+    unsigned char mRepeats;   // how often the steps before the last one play per cycle
+    unsigned char mStep;
+    unsigned char mPass;
+    unsigned char mFrom;      // level at the start of the current step, for fades
+    unsigned long mStepStart;
+};
+
+#endif // __LedPattern_H__
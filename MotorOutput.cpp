@@ -0,0 +1,63 @@
+#include "MotorOutput.h"
+
+MotorOutput::MotorOutput(MotorDriver & driver) :
+  writes(0),
+  skipped(0),
+  mDriver(driver),
+  mTarget(),
+  mLevel(),
+  mApplied(),
+  mMoving(0),
+  mLastMillis(0)
+{
+  for (unsigned char i = 0; i < MOTOR_CHANNELS; i++) rate[i] = MOTOR_DEFAULT_RATE;
+}
+
+bool MotorOutput::set(unsigned char motor, int pwm, bool ramp)
+{
+  if (motor < 1 || motor > MOTOR_CHANNELS) return false;
+  unsigned char i = motor - 1;
+  unsigned char value = pwm < 0 ? 0 : pwm > 255 ? 255 : pwm;
+  if (!ramp) mLevel[i] = (unsigned int)value << 8;
+  if (value == mTarget[i] && (ramp || !(mMoving & (1 << i)))) return false;
+  mTarget[i] = value; // a ramp already under way just carries on toward the new target
+  mMoving |= 1 << i;
+  return true;
+}
+
+void MotorOutput::assign(unsigned char motor, int pwm)
+{
+  if (!set(motor, pwm)) skipped++;
+}
+
+int MotorOutput::get(unsigned char motor)
+{
+  return (motor < 1 || motor > MOTOR_CHANNELS) ? 0 : mTarget[motor - 1];
+}
+
+int MotorOutput::level(unsigned char motor)
+{
+  return (motor < 1 || motor > MOTOR_CHANNELS) ? 0 : mLevel[motor - 1] >> 8;
+}
+
+void MotorOutput::update(void)
+{
+  unsigned long now = millis();
+  unsigned long elapsed = now - mLastMillis;
+  mLastMillis = now;
+  for (unsigned char i = 0; mMoving >> i; i++)
+  {
+    if (!(mMoving & (1 << i))) continue;
+    unsigned int target = (unsigned int)mTarget[i] << 8;
+    unsigned long step = rate[i] ? ((unsigned long)rate[i] * elapsed * 256UL) / 1000UL : 0xFFFFUL;
+    if (mLevel[i] < target) mLevel[i] = (target - mLevel[i] <= step) ? target : mLevel[i] + step;
+    else                    mLevel[i] = (mLevel[i] - target <= step) ? target : mLevel[i] - step;
+    if (mLevel[i] == target) mMoving &= ~(1 << i);
+
+    unsigned char pwm = mLevel[i] >> 8;
+    if (pwm == mApplied[i]) continue; // still within the same PWM step: nothing for the driver yet
+    mDriver.motor(i + 1, FORWARD, pwm);
+    mApplied[i] = pwm;
+    writes++;
+  }
+}
@@ -0,0 +1,51 @@
+// Shadow and ramp layer between the sketch and MotorDriver.
+//
+// The sketch calls set() as often as it likes (and assign() for every
+// value the host sends, changed or not): that only moves the channel's
+// target.
+// update(), called on every motor pass, moves each channel's level
+// toward its target at that channel's `rate` (so a fan never jumps from
+// 0 to 255 in one step, and a new target simply redirects a ramp that is
+// already under way), then calls MotorDriver::motor() only for the
+// channels whose level really differs from what the driver was last
+// given. Nothing here ever waits.
+
+#ifndef __MotorOutput_H__
+#define __MotorOutput_H__
+
+#include "Arduino.h"
+#include <MotorDriver.h>
+
+#define MOTOR_CHANNELS     4   // MotorDriver channels 1..4
+#define MOTOR_DEFAULT_RATE 128 // PWM steps per second: 0 to full in 2 seconds
+
+class MotorOutput
+{
+  public:
+    MotorOutput(MotorDriver & driver);
+
+    // set() only records the target PWM (clamped to 0..255) for motor 1..MOTOR_CHANNELS; with `ramp` false the next update() jumps straight to it.
+    // Returns false if that changes nothing.
+    bool set(unsigned char motor, int pwm, bool ramp = true);
+    // assign() is set() for a value that the host sent: one that changes nothing is counted in `skipped`.
+    void assign(unsigned char motor, int pwm);
+    int  get(unsigned char motor);   // the target
+    int  level(unsigned char motor); // where the ramp has got to
+
+    // update() advances the ramps by the time since the last call and hands every changed channel to the driver, in one pass.
+    void update(void);
+
+    unsigned int  rate[MOTOR_CHANNELS]; // ramp rate of each channel in PWM steps per second (0 = jump straight to the target)
+    unsigned long writes;  // MotorDriver::motor() calls actually made
+    unsigned long skipped; // assign() calls that would not have changed anything
+
+  private:
+    MotorDriver & mDriver;
+    unsigned char mTarget[MOTOR_CHANNELS];
+    unsigned int  mLevel[MOTOR_CHANNELS];   // in 1/256ths of a PWM step, so that slow ramps still move every pass
+    unsigned char mApplied[MOTOR_CHANNELS]; // what the driver was last given (0 after reset)
+    unsigned char mMoving;                  // bit N set => channel N+1 has not reached its target
+    unsigned long mLastMillis;
+};
+
+#endif // __MotorOutput_H__
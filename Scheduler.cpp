@@ -0,0 +1,43 @@
+#include "Scheduler.h"
+
+Scheduler::Scheduler(Task * tasks, unsigned int numberOfTasks) :
+  maxLoopMicros(0),
+  maxLateMicros(0),
+  loopCount(0),
+  mTasks(tasks),
+  mNumberOfTasks(numberOfTasks),
+  mLastRunMicros(0)
+{
+}
+
+void Scheduler::run(void)
+{
+  unsigned long nowMicros = micros();
+  if (loopCount++ && nowMicros - mLastRunMicros > maxLoopMicros)
+    maxLoopMicros = nowMicros - mLastRunMicros;
+  mLastRunMicros = nowMicros;
+
+  for (unsigned int i = 0; i < mNumberOfTasks; i++)
+  {
+    Task & task = mTasks[i];
+    unsigned long now = micros(); // (not nowMicros: the tasks before this one took time)
+    unsigned long elapsed = now - task.lastRunMicros;
+    unsigned long period = task.periodMillis * 1000UL;
+    if (elapsed < period) continue;
+    if (period)
+    {
+      unsigned long late = elapsed - period;
+      if (late > maxLateMicros) maxLateMicros = late;
+      // keep to the original schedule unless we have fallen a whole period behind
+      task.lastRunMicros = (elapsed < 2 * period) ? task.lastRunMicros + period : now;
+    }
+    else task.lastRunMicros = now;
+    task.function();
+  }
+}
+
+void Scheduler::resetTiming(void)
+{
+  maxLoopMicros = 0;
+  maxLateMicros = 0;
+}
@@ -0,0 +1,45 @@
+// Minimal cooperative task scheduler for the controller sketch.
+//
+// Each task is a plain function that runs whenever its period (in
+// milliseconds) has elapsed. A period of 0 means "run on every pass".
+// Tasks must return quickly and never call delay(), otherwise they
+// starve every other task. The schedule is kept in micros(), so that
+// lateness is measured to the microsecond, which limits periods to the
+// 71 minutes after which micros() wraps.
+
+#ifndef __Scheduler_H__
+#define __Scheduler_H__
+
+#include "Arduino.h"
+
+typedef void (*TaskFunction)(void);
+
+struct Task
+{
+  TaskFunction  function;
+  unsigned long periodMillis;
+  unsigned long lastRunMicros;
+};
+
+class Scheduler
+{
+  public:
+    Scheduler(Task * tasks, unsigned int numberOfTasks);
+
+    // run() is the whole body of loop(): it runs every task that is due.
+    void run(void);
+
+    // Loop timing, measured by run() itself and reset by resetTiming():
+    unsigned long maxLoopMicros;  // longest interval between two successive run() calls
+    unsigned long maxLateMicros;  // worst lateness of a periodic task relative to its schedule
+    unsigned long loopCount;      // number of run() calls
+
+    void resetTiming(void);
+
+  private:
+    Task *        mTasks;
+    unsigned int  mNumberOfTasks;
+    unsigned long mLastRunMicros;
+};
+
+#endif // __Scheduler_H__
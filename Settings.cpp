@@ -0,0 +1,142 @@
+#include "Settings.h"
+#include <string.h>
+
+#ifdef ARDUINO
+#include <EEPROM.h>
+
+static unsigned char storageRead(unsigned int address) { return EEPROM.read(address); }
+static void storageWrite(unsigned int address, unsigned char value) { EEPROM.update(address, value); } // update() skips bytes that are already right, saving wear
+static void storageFlush(void) {}
+
+#else // file-backed stand-in: an image of the EEPROM, loaded on first use and written back after each record
+#include <stdio.h>
+
+static unsigned char sImage[SETTINGS_EEPROM_SIZE];
+static bool sLoaded = false;
+
+static void storageLoad(void)
+{
+  if (sLoaded) return;
+  sLoaded = true;
+  memset(sImage, 0xFF, sizeof(sImage)); // what erased EEPROM reads as
+  FILE * file = fopen(SETTINGS_EEPROM_FILE, "rb");
+  if (!file) return;
+  if (fread(sImage, 1, sizeof(sImage), file)) {}
+  fclose(file);
+}
+static unsigned char storageRead(unsigned int address) { storageLoad(); return sImage[address]; }
+static void storageWrite(unsigned int address, unsigned char value) { storageLoad(); sImage[address] = value; }
+static void storageFlush(void)
+{
+  FILE * file = fopen(SETTINGS_EEPROM_FILE, "wb");
+  if (!file) return;
+  fwrite(sImage, 1, sizeof(sImage), file);
+  fclose(file);
+}
+#endif
+
+Settings::Settings(void) :
+  saves(0),
+  mItemCount(0),
+  mLength(0),
+  mFull(false),
+  mRecord(),
+  mLayout(0),
+  mSlots(0),
+  mSlot(0),
+  mSequence(0),
+  mSavedCrc(0),
+  mPendingCrc(0),
+  mChangedMillis(0),
+  mWriting(0)
+{
+}
+
+bool Settings::_add(void * address, unsigned char size)
+{
+  if (mFull || mItemCount >= SETTINGS_MAX_ITEMS || 2 + mLength + size + 2 > SETTINGS_RECORD_MAX) { mFull = true; return false; }
+  mItems[mItemCount].address = address;
+  mItems[mItemCount].size = size;
+  mItemCount++;
+  mLength += size;
+  return true;
+}
+
+unsigned int Settings::_gather(void)
+{
+  unsigned char * p = mRecord + 2;
+  for (unsigned char i = 0; i < mItemCount; i++)
+  {
+    memcpy(p, mItems[i].address, mItems[i].size);
+    p += mItems[i].size;
+  }
+  return Keyhole::crc16(mRecord + 2, mLength);
+}
+
+bool Settings::begin(unsigned long now)
+{
+  if (mFull) return false; // (and mSlots stays 0, so poll() never saves either)
+  unsigned char layout[1 + SETTINGS_MAX_ITEMS];
+  layout[0] = mItemCount;
+  for (unsigned char i = 0; i < mItemCount; i++) layout[1 + i] = mItems[i].size;
+  mLayout = Keyhole::crc16(layout, 1 + mItemCount);
+  mSlots = SETTINGS_EEPROM_SIZE / _recordLength();
+  mSlot = mSlots - 1; // so that the first save on a blank EEPROM goes to slot 0
+
+  unsigned char recordLength = _recordLength();
+  bool found = false;
+  for (unsigned int slot = 0; slot < mSlots; slot++)
+  {
+    unsigned int address = _slotAddress(slot);
+    for (unsigned char i = 0; i < recordLength; i++) mRecord[i] = storageRead(address + i);
+    unsigned int crc = mRecord[recordLength - 2] | (mRecord[recordLength - 1] << 8);
+    if ((Keyhole::crc16(mRecord, recordLength - 2) ^ mLayout) != crc) continue; // blank, torn, or saved with a different set of variables
+    unsigned int sequence = mRecord[0] | (mRecord[1] << 8);
+    if (found && (int)(short)(sequence - mSequence) <= 0) continue; // compared modulo 2^16, so the counter can wrap
+    found = true;
+    mSlot = slot;
+    mSequence = sequence;
+  }
+  if (found)
+  {
+    unsigned int address = _slotAddress(mSlot) + 2;
+    for (unsigned char i = 0; i < mItemCount; i++)
+    {
+      unsigned char * p = (unsigned char *)mItems[i].address;
+      for (unsigned char j = 0; j < mItems[i].size; j++) p[j] = storageRead(address++);
+    }
+  }
+  mSavedCrc = mPendingCrc = _gather();
+  mChangedMillis = now;
+  return found;
+}
+
+void Settings::poll(unsigned long now)
+{
+  if (!mSlots) return; // begin() has not been called, or the variables did not fit
+  if (mWriting)
+  {
+    // the CRC covers the sequence number too, so a slot left half-written by a reset never passes for a record
+    unsigned char i = 2 + mLength + 2 - mWriting;
+    storageWrite(_slotAddress(mSlot) + i, mRecord[i]);
+    if (--mWriting) return;
+    storageFlush();
+    saves++;
+    return;
+  }
+  unsigned int crc = _gather();
+  if (crc == mSavedCrc) { mPendingCrc = crc; return; }
+  if (crc != mPendingCrc) { mPendingCrc = crc; mChangedMillis = now; return; }
+  if (now - mChangedMillis < SETTINGS_SETTLE_MS) return;
+
+  // settled: stage the record (mRecord already holds the values) and start writing it to the next slot
+  mSlot = (mSlot + 1) % mSlots;
+  mSequence++;
+  mRecord[0] = mSequence & 0xFF;
+  mRecord[1] = (mSequence >> 8) & 0xFF;
+  unsigned int recordCrc = Keyhole::crc16(mRecord, 2 + mLength) ^ mLayout;
+  mRecord[2 + mLength] = recordCrc & 0xFF;
+  mRecord[2 + mLength + 1] = (recordCrc >> 8) & 0xFF;
+  mSavedCrc = crc;
+  mWriting = 2 + mLength + 2;
+}
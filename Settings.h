@@ -0,0 +1,78 @@
+// EEPROM persistence of controller settings.
+//
+// The sketch registers the variables it wants kept with add() and calls
+// begin() once, which restores the newest saved copy. poll() then
+// watches them: a change is only saved once the values have stayed put
+// for SETTINGS_SETTLE_MS (so a host sweeping a fan costs one save, not
+// hundreds), and the save goes to the next slot of a ring, so that the
+// writes are spread over the whole EEPROM. Each slot holds a sequence
+// number, the values and a CRC; begin() picks the valid slot with the
+// newest sequence number, so a save cut short by a reset just leaves the
+// previous one in charge. The slots are as long as the record, and the
+// CRC also covers the layout (how many variables, and the size of each),
+// so a copy saved by a sketch with a different list is never restored.
+// poll() writes at most one byte per call, so it never waits for the
+// EEPROM.
+//
+// Without ARDUINO the EEPROM is a file (SETTINGS_EEPROM_FILE), so that the
+// same code can be exercised on a desktop build.
+
+#ifndef __Settings_H__
+#define __Settings_H__
+
+#include "Keyhole.h"
+
+#ifndef SETTINGS_EEPROM_SIZE
+#define SETTINGS_EEPROM_SIZE 1024   // bytes used, from address 0 (a quarter of the Mega's EEPROM)
+#endif
+#ifndef SETTINGS_RECORD_MAX
+#define SETTINGS_RECORD_MAX  80     // largest record: 2 of sequence number, the values, 2 of CRC
+#endif
+#ifndef SETTINGS_MAX_ITEMS
+#define SETTINGS_MAX_ITEMS   12
+#endif
+#ifndef SETTINGS_SETTLE_MS
+#define SETTINGS_SETTLE_MS   5000UL // how long values must stay unchanged before they are saved
+#endif
+#ifndef SETTINGS_EEPROM_FILE
+#define SETTINGS_EEPROM_FILE "eeprom.bin"
+#endif
+
+class Settings
+{
+  public:
+    Settings(void);
+
+    // Registers a variable (or a whole array) to be kept; returns false if it does not fit in a record, in which
+    // case nothing at all is restored or saved (rather than everything but the variables that did not fit).
+    template< typename T > bool add(T & variable) { return _add(&variable, sizeof(T)); }
+    // Restores the newest valid saved copy into the registered variables; returns false (and changes nothing) if there is none.
+    bool begin(unsigned long now);
+    // Call this every few milliseconds: saves the variables once they have settled, one byte per call.
+    void poll(unsigned long now);
+
+    unsigned long saves; // records completed since reset
+
+  private:
+    bool _add(void * address, unsigned char size);
+    unsigned int _gather(void);   // copies the variables into mRecord, returns their CRC
+    unsigned int _recordLength(void) const { return 2 + mLength + 2; }
+    unsigned int _slotAddress(unsigned int slot) const { return slot * _recordLength(); }
+
+    struct Item { void * address; unsigned char size; };
+    Item          mItems[SETTINGS_MAX_ITEMS];
+    unsigned char mItemCount;
+    unsigned char mLength;        // bytes of values, in mRecord after the sequence number
+    bool          mFull;          // an add() did not fit
+    unsigned char mRecord[SETTINGS_RECORD_MAX];
+    unsigned int  mLayout;        // CRC of the item count and sizes, folded into each record's CRC
+    unsigned int  mSlots;         // slots in the ring (0 until begin(), and if an add() failed)
+    unsigned int  mSlot;          // slot of the newest record
+    unsigned int  mSequence;      // its sequence number
+    unsigned int  mSavedCrc;      // CRC of the values as last saved (or restored)
+    unsigned int  mPendingCrc;    // CRC of the values as last seen changed
+    unsigned long mChangedMillis;
+    unsigned char mWriting;       // bytes of mRecord still to write (0 = not saving)
+};
+
+#endif // __Settings_H__
@@ -0,0 +1,78 @@
+#include "Tachometer.h"
+
+static Tachometer * sTachometer = NULL;
+
+// attachInterrupt() takes plain functions, so one per fan:
+static void tachPulse1(void) { sTachometer->pulse(0); }
+static void tachPulse2(void) { sTachometer->pulse(1); }
+static void tachPulse3(void) { sTachometer->pulse(2); }
+static void (* const sPulseFunctions[TACH_FANS])(void) = { tachPulse1, tachPulse2, tachPulse3 };
+
+Tachometer::Tachometer(void) :
+  rpm(),
+  overruns(0),
+  mHead(0),
+  mTail(0),
+  mOverruns(0),
+  mOverrunsSeen(0),
+  mFirstMicros(),
+  mLastMicros(),
+  mPulses(),
+  mWindowMillis(0)
+{
+}
+
+void Tachometer::begin(const uint8_t pins[TACH_FANS])
+{
+  if (sTachometer) return;
+  sTachometer = this;
+  mWindowMillis = millis();
+  for (unsigned char i = 0; i < TACH_FANS; i++)
+  {
+    int interrupt = digitalPinToInterrupt(pins[i]);
+    if (interrupt == NOT_AN_INTERRUPT) continue;
+    pinMode(pins[i], INPUT_PULLUP); // tach outputs are open-collector
+    attachInterrupt(interrupt, sPulseFunctions[i], FALLING);
+  }
+}
+
+void Tachometer::pulse(unsigned char fan)
+{
+  // Interrupt context: one timestamp, one store, one index update.
+  unsigned char head = mHead;
+  unsigned char next = (head + 1) & (TACH_RING_SIZE - 1);
+  if (next == mTail) { mOverruns++; return; }
+  mRing[head].micros = micros();
+  mRing[head].fan = fan;
+  mHead = next; // publish the sample only once it is complete
+}
+
+void Tachometer::update(void)
+{
+  for (unsigned char n = 0; n < TACH_DRAIN_MAX && mTail != mHead; n++)
+  {
+    unsigned char tail = mTail;
+    unsigned long t = mRing[tail].micros;
+    unsigned char fan = mRing[tail].fan;
+    mTail = (tail + 1) & (TACH_RING_SIZE - 1); // hand the slot back to the ISR
+    if (mPulses[fan] && t - mLastMicros[fan] < TACH_MIN_PERIOD_US) continue;
+    if (!mPulses[fan]) mFirstMicros[fan] = t;
+    mLastMicros[fan] = t;
+    if (mPulses[fan] < 0xFFFF) mPulses[fan]++;
+  }
+  unsigned char seen = mOverruns; // a single byte, so it is read atomically
+  overruns += (unsigned char)(seen - mOverrunsSeen);
+  mOverrunsSeen = seen;
+
+  if (millis() - mWindowMillis < TACH_WINDOW_MS) return;
+  mWindowMillis += TACH_WINDOW_MS;
+  for (unsigned char i = 0; i < TACH_FANS; i++)
+  {
+    unsigned long span = mLastMicros[i] - mFirstMicros[i];
+    if (mPulses[i] >= 2 && span) rpm[i] = 60000000UL / TACH_PULSES_PER_REV / (span / (mPulses[i] - 1));
+    else rpm[i] = 0; // a stalled (or unconnected) fan
+    // the next window starts at this window's last pulse, so no period is lost in between (unless the fan has stopped)
+    mFirstMicros[i] = mLastMicros[i];
+    mPulses[i] = (mPulses[i] >= 2) ? 1 : 0;
+  }
+}
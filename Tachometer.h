@@ -0,0 +1,55 @@
+// Fan tachometer capture for the controller sketch.
+//
+// Each fan's tach output drives an external interrupt. The ISR does as
+// little as possible: it timestamps the pulse and pushes it into a
+// single-producer/single-consumer ring, which it alone writes the head
+// of. update(), called from loop(), is the only consumer: it drains at
+// most TACH_DRAIN_MAX pulses per call (so a burst can never hold up
+// Keyhole) and turns them into revolutions per minute once every
+// TACH_WINDOW_MS. Neither side ever disables interrupts.
+
+#ifndef __Tachometer_H__
+#define __Tachometer_H__
+
+#include "Arduino.h"
+
+#define TACH_FANS           3
+#define TACH_RING_SIZE      32    // must be a power of 2 (and at most 256)
+#define TACH_DRAIN_MAX      8     // pulses handled per update() call
+#define TACH_WINDOW_MS      1000  // how often rpm[] is recomputed
+#define TACH_PULSES_PER_REV 2     // standard for PC fans
+#define TACH_MIN_PERIOD_US  1000  // pulses closer together than this are treated as noise (limits rpm to 30000)
+
+class Tachometer
+{
+  public:
+    Tachometer(void);
+
+    // Attaches the interrupts (once). Pins that cannot interrupt are skipped, and their fans read 0 rpm.
+    void begin(const uint8_t pins[TACH_FANS]);
+    // Call this on every pass of loop().
+    void update(void);
+
+    unsigned int  rpm[TACH_FANS];  // 0 if the fan has not pulsed during the last window
+    unsigned long overruns;        // pulses dropped because the ring was full
+
+    void pulse(unsigned char fan); // for the ISRs only
+
+  private:
+    struct Sample
+    {
+      unsigned long micros;
+      unsigned char fan;
+    };
+    volatile Sample        mRing[TACH_RING_SIZE];
+    volatile unsigned char mHead;          // written only by the ISRs
+    volatile unsigned char mTail;          // written only by update()
+    volatile unsigned char mOverruns;      // written only by the ISRs, folded into `overruns` by update()
+    unsigned char          mOverrunsSeen;
+    unsigned long mFirstMicros[TACH_FANS]; // first and last pulse of the current window
+    unsigned long mLastMicros[TACH_FANS];
+    unsigned int  mPulses[TACH_FANS];      // pulses in the current window
+    unsigned long mWindowMillis;
+};
+
+#endif // __Tachometer_H__
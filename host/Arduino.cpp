@@ -0,0 +1,255 @@
+#include "Arduino.h"
+#include <stdio.h>
+#include <chrono>
+
+HardwareSerial Serial;
+
+int  hostAnalogValue[HOST_PINS];
+int  hostPinLevel[HOST_PINS];
+void (*hostInterrupt[6])(void);
+
+static bool sManualClock = false;
+static unsigned long sManualMicros = 0;
+static const std::chrono::steady_clock::time_point sStart = std::chrono::steady_clock::now();
+
+unsigned long micros(void)
+{
+  if (sManualClock) return sManualMicros;
+  return (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - sStart).count();
+}
+
+unsigned long millis(void)
+{
+  return micros() / 1000;
+}
+
+void hostUseManualClock(bool manual)
+{
+  if (manual && !sManualClock) sManualMicros = micros();
+  sManualClock = manual;
+}
+
+void hostAdvanceMicros(unsigned long us) { sManualMicros += us; }
+void hostAdvanceMillis(unsigned long ms) { sManualMicros += ms * 1000UL; }
+
+void delay(unsigned long ms) { if (sManualClock) hostAdvanceMillis(ms); }
+void delayMicroseconds(unsigned int us) { if (sManualClock) hostAdvanceMicros(us); }
+
+void pinMode(uint8_t, uint8_t) {}
+void digitalWrite(uint8_t pin, uint8_t value) { if (pin < HOST_PINS) hostPinLevel[pin] = value; }
+int  digitalRead(uint8_t pin) { return pin < HOST_PINS ? hostPinLevel[pin] : LOW; }
+int  analogRead(uint8_t pin) { return pin < HOST_PINS ? hostAnalogValue[pin] : 0; }
+void analogWrite(uint8_t pin, int value) { if (pin < HOST_PINS) hostPinLevel[pin] = value; }
+
+int digitalPinToInterrupt(uint8_t pin)
+{
+  switch (pin)
+  {
+    case 2:  return 0;
+    case 3:  return 1;
+    case 18: return 5;
+    case 19: return 4;
+    case 20: return 3;
+    case 21: return 2;
+  }
+  return NOT_AN_INTERRUPT;
+}
+
+void attachInterrupt(uint8_t interrupt, void (*isr)(void), int) { if (interrupt < 6) hostInterrupt[interrupt] = isr; }
+void detachInterrupt(uint8_t interrupt) { if (interrupt < 6) hostInterrupt[interrupt] = NULL; }
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// String: like the AVR core's WString, the buffer is reallocated to the exact length whenever it has to grow.
+
+unsigned long String::allocations = 0;
+
+String::String(const char * s) : mBuffer(NULL), mCapacity(0), mLength(0) { *this = s; }
+String::String(const String & other) : mBuffer(NULL), mCapacity(0), mLength(0) { *this = other; }
+String::~String() { free(mBuffer); }
+
+bool String::reserve(unsigned int size)
+{
+  if (mBuffer && mCapacity >= size) return true;
+  char * buffer = (char *)realloc(mBuffer, size + 1);
+  if (!buffer) return false;
+  allocations++;
+  if (!mBuffer) buffer[0] = '\0';
+  mBuffer = buffer;
+  mCapacity = size;
+  return true;
+}
+
+bool String::concat(const char * s, unsigned int length)
+{
+  if (!reserve(mLength + length)) return false;
+  memcpy(mBuffer + mLength, s, length);
+  mLength += length;
+  mBuffer[mLength] = '\0';
+  return true;
+}
+
+String & String::operator=(const String & other)
+{
+  if (this == &other) return *this;
+  mLength = 0;
+  concat(other.c_str(), other.length());
+  return *this;
+}
+
+String & String::operator=(const char * s)
+{
+  mLength = 0;
+  if (mBuffer) mBuffer[0] = '\0';
+  concat(s ? s : "", s ? strlen(s) : 0);
+  return *this;
+}
+
+String & String::operator+=(char c) { concat(&c, 1); return *this; }
+String & String::operator+=(const char * s) { concat(s, strlen(s)); return *this; }
+String & String::operator+=(const String & other) { concat(other.c_str(), other.length()); return *this; }
+
+void String::remove(unsigned int index)
+{
+  if (index >= mLength) return;
+  mLength = index;
+  mBuffer[mLength] = '\0';
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Print: number formatting as in the AVR core (including its fixed-decimal floats)
+
+size_t Print::write(const uint8_t * buffer, size_t size)
+{
+  size_t n = 0;
+  while (size--) n += write(*buffer++);
+  return n;
+}
+
+size_t Print::printNumber(unsigned long n, uint8_t base)
+{
+  char text[8 * sizeof(long) + 1];
+  char * p = text + sizeof(text) - 1;
+  *p = '\0';
+  if (base < 2) base = 10;
+  do { unsigned long digit = n % base; n /= base; *--p = digit < 10 ? '0' + digit : 'A' + digit - 10; } while (n);
+  return write(p);
+}
+
+size_t Print::print(long n, int base)
+{
+  if (base == DEC && n < 0) return print('-') + printNumber(0UL - (unsigned long)n, DEC);
+  return printNumber((unsigned long)n, base);
+}
+
+size_t Print::print(unsigned long n, int base)
+{
+  return printNumber(n, base);
+}
+
+size_t Print::print(double number, int digits)
+{
+  if (isnan(number)) return print("nan");
+  if (isinf(number)) return print("inf");
+  if (number > 4294967040.0 || number < -4294967040.0) return print("ovf");
+  char text[48];
+  snprintf(text, sizeof(text), "%.*f", digits, number);
+  return print(text);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+ScriptedStream::ScriptedStream(void) :
+  baud(0),
+  txSize(64),
+  capture(true),
+  bytesWritten(0),
+  writeCalls(0),
+  flushCalls(0),
+  blockedMicros(0),
+  mInputPosition(0),
+  mTxQueued(0),
+  mTxMicros(0)
+{
+}
+
+void ScriptedStream::script(const char * text, size_t length)
+{
+  if (mInputPosition == mInput.size()) { mInput.clear(); mInputPosition = 0; }
+  mInput.append(text, length ? length : strlen(text));
+}
+
+std::string ScriptedStream::take(void)
+{
+  std::string result;
+  result.swap(output);
+  return result;
+}
+
+void ScriptedStream::reset(void)
+{
+  mInput.clear();
+  mInputPosition = 0;
+  output.clear();
+  bytesWritten = writeCalls = flushCalls = blockedMicros = 0;
+  mTxQueued = 0;
+  mTxMicros = micros();
+}
+
+int ScriptedStream::available(void) { return (int)(mInput.size() - mInputPosition); }
+int ScriptedStream::read(void) { return mInputPosition < mInput.size() ? (unsigned char)mInput[mInputPosition++] : -1; }
+int ScriptedStream::peek(void) { return mInputPosition < mInput.size() ? (unsigned char)mInput[mInputPosition] : -1; }
+
+void ScriptedStream::_drainTx(void)
+{
+  unsigned long now = micros();
+  if (!baud) { mTxQueued = 0; mTxMicros = now; return; }
+  unsigned long sent = (unsigned long)((unsigned long long)(now - mTxMicros) * baud / 10 / 1000000UL);
+  if (sent >= mTxQueued) { mTxQueued = 0; mTxMicros = now; return; }
+  mTxQueued -= sent;
+  mTxMicros += (unsigned long)((unsigned long long)sent * 10 * 1000000UL / baud);
+}
+
+void ScriptedStream::_waitForTx(unsigned long bytes)
+{
+  // Wait until `bytes` bytes have left the TX queue (as a real write() into a full buffer would).
+  unsigned long wait = (unsigned long)(((unsigned long long)bytes * 10 * 1000000UL + baud - 1) / baud);
+  blockedMicros += wait;
+  hostAdvanceMicros(wait); // (no effect on the real clock, where the wait is only accounted for)
+  mTxQueued -= bytes;
+  mTxMicros = micros();
+}
+
+size_t ScriptedStream::write(uint8_t c)
+{
+  return write(&c, 1);
+}
+
+size_t ScriptedStream::write(const uint8_t * buffer, size_t size)
+{
+  writeCalls++;
+  bytesWritten += size;
+  if (capture) output.append((const char *)buffer, size);
+  if (!baud) return size;
+  _drainTx();
+  for (size_t i = 0; i < size; i++)
+  {
+    if (mTxQueued >= txSize) _waitForTx(1);
+    mTxQueued++;
+  }
+  return size;
+}
+
+int ScriptedStream::availableForWrite(void)
+{
+  if (!baud) return txSize;
+  _drainTx();
+  return (int)(txSize - mTxQueued);
+}
+
+void ScriptedStream::flush(void)
+{
+  flushCalls++;
+  if (!baud) return;
+  _drainTx();
+  if (mTxQueued) _waitForTx(mTxQueued);
+}
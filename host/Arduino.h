@@ -0,0 +1,159 @@
+// Minimal stand-in for the Arduino core, for building the sketch's modules
+// (Keyhole, Scheduler, MotorOutput, FanController...) on Linux.
+//
+// It provides only what this repository uses: Print, Stream and String
+// with the same interfaces and the same quirks as the AVR core (String
+// reallocates to the exact length on every append, Print::print(double)
+// prints fixed decimals), millis()/micros(), and pin functions that just
+// record what the sketch did. F(), PSTR() and PROGMEM are accepted (and
+// read from ordinary memory). The clock is real by default; a test can
+// switch it to a manual clock and advance it explicitly, so that timed
+// behaviour runs the same on every machine.
+//
+// Serial is a ScriptedStream (see ScriptedStream.h): input is scripted by
+// the test, and output is captured and paced at the configured baud rate.
+
+#ifndef __Arduino_H__
+#define __Arduino_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#define HIGH 1
+#define LOW  0
+#define INPUT        0
+#define OUTPUT       1
+#define INPUT_PULLUP 2
+#define CHANGE  1
+#define FALLING 2
+#define RISING  3
+#define NOT_AN_INTERRUPT -1
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+#define LED_BUILTIN 13
+#define A0 54 // as on a Mega
+#define HOST_PINS 70
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+// Program memory: on AVR, PROGMEM data and F()/PSTR() strings stay in flash instead of being copied to SRAM, and must be
+// read with pgm_read_byte() or the *_P functions. On the host, flash is ordinary memory.
+class __FlashStringHelper;
+#define PROGMEM
+#define PSTR(s) (s)
+#define F(s) (reinterpret_cast<const __FlashStringHelper *>(PSTR(s)))
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+#define strncmp_P strncmp
+#define strcpy_P strcpy
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int  digitalRead(uint8_t pin);
+int  analogRead(uint8_t pin);
+void analogWrite(uint8_t pin, int value);
+int  digitalPinToInterrupt(uint8_t pin); // the Mega's six external interrupts: pins 2, 3, 18, 19, 20 and 21
+void attachInterrupt(uint8_t interrupt, void (*isr)(void), int mode);
+void detachInterrupt(uint8_t interrupt);
+
+// Host-only controls, for tests:
+void hostUseManualClock(bool manual);    // with a manual clock, time only moves when a test (or a blocking write) moves it
+void hostAdvanceMicros(unsigned long us);
+void hostAdvanceMillis(unsigned long ms);
+extern int  hostAnalogValue[HOST_PINS];  // what analogRead() returns for each pin
+extern int  hostPinLevel[HOST_PINS];     // what digitalWrite() last wrote to each pin
+extern void (*hostInterrupt[6])(void);   // what attachInterrupt() attached to each interrupt (call it to simulate an edge)
+
+class String
+{
+  public:
+    String(const char * s = "");
+    String(const String & other);
+    ~String();
+    String & operator=(const String & other);
+    String & operator=(const char * s);
+    String & operator+=(char c);
+    String & operator+=(const char * s);
+    String & operator+=(const String & other);
+    bool concat(const char * s, unsigned int length);
+    bool reserve(unsigned int size);
+    unsigned int length(void) const { return mLength; }
+    const char * c_str(void) const { return mBuffer ? mBuffer : ""; }
+    char operator[](unsigned int index) const { return index < mLength ? mBuffer[index] : 0; }
+    void setCharAt(unsigned int index, char c) { if (index < mLength) mBuffer[index] = c; }
+    void remove(unsigned int index);
+    bool operator==(const char * s) const { return strcmp(c_str(), s) == 0; }
+    bool operator!=(const char * s) const { return !(*this == s); }
+
+    static unsigned long allocations; // calls to malloc()/realloc(), so a benchmark can show heap traffic
+
+  private:
+    char *       mBuffer;
+    unsigned int mCapacity;
+    unsigned int mLength;
+};
+
+class Print
+{
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t * buffer, size_t size);
+    size_t write(const char * s) { return s ? write((const uint8_t *)s, strlen(s)) : 0; }
+    size_t write(const char * buffer, size_t size) { return write((const uint8_t *)buffer, size); }
+    virtual int availableForWrite(void) { return 0; }
+    virtual void flush(void) {}
+
+    size_t print(const char * s) { return write(s); }
+    size_t print(const __FlashStringHelper * s) { return write(reinterpret_cast<const char *>(s)); }
+    size_t print(const String & s) { return write(s.c_str(), s.length()); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(unsigned char n, int base = DEC) { return print((unsigned long)n, base); }
+    size_t print(int n, int base = DEC) { return print((long)n, base); }
+    size_t print(unsigned int n, int base = DEC) { return print((unsigned long)n, base); }
+    size_t print(long n, int base = DEC);
+    size_t print(unsigned long n, int base = DEC);
+    size_t print(double n, int digits = 2);
+
+    size_t println(void) { return write("\r\n"); }
+    template< typename T > size_t println(const T & x) { size_t n = print(x); return n + println(); }
+    template< typename T > size_t println(const T & x, int format) { size_t n = print(x, format); return n + println(); }
+
+  private:
+    size_t printNumber(unsigned long n, uint8_t base);
+};
+
+class Stream : public Print
+{
+  public:
+    virtual int available(void) = 0;
+    virtual int read(void) = 0;
+    virtual int peek(void) = 0;
+};
+
+#include "ScriptedStream.h"
+
+class HardwareSerial : public ScriptedStream
+{
+  public:
+    void begin(unsigned long rate) { baud = rate; }
+    void end(void) { flush(); }
+    operator bool(void) { return true; }
+};
+
+extern HardwareSerial Serial;
+
+#endif // __Arduino_H__
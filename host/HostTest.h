@@ -0,0 +1,41 @@
+// Just enough of a test framework for the host tests: CHECK() and
+// CHECK_EQUAL() report the file and line of each failure and keep going,
+// and hostTestResult() is what main() returns.
+
+#ifndef __HostTest_H__
+#define __HostTest_H__
+
+#include <stdio.h>
+#include <string>
+
+static int sHostTestChecks = 0;
+static int sHostTestFailures = 0;
+
+#define CHECK(CONDITION) \
+  do { sHostTestChecks++; if (!(CONDITION)) { sHostTestFailures++; printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #CONDITION); } } while (0)
+
+#define CHECK_EQUAL(EXPECTED, ACTUAL) \
+  do { sHostTestChecks++; std::string _expected(EXPECTED), _actual(ACTUAL); \
+       if (_expected != _actual) { sHostTestFailures++; printf("%s:%d: expected\n  %s\nbut got\n  %s\n", __FILE__, __LINE__, hostTestEscape(_expected).c_str(), hostTestEscape(_actual).c_str()); } } while (0)
+
+static inline std::string hostTestEscape(const std::string & s)
+{
+  std::string escaped;
+  for (size_t i = 0; i < s.size(); i++)
+  {
+    unsigned char c = s[i];
+    if (c == '\r') escaped += "\\r";
+    else if (c == '\n') escaped += "\\n";
+    else if (c < 32 || c > 126) { char hex[8]; snprintf(hex, sizeof(hex), "\\x%02X", c); escaped += hex; }
+    else escaped += (char)c;
+  }
+  return escaped;
+}
+
+static inline int hostTestResult(const char * name)
+{
+  printf("%s: %d checks, %d failed\n", name, sHostTestChecks, sHostTestFailures);
+  return sHostTestFailures ? 1 : 0;
+}
+
+#endif // __HostTest_H__
@@ -0,0 +1,24 @@
+// Stand-in for the MotorDriver library (https://github.com/CuriosityGym/motordriver),
+// for building the sketch on Linux: it only records what each motor was last given.
+
+#ifndef __MotorDriver_H__
+#define __MotorDriver_H__
+
+#include "Arduino.h"
+
+#define FORWARD  1
+#define BACKWARD 2
+#define BRAKE    3
+#define RELEASE  4
+
+class MotorDriver
+{
+  public:
+    MotorDriver(void) : calls(0) { memset(pwm, 0, sizeof(pwm)); }
+    void motor(uint8_t motorNumber, uint8_t command, uint8_t speed) { if (motorNumber >= 1 && motorNumber <= 4) pwm[motorNumber] = command == FORWARD ? speed : 0; calls++; }
+
+    uint8_t       pwm[5]; // by motor number (1..4)
+    unsigned long calls;
+};
+
+#endif // __MotorDriver_H__
@@ -0,0 +1,56 @@
+// In-memory Stream for host builds.
+//
+// The test scripts what the "host" sends with script(), and reads back
+// what the sketch wrote from `output`. Transmission is modelled like a
+// UART: with `baud` set, written bytes go into a TX queue of `txSize`
+// bytes that empties at baud/10 bytes per second of micros() time, and
+// availableForWrite() reports the room in it. A write() into a full
+// queue, or a flush(), has to wait for it to empty: that wait is added
+// to `blockedMicros` (and, with the manual clock, actually passes), so a
+// test can check that something never waits. With `baud` 0 the link is
+// infinitely fast.
+
+#ifndef __ScriptedStream_H__
+#define __ScriptedStream_H__
+
+#include <string>
+
+class ScriptedStream : public Stream
+{
+  public:
+    ScriptedStream(void);
+
+    // Queues bytes for the sketch to read (length 0 means up to the first '\0').
+    void script(const char * text, size_t length = 0);
+    // Returns everything written since the last call, and forgets it.
+    std::string take(void);
+    void reset(void);
+
+    int    available(void);
+    int    read(void);
+    int    peek(void);
+    size_t write(uint8_t c);
+    size_t write(const uint8_t * buffer, size_t size);
+    using  Print::write;
+    int    availableForWrite(void);
+    void   flush(void);
+
+    unsigned long baud;          // 0 = no transmission delay
+    unsigned int  txSize;        // capacity of the TX queue (64 bytes, as in the AVR core)
+    bool          capture;       // set to false to discard output (e.g. in benchmarks)
+    std::string   output;
+    unsigned long bytesWritten;
+    unsigned long writeCalls;
+    unsigned long flushCalls;
+    unsigned long blockedMicros; // total time that writes and flushes have had to wait for the TX queue
+
+  private:
+    std::string   mInput;
+    size_t        mInputPosition;
+    unsigned long mTxQueued;     // bytes in the TX queue as of mTxMicros
+    unsigned long mTxMicros;
+    void          _drainTx(void);
+    void          _waitForTx(unsigned long bytes);
+};
+
+#endif // __ScriptedStream_H__
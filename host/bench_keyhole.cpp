@@ -0,0 +1,193 @@
+// Host micro-benchmarks of Keyhole, for catching performance regressions
+// and comparing optimisations without hardware. Absolute numbers are for
+// the host CPU only: compare runs of the same machine and build flags.
+//
+//   make bench
+
+#include "Keyhole.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+
+static double nowNanoseconds(void)
+{
+  return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Runs `body` `iterations` times, best of three, and returns nanoseconds per iteration.
+template< typename F > static double measure(unsigned long iterations, F body)
+{
+  double best = 1e30;
+  for (int run = 0; run < 3; run++)
+  {
+    double start = nowNanoseconds();
+    for (unsigned long i = 0; i < iterations; i++) body();
+    double elapsed = (nowNanoseconds() - start) / iterations;
+    if (elapsed < best) best = elapsed;
+  }
+  return best;
+}
+
+class NullPrint : public Print
+{
+  public:
+    NullPrint(void) : bytes(0) {}
+    size_t write(uint8_t) { bytes++; return 1; }
+    size_t write(const uint8_t *, size_t size) { bytes += size; return size; }
+    using Print::write;
+    unsigned long bytes;
+};
+
+static bool           vBool;
+static char           vChar;
+static int8_t         vInt8;
+static unsigned char  vUChar;
+static int            vInt;
+static unsigned int   vUInt;
+static short          vShort;
+static unsigned short vUShort;
+static long           vLong;
+static unsigned long  vULong;
+static float          vFloat;
+static double         vDouble;
+static String         vString;
+
+// key, variable, an assignment to time
+#define BENCH_VARIABLES( X ) \
+  X( "b",   vBool,   "b=1" ) \
+  X( "c",   vChar,   "c=65" ) \
+  X( "i8",  vInt8,   "i8=-5" ) \
+  X( "uc",  vUChar,  "uc=200" ) \
+  X( "i",   vInt,    "i=-1234" ) \
+  X( "ui",  vUInt,   "ui=1234" ) \
+  X( "s",   vShort,  "s=-300" ) \
+  X( "us",  vUShort, "us=300" ) \
+  X( "l",   vLong,   "l=-100000" ) \
+  X( "ul",  vULong,  "ul=100000" ) \
+  X( "f",   vFloat,  "f=0.25" ) \
+  X( "d",   vDouble, "d=3.14159" ) \
+  X( "str", vString, "str=\"hello\"" )
+
+static Keyhole registered(Serial);   // variables registered with expose(), dispatched by begin()
+static Keyhole unregistered(Serial); // variables passed to variable() on every pass, as in the original Keyhole examples
+
+static void passRegistered(void)
+{
+  if (registered.begin()) registered.end();
+}
+
+static void passUnregistered(void)
+{
+  if (!unregistered.begin()) return;
+#define VARIABLE_CALL( KEY, VAR, ASSIGNMENT ) unregistered.variable(KEY, VAR);
+  BENCH_VARIABLES( VARIABLE_CALL )
+  unregistered.end();
+}
+
+static double command(void (*pass)(void), const char * text)
+{
+  std::string line = std::string(text) + "\n";
+  return measure(50000, [&]() { Serial.script(line.c_str(), line.size()); pass(); });
+}
+
+// A binary-protocol frame as the host would send it: [op][index][type][payload], COBS-encoded and delimited
+static std::string frame(uint8_t op, uint8_t index, uint8_t type = 0, const std::string & payload = "")
+{
+  std::string body = std::string(1, (char)op) + (char)index;
+  if (op == KEYHOLE_FRAME_SET) body += (char)type + payload;
+  unsigned int crc = Keyhole::crc16((const uint8_t *)body.data(), body.size());
+  body += (char)(crc & 0xFF);
+  body += (char)(crc >> 8);
+  std::string encoded(1, '\0');
+  size_t code = 0;
+  for (size_t i = 0; i < body.size(); i++)
+  {
+    if (body[i]) { encoded += body[i]; continue; }
+    encoded[code] = (char)(encoded.size() - code);
+    code = encoded.size();
+    encoded += '\0';
+  }
+  encoded[code] = (char)(encoded.size() - code);
+  return encoded + '\0';
+}
+
+template< typename T > static std::string payload(const T & value) { return std::string((const char *)&value, sizeof value); }
+static std::string payload(const String & value) { return std::string(value.c_str(), value.length()); }
+
+static double binaryCommand(const std::string & bytes)
+{
+  return measure(50000, [&]() { Serial.script(bytes.data(), bytes.size()); passRegistered(); });
+}
+
+int main(void)
+{
+  Serial.capture = false;
+  char label[40];
+#define EXPOSE( KEY, VAR, ASSIGNMENT ) registered.expose(KEY, VAR);
+  BENCH_VARIABLES( EXPOSE )
+
+  printf("%-36s %10s\n", "benchmark", "ns/op");
+  printf("%-36s %10.1f\n", "begin() idle, 13 registered", measure(500000, passRegistered));
+  printf("%-36s %10.1f\n", "begin() idle, 13 via variable()", measure(500000, passUnregistered));
+
+#define TIME_TYPE( KEY, VAR, ASSIGNMENT ) \
+  printf("%-36s %10.1f %10.1f %10.1f %10.1f\n", "  " ASSIGNMENT, \
+    command(passRegistered, ASSIGNMENT), command(passRegistered, KEY), \
+    command(passUnregistered, ASSIGNMENT), command(passUnregistered, KEY));
+  printf("%-36s %10s %10s %10s %10s\n", "dispatch per command (incl. begin/end)", "set/reg", "query/reg", "set/var()", "query/var()");
+  BENCH_VARIABLES( TIME_TYPE )
+
+  printf("%-36s %10.1f\n", "? listing, 13 registered", command(passRegistered, "?"));
+  printf("%-36s %10.1f\n", "? listing, 13 via variable()", command(passUnregistered, "?"));
+
+  // The same assignments and queries in the binary protocol, next to their text equivalents (registered variables
+  // only: nothing else can be reached in binary). The assignments set each variable to the value it already has.
+  unsigned char index = 0;
+  command(passRegistered, "binary");
+#define TIME_BINARY( KEY, VAR, ASSIGNMENT ) \
+  printf("%-36s %10.1f %10.1f\n", "  " KEY, \
+    binaryCommand(frame(KEYHOLE_FRAME_SET, index, KeyholeTraits< decltype( VAR ) >::type, payload(VAR))), \
+    binaryCommand(frame(KEYHOLE_FRAME_GET, index))); \
+  index++;
+  printf("%-36s %10s %10s\n", "binary protocol, per frame", "set/reg", "query/reg");
+  BENCH_VARIABLES( TIME_BINARY )
+  printf("%-36s %10.1f\n", "LIST, 13 registered", binaryCommand(frame(KEYHOLE_FRAME_LIST, 0)));
+  binaryCommand(frame(KEYHOLE_FRAME_TEXT, 0));
+
+  // Receiving: the same 60-byte command, read into the fixed command buffer (KEYHOLE_BUFFER_SIZE > 0) or, in the
+  // bench_keyhole_string build (KEYHOLE_BUFFER_SIZE 0), into a String that grows one character at a time.
+  std::string padded = "d=" + std::string(55, ' ') + "1.5";
+  unsigned long allocations = String::allocations;
+  double perCommand = command(passRegistered, padded.c_str());
+  allocations = String::allocations - allocations;
+  snprintf(label, sizeof(label), "receive, %s buffer", KEYHOLE_BUFFER_SIZE ? "fixed" : "String");
+  printf("%-36s %10.1f  (%.2f ns/byte, %.1f allocations/command)\n", label, perCommand, perCommand / (padded.size() + 1), allocations / (3 * 50000.0));
+
+  NullPrint out;
+  const char * text = "look at these escaped characters: \" \x08 \\ \t\r\n";
+  unsigned int length = strlen(text);
+  double perString = measure(300000, [&]() { Keyhole::printLiteral(out, text, length, '"'); });
+  snprintf(label, sizeof(label), "printLiteral(String), %u chars", length);
+  printf("%-36s %10.1f  (%.0f MB/s in)\n", label, perString, length * 1e3 / perString);
+  double values[] = { 0.1, 3.14159, 1e20, 2.5e-7, 255.0, 12345.678 };
+  unsigned int v = 0;
+  printf("%-36s %10.1f\n", "printLiteral(double)", measure(300000, [&]() { Keyhole::printLiteral(out, values[v++ % 6], '"', false); }));
+  printf("%-36s %10.1f\n", "printLiteral(float)", measure(300000, [&]() { Keyhole::printLiteral(out, values[v++ % 6], '"', true); }));
+  printf("%-36s %10.1f\n", "printLiteral(char)", measure(300000, [&]() { Keyhole::printLiteral(out, (char)('a' + v++ % 26), '"'); }));
+
+  // Parsing numbers, against the C library over the same inputs (which the C library accepts just as well).
+  const char * integers[] = { "0", "-5", "200", "-1234", "65535", "-100000", "4294967295", "0x7FFF" };
+  const char * decimals[] = { "0.25", "3.14159", "-300", "1e20", "2.5e-7", "12345.678", "0.1", "-1.17549435e-38" };
+  volatile double sink = 0;
+  char * end;
+  printf("%-36s %10s %10s %10s\n", "parse, per number", "Keyhole", "strtol", "strtoul");
+  printf("%-36s %10.1f %10.1f %10.1f\n", "  integers",
+    measure(300000, [&]() { unsigned long magnitude; bool negative; Keyhole::parseInteger(integers[v++ % 8], &end, magnitude, negative); sink = sink + magnitude; }),
+    measure(300000, [&]() { sink = sink + strtol(integers[v++ % 8], &end, 0); }),
+    measure(300000, [&]() { sink = sink + strtoul(integers[v++ % 8], &end, 0); }));
+  printf("%-36s %10s %10s\n", "", "Keyhole", "strtod");
+  printf("%-36s %10.1f %10.1f\n", "  decimals",
+    measure(300000, [&]() { double value; Keyhole::parseDecimal(decimals[v++ % 8], &end, value); sink = sink + value; }),
+    measure(300000, [&]() { sink = sink + strtod(decimals[v++ % 8], &end); }));
+  return 0;
+}
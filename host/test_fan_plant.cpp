@@ -0,0 +1,127 @@
+// Closed-loop tests of FanController against a simulated thermal plant:
+// a first-order lump of heat capacity `C`, heated with `power` watts and
+// cooled toward ambient through a conductance that the fans raise.
+
+#include "FanController.h"
+#include "HostTest.h"
+#include <math.h>
+
+#define DT 0.1f // the sketch's CONTROL_PERIOD_MS
+
+struct Plant
+{
+  Plant(void) : temperature(25.0f), ambient(25.0f), power(20.0f), capacity(200.0f), still(0.2f), fanned(1.0f) {}
+
+  // Conductance to ambient in W/K at fan PWM `pwm` (0..255)
+  float conductance(float pwm) const { return still + fanned * pwm / FAN_PWM_MAX; }
+  void  step(float pwm, float dt) { temperature += (power - conductance(pwm) * (temperature - ambient)) * dt / capacity; }
+  // The temperature at which the plant would settle with the fans fixed at `pwm`
+  float settled(float pwm) const { return ambient + power / conductance(pwm); }
+
+  float temperature, ambient, power, capacity, still, fanned;
+};
+
+// Runs the loop for `seconds`; returns how far the PWM moved in the last 60 s.
+static float run(FanController & control, Plant & plant, float seconds)
+{
+  float low = FAN_PWM_MAX, high = 0.0f;
+  for (float t = 0.0f; t < seconds; t += DT)
+  {
+    float pwm = control.step(plant.temperature, DT);
+    plant.step(pwm, DT);
+    if (t >= seconds - 60.0f) { if (pwm < low) low = pwm; if (pwm > high) high = pwm; }
+  }
+  return high - low;
+}
+
+// Curve mode settles where the curve and the plant agree: T = settled(curve(T)).
+static void testCurveSettles(void)
+{
+  FanController control;
+  Plant plant;
+  control.mode = FAN_MODE_CURVE;
+  control.reset(0.0f);
+  float wobble = run(control, plant, 3600.0f);
+  CHECK(wobble < 1.0f);
+  CHECK(control.output > control.curve[1] && control.output < control.curve[3]); // on the sloped part of the curve
+  CHECK(fabsf(plant.temperature - plant.settled(control.output)) < 0.2f);
+}
+
+// PID mode holds the setpoint, from a cold start and after the load changes.
+static void testPidSettles(void)
+{
+  FanController control;
+  Plant plant;
+  control.mode = FAN_MODE_PID;
+  control.reset(0.0f);
+  float peak = 0.0f;
+  for (int minute = 0; minute < 60; minute++)
+  {
+    run(control, plant, 60.0f);
+    if (plant.temperature > peak) peak = plant.temperature;
+  }
+  CHECK(fabsf(plant.temperature - control.pid[0]) < 0.2f);
+  CHECK(peak < control.pid[0] + 8.0f); // a cold start overshoots by about 5 C with the default gains
+
+  plant.power = 15.0f;
+  float wobble = run(control, plant, 3600.0f);
+  CHECK(wobble < 1.0f);
+  CHECK(fabsf(plant.temperature - control.pid[0]) < 0.2f);
+}
+
+// With more heat than the fans can remove, PID pins the fans at full; once the load drops it must let go
+// promptly instead of unwinding an integral that grew the whole time.
+static void testPidSaturation(void)
+{
+  FanController control;
+  Plant plant;
+  control.mode = FAN_MODE_PID;
+  control.reset(0.0f);
+  plant.power = 40.0f; // at full fans this still settles at 58 C, above the 45 C setpoint
+  run(control, plant, 1800.0f);
+  CHECK(control.output == FAN_PWM_MAX);
+  CHECK(fabsf(plant.temperature - plant.settled(FAN_PWM_MAX)) < 0.5f);
+
+  plant.power = 10.0f;
+  float belowSetpoint = -1.0f, released = -1.0f;
+  for (float t = 0.0f; t < 3600.0f && released < 0.0f; t += DT)
+  {
+    float pwm = control.step(plant.temperature, DT);
+    plant.step(pwm, DT);
+    if (belowSetpoint < 0.0f && plant.temperature < control.pid[0]) belowSetpoint = t;
+    if (pwm < FAN_PWM_MAX) released = t;
+  }
+  CHECK(released >= 0.0f && (belowSetpoint < 0.0f || released - belowSetpoint < 10.0f));
+  run(control, plant, 3600.0f);
+  CHECK(fabsf(plant.temperature - control.pid[0]) < 0.2f);
+  CHECK(control.output >= 0.0f && control.output <= FAN_PWM_MAX);
+}
+
+// The slew limit bounds every step, whatever the mode asks for.
+static void testSlewLimit(void)
+{
+  FanController control;
+  Plant plant;
+  control.mode = FAN_MODE_CURVE;
+  control.reset(0.0f);
+  plant.temperature = 80.0f; // the curve wants 255 straight away
+  float last = 0.0f;
+  bool limited = true;
+  for (int i = 0; i < 40; i++)
+  {
+    float pwm = control.step(plant.temperature, DT);
+    if (pwm - last > control.slew * DT + 1e-3f) limited = false;
+    last = pwm;
+  }
+  CHECK(limited);
+  CHECK(fabsf(last - 40 * control.slew * DT) < 1e-2f);
+}
+
+int main(void)
+{
+  testCurveSettles();
+  testPidSettles();
+  testPidSaturation();
+  testSlewLimit();
+  return hostTestResult("test_fan_plant");
+}
@@ -0,0 +1,493 @@
+// Host tests of the Keyhole text protocol: each test scripts some input on
+// Serial, runs one loop() of a small sketch and checks the exact reply.
+
+#include "Keyhole.h"
+#include "HostTest.h"
+#include <float.h>
+#include <vector>
+
+static short  fan1 = 0, fan2 = 0;
+static short  fans[3] = { 0, 0, 0 };
+static float  gain = 0.5;
+static bool   flag = false;
+static String name = "pong!";
+static unsigned long counter = 7;
+
+static Keyhole * keyhole = NULL;
+
+// One pass of the sketch: registered variables are dispatched by begin(), `counter` goes through variable().
+static std::string exchange(const std::string & input)
+{
+  Serial.script(input.data(), input.size());
+  while (Serial.available())
+  {
+    if (!keyhole->begin()) break;
+    keyhole->variable("counter", counter, VARIABLE_READ_ONLY);
+    keyhole->end();
+  }
+  return Serial.take();
+}
+
+// A binary-protocol frame as the host would send it: [op][index], then `rest` (e.g. [type][payload] for a SET)
+static std::string cobsFrame(uint8_t op, uint8_t index, const std::string & rest = "")
+{
+  std::string frame = std::string(1, (char)op) + (char)index + rest;
+  unsigned int crc = Keyhole::crc16((const uint8_t *)frame.data(), frame.size());
+  frame += (char)(crc & 0xFF);
+  frame += (char)(crc >> 8);
+  std::string encoded(1, '\0');
+  size_t code = 0;
+  for (size_t i = 0; i < frame.size(); i++)
+  {
+    if (frame[i]) { encoded += frame[i]; continue; }
+    encoded[code] = (char)(encoded.size() - code);
+    code = encoded.size();
+    encoded += '\0';
+  }
+  encoded[code] = (char)(encoded.size() - code);
+  return encoded + '\0';
+}
+
+// Decodes a COBS-encoded frame (without its 0 delimiter) and checks its CRC: returns it without the CRC, or "" if it is bad.
+static std::string decodeFrame(const std::string & frame)
+{
+  std::string decoded;
+  for (size_t r = 0; r < frame.size(); )
+  {
+    size_t code = (unsigned char)frame[r++];
+    if (!code || r + code - 1 > frame.size()) return "";
+    decoded.append(frame, r, code - 1);
+    r += code - 1;
+    if (code < 0xFF && r < frame.size()) decoded += '\0';
+  }
+  size_t n = decoded.size();
+  if (n < 5 || Keyhole::crc16((const uint8_t *)decoded.data(), n - 2) != (unsigned int)((uint8_t)decoded[n - 2] | (uint8_t)decoded[n - 1] << 8)) return "";
+  return decoded.substr(0, n - 2);
+}
+
+// True if `frame` (without its 0 delimiter) is a whole COBS-encoded frame with a good CRC.
+static bool goodFrame(const std::string & frame)
+{
+  return !decodeFrame(frame).empty();
+}
+
+// Splits the output of the binary protocol into decoded frames; a bad frame (or trailing bytes) comes back as "".
+static std::vector<std::string> decodeFrames(const std::string & output)
+{
+  std::vector<std::string> frames;
+  size_t start = 0;
+  for (size_t end; (end = output.find('\0', start)) != std::string::npos; start = end + 1) frames.push_back(decodeFrame(output.substr(start, end - start)));
+  if (start < output.size()) frames.push_back("");
+  return frames;
+}
+
+static void setUp(void)
+{
+  static Keyhole instance(Serial);
+  keyhole = &instance;
+  keyhole->expose("fan1", fan1);
+  keyhole->expose("fan2", fan2, VARIABLE_VERBOSE);
+  keyhole->expose("fans", fans);
+  keyhole->expose("gain", gain);
+  keyhole->expose("flag", flag);
+  keyhole->expose("name", name);
+}
+
+static void testQueryAndAssign(void)
+{
+  CHECK_EQUAL("{\"fan1\": 0}\r\n", exchange("fan1\n"));
+  CHECK_EQUAL("", exchange("fan1=200\n"));
+  CHECK(fan1 == 200);
+  CHECK_EQUAL("{\"fan2\": 3}\r\n", exchange("fan2 = 3\n")); // verbose
+  CHECK_EQUAL("{\"fan1\": 5, \"fan2\": 3}\r\n", exchange("fan1=5;fan1;fan2\n"));
+  CHECK_EQUAL("{\"counter\": 7}\r\n", exchange("counter\n"));
+  CHECK_EQUAL("{\"name\": \"pong!\"}\r\n", exchange("name\n"));
+  CHECK_EQUAL("{\"name\": \"a\\tb\"}\r\n", exchange("name=\"a\\tb\";name\n"));
+}
+
+static void testErrors(void)
+{
+  CHECK_EQUAL("{\"_KEYHOLE_ERROR_TYPE\": \"BadValue\", \"_KEYHOLE_ERROR_MSG\": \"failed to interpret argument as type 'short' when setting the 'fan1' variable\"}\r\n", exchange("fan1=70000\n"));
+  CHECK(fan1 == 5);
+  CHECK_EQUAL("{\"_KEYHOLE_ERROR_TYPE\": \"BadKey\", \"_KEYHOLE_ERROR_MSG\": \"failed to recognize command\"}\r\n", exchange("nosuchkey\n"));
+  CHECK_EQUAL("{\"_KEYHOLE_ERROR_TYPE\": \"ReadOnly\", \"_KEYHOLE_ERROR_MSG\": \"cannot change the 'counter' variable because it is read-only\"}\r\n", exchange("counter=1\n"));
+  std::string tooLong = "name=\"" + std::string(KEYHOLE_BUFFER_SIZE, 'x') + "\"\n";
+  CHECK_EQUAL("{\"_KEYHOLE_ERROR_TYPE\": \"BufferOverflow\", \"_KEYHOLE_ERROR_MSG\": \"command exceeded the 63-character limit and was discarded\"}\r\n", exchange(tooLong.c_str()));
+}
+
+static void testNumbers(void)
+{
+  CHECK_EQUAL("{\"gain\": 0.1}\r\n", exchange("gain=0.1;gain\n"));
+  CHECK_EQUAL("{\"gain\": 1e+20}\r\n", exchange("gain=1e20;gain\n"));
+  CHECK_EQUAL("{\"gain\": -0.0}\r\n", exchange("gain=-0.0;gain\n"));
+  CHECK_EQUAL("{\"gain\": 3.14159}\r\n", exchange("gain=3.14159;gain\n"));
+  CHECK_EQUAL("{\"gain\": 1.1754944e-38}\r\n", exchange("gain=1.17549435e-38;gain\n")); // FLT_MIN
+  CHECK_EQUAL("{\"gain\": 16777216.0}\r\n", exchange("gain=16777217;gain\n"));     // 2^24 + 1 rounds to 2^24 as a float
+  char text[Keyhole::DECIMAL_BUFFER_SIZE];
+  Keyhole::formatDecimal(text, 0.1 + 0.2);
+  CHECK_EQUAL("0.30000000000000004", text);
+  Keyhole::formatDecimal(text, DBL_MAX);
+  CHECK(strtod(text, NULL) == DBL_MAX && strlen(text) == 23);
+  Keyhole::formatDecimal(text, 5e-324);
+  CHECK_EQUAL("5e-324", text);
+  CHECK_EQUAL("{\"fan1\": 255}\r\n", exchange("fan1=0xFF;fan1\n"));
+  CHECK_EQUAL("{\"flag\": 1}\r\n", exchange("flag=TRUE;flag\n"));
+  CHECK_EQUAL("{\"flag\": 0}\r\n", exchange("flag=0;flag\n"));
+  CHECK_EQUAL("{\"flag\": 1}\r\n", exchange("flag = 1;flag\n"));
+  const char * notBools[] = { "flag=-1\n", "flag=2\n", "flag=0x1\n", "flag=01\n", "flag=-0\n", "flag=truer\n" };
+  for (unsigned int i = 0; i < sizeof(notBools) / sizeof(notBools[0]); i++)
+    CHECK_EQUAL("{\"_KEYHOLE_ERROR_TYPE\": \"BadValue\", \"_KEYHOLE_ERROR_MSG\": \"failed to interpret argument as type 'bool' when setting the 'flag' variable\"}\r\n", exchange(notBools[i]));
+  CHECK(flag == true);
+}
+
+static void testArrays(void)
+{
+  CHECK_EQUAL("", exchange("fans=[100, 120, 90]\n"));
+  CHECK(fans[0] == 100 && fans[1] == 120 && fans[2] == 90);
+  CHECK_EQUAL("{\"fans\": [100, 7, 90]}\r\n", exchange("fans[1]=7;fans\n"));
+  exchange("fans=[1, 2]\n"); // wrong length: rejected as a whole
+  CHECK(fans[0] == 100);
+}
+
+static void testListingAndTags(void)
+{
+  exchange("fan1=1;fan2=2;fans=[1,2,3];gain=0.5;flag=0;name=\"x\"\n");
+  CHECK_EQUAL("{\"fan1\": 1, \"fan2\": 2, \"fans\": [1, 2, 3], \"gain\": 0.5, \"flag\": 0, \"name\": \"x\", \"counter\": 7}\r\n", exchange("?\n"));
+  CHECK_EQUAL("{\"_KEYHOLE_TAG\": 5, \"fan1\": 1}\r\n", exchange("#5 fan1\n"));
+  CHECK_EQUAL("{\"_KEYHOLE_TAG\": 6}\r\n", exchange("#6 fan1=9\n"));
+  CHECK_EQUAL("{\"fan1\": 9}\r\n", exchange("@0\n"));
+}
+
+static unsigned long sBaud = 0;
+static void setBaud(unsigned long baud) { sBaud = baud; }
+
+// Built-in commands answer a tag with their own reply, not with an acknowledgement as well
+static void testTaggedBuiltins(void)
+{
+  CHECK_EQUAL("{\"_KEYHOLE_TAG\": 1, \"fan1\": 9, \"fan2\": 2, \"fans\": [1, 2, 3], \"gain\": 0.5, \"flag\": 0, \"name\": \"x\", \"counter\": 7}\r\n", exchange("#1 ?\n"));
+  keyhole->setBaud = setBaud;
+  CHECK_EQUAL("{\"_KEYHOLE_TAG\": 3, \"_KEYHOLE_BAUD\": 9600}\r\n", exchange("#3 baud\n"));
+  CHECK_EQUAL("{\"_KEYHOLE_TAG\": 4, \"_KEYHOLE_BAUD\": 19200}\r\n", exchange("#4 baud 19200\n"));
+  CHECK(sBaud == 19200);
+  exchange("baud\n");
+  keyhole->setBaud = NULL;
+  CHECK_EQUAL("{\"_KEYHOLE_TAG\": 2, \"_KEYHOLE_PROTOCOL\": \"binary\"}\r\n", exchange("#2 binary\n"));
+  CHECK_EQUAL("{\"_KEYHOLE_PROTOCOL\": \"text\"}\r\n", exchange(cobsFrame(KEYHOLE_FRAME_TEXT, 0)));
+  CHECK_EQUAL("{\"_KEYHOLE_TAG\": 5}\r\n", exchange("#5 sub fan1 10s\n"));
+  exchange("unsub\n");
+}
+
+static void testSubscriptions(void)
+{
+  CHECK_EQUAL("", exchange("sub fan1 10s\n"));
+  CHECK_EQUAL("{\"_KEYHOLE_TAG\": 4}\r\n", exchange("#4 sub counter 10s\n")); // passed to variable(), not registered
+  CHECK_EQUAL("{\"_KEYHOLE_ERROR_TYPE\": \"BadValue\", \"_KEYHOLE_ERROR_MSG\": \"cannot subscribe to a key that is not a variable\"}\r\n", exchange("sub nosuchkey 10ms\n"));
+  CHECK_EQUAL("{\"_KEYHOLE_TAG\": 5, \"_KEYHOLE_ERROR_TYPE\": \"BadValue\", \"_KEYHOLE_ERROR_MSG\": \"cannot subscribe to a key that is not a variable\"}\r\n", exchange("#5 sub nosuchkey 10ms\n"));
+  // a period must be a whole, non-negative number that the timer wheel can reach, and nothing is subscribed otherwise
+  std::string badPeriod = "{\"_KEYHOLE_ERROR_TYPE\": \"BadValue\", \"_KEYHOLE_ERROR_MSG\": \"expected: sub KEY PERIOD[ms|s], with PERIOD up to 655350 ms\"}\r\n";
+  const char * badPeriods[] = { "sub fan2 -5\n", "sub fan2 5000000s\n", "sub fan2 656s\n", "sub fan2 655351\n", "sub fan2 99999999999999999999ms\n", "sub fan2 1.5s\n", "sub fan2\n" };
+  for (unsigned int i = 0; i < sizeof(badPeriods) / sizeof(badPeriods[0]); i++) CHECK_EQUAL(badPeriod, exchange(badPeriods[i]));
+  CHECK_EQUAL("", exchange("sub fan2 655s;sub gain 655350ms\n"));
+  CHECK_EQUAL("", exchange("unsub fan2;unsub gain\n"));
+  CHECK_EQUAL("", exchange("unsub\n"));
+}
+
+// Keyhole's own counters and histograms are variables of its own, registered after the sketch's by the first begin().
+static void testStats(void)
+{
+  hostUseManualClock(true); // (so that every timing is 0)
+  std::string zeros = "{\"_stats\": {\"commands\": 0, \"errors\": 0, \"bytes_in\": 0, \"bytes_out\": 0, \"dropped\": 0, \"max_loop_us\": 0}}\r\n";
+  CHECK_EQUAL(zeros, exchange("_stats=0;_stats\n"));
+  CHECK_EQUAL("{\"_stats\": {\"commands\": 1, \"errors\": 0, \"bytes_in\": 7, \"bytes_out\": " + std::to_string(zeros.size()) + ", \"dropped\": 0, \"max_loop_us\": 0}}\r\n", exchange("_stats\n"));
+  CHECK_EQUAL("{\"_latency_us\": {\"max\": 0, \"counts\": [1, 0, 0, 0, 0, 0, 0, 0]}}\r\n", exchange("_latency_us=0;_latency_us\n"));
+  CHECK_EQUAL("{\"_KEYHOLE_TAG\": 3}\r\n", exchange("#3 _output_us=0\n"));
+  CHECK_EQUAL("{\"_KEYHOLE_TAG\": 4, \"_KEYHOLE_ERROR_TYPE\": \"BadValue\", \"_KEYHOLE_ERROR_MSG\": \"failed to interpret argument as type 'stats' when setting the '_stats' variable\"}\r\n", exchange("#4 _stats=1\n"));
+  std::string reply = exchange("#5 _stats\n");
+  CHECK(reply.find("{\"_KEYHOLE_TAG\": 5, \"_stats\": {\"commands\": ") == 0 && reply.size() < 128); // short enough for the smallest output queue
+  std::string schema = exchange("schema\n");
+  CHECK(schema.find("[6, \"_stats\", \"stats\", \"silent\"], [7, \"_latency_us\", \"stats\", \"silent\"]") != std::string::npos);
+  CHECK(schema.find("[10, \"_output_us\", \"stats\", \"silent\"]]") != std::string::npos);
+  CHECK(exchange("?\n").find("_stats") == std::string::npos); // too big and too busy for listings
+
+  CHECK_EQUAL("", exchange("sub _stats 1s\n"));
+  for (int pass = 0; pass < 11; pass++) { hostAdvanceMillis(100); if (keyhole->begin()) keyhole->end(); }
+  reply = Serial.take();
+  CHECK(reply.find("{\"_stats\": {\"commands\": ") == 0 && reply.find('\n') == reply.size() - 1); // once, on its own
+  CHECK_EQUAL("", exchange("unsub\n"));
+  hostUseManualClock(false);
+}
+
+// At 9600 baud a long reply takes far longer to send than a loop pass should: in the non-blocking modes nothing
+// may wait for it, and a reply longer than the whole queue is dropped and the host told so.
+static void testNonBlockingOutput(void)
+{
+  hostUseManualClock(true);
+  Serial.reset();
+  Serial.baud = 9600;
+  keyhole->output.mode = KEYHOLE_OUTPUT_DROP_OLDEST;
+  CHECK_EQUAL("{\"fan1\": 9}\r\n", exchange("fan1\n"));
+  name = std::string(KEYHOLE_OUTPUT_SIZE, 'x').c_str();
+  std::string reply = exchange("?\n");
+  for (int pass = 0; pass < 3; pass++) // the rest goes out in later passes, as the UART makes room
+  {
+    hostAdvanceMillis(100);
+    if (keyhole->begin()) keyhole->end();
+  }
+  reply += Serial.take();
+  std::string overflow = "{\"_KEYHOLE_ERROR_TYPE\": \"BufferOverflow\", \"_KEYHOLE_ERROR_MSG\": \"reply overflowed the " + std::to_string(KEYHOLE_OUTPUT_SIZE) + "-byte output queue\"}\r\n";
+  CHECK_EQUAL(overflow, reply);
+  CHECK(Serial.blockedMicros == 0);
+  CHECK(keyhole->output.dropped == 1);
+  CHECK(keyhole->output.highWater < KEYHOLE_OUTPUT_SIZE);
+
+  // Only the line that does not fit is dropped: the lines of the same reply before it still go out.
+  reply = exchange("nosuchkey;?\n");
+  for (int pass = 0; pass < 3; pass++)
+  {
+    hostAdvanceMillis(100);
+    if (keyhole->begin()) keyhole->end();
+  }
+  reply += Serial.take();
+  CHECK_EQUAL("{\"_KEYHOLE_ERROR_TYPE\": \"BadKey\", \"_KEYHOLE_ERROR_MSG\": \"failed to recognize command\"}\r\n" + overflow, reply);
+  CHECK(keyhole->output.dropped == 2);
+
+  keyhole->output.mode = KEYHOLE_OUTPUT_BLOCKING;
+  exchange("_stats=0\n");
+  CHECK(keyhole->output.dropped == 0);
+  name = "x";
+  Serial.baud = 0;
+  hostUseManualClock(false);
+}
+
+// In the binary protocol DROP_OLDEST must drop whole frames, which end in 0 and may contain 0x0A ('\n').
+static void testDroppingFrames(void)
+{
+  fan1 = '\n';
+  exchange("binary\n");
+  std::string list = cobsFrame(KEYHOLE_FRAME_LIST, 0);
+  fan2 = 7;
+  std::string lastList = exchange(list);
+  exchange(cobsFrame(KEYHOLE_FRAME_TEXT, 0));
+
+  hostUseManualClock(true);
+  Serial.reset();
+  Serial.baud = 9600;
+  keyhole->output.mode = KEYHOLE_OUTPUT_DROP_OLDEST;
+  std::string output = exchange("binary\n");
+  for (int i = 0; i < 64; i++) { fan2 = i % 8; output += exchange(list); } // far more than the UART and the queue can hold
+  CHECK(keyhole->output.dropped > 0);
+  for (int pass = 0; pass < KEYHOLE_OUTPUT_SIZE / 64; pass++)
+  {
+    hostAdvanceMillis(100);
+    if (keyhole->begin()) keyhole->end();
+  }
+  output += Serial.take();
+  size_t start = output.find('\n') + 1; // after the {"_KEYHOLE_PROTOCOL": "binary"} line
+  int frames = 0;
+  for (size_t end; (end = output.find('\0', start)) != std::string::npos; start = end + 1, frames++) CHECK(goodFrame(output.substr(start, end - start)));
+  CHECK(frames > 6 && start == output.size());
+  CHECK(output.size() > lastList.size() && output.compare(output.size() - lastList.size(), lastList.size(), lastList) == 0); // the oldest went, not the newest (fan2 == 7)
+
+  exchange(cobsFrame(KEYHOLE_FRAME_TEXT, 0));
+  keyhole->output.sendAll(); // (whatever is still queued)
+  Serial.take();
+  keyhole->output.mode = KEYHOLE_OUTPUT_BLOCKING;
+  keyhole->output.dropped = 0;
+  Serial.baud = 0;
+  hostUseManualClock(false);
+}
+
+// The sketch can turn down a value with reject(): a tagged assignment then gets the error under its tag instead of
+// an acknowledgement, in the text protocol, and an error frame naming the variable in the binary protocol.
+static std::string rejectingExchange(const std::string & input)
+{
+  Serial.script(input.data(), input.size());
+  if (keyhole->begin())
+  {
+    if (keyhole->assigned(&fan2) && fan2 < 0) { fan2 = 0; keyhole->reject(&fan2, "fan2 must not be negative"); }
+    keyhole->end();
+  }
+  return Serial.take();
+}
+
+static void testReject(void)
+{
+  const char * error = "\"_KEYHOLE_ERROR_TYPE\": \"BadValue\", \"_KEYHOLE_ERROR_MSG\": \"fan2 must not be negative\"}\r\n";
+  CHECK_EQUAL(std::string("{\"_KEYHOLE_TAG\": 6, ") + error, rejectingExchange("#6 fan2=-4\n"));
+  CHECK(fan2 == 0);
+  CHECK_EQUAL("{\"_KEYHOLE_TAG\": 7, \"fan2\": 4}\r\n", rejectingExchange("#7 fan2=4\n")); // verbose, and accepted
+  CHECK_EQUAL(std::string("{\"_KEYHOLE_TAG\": 9, ") + error + "{\"_KEYHOLE_TAG\": 8}\r\n", rejectingExchange("#8 fan1=1;#9 fan2=-1\n"));
+  rejectingExchange("binary\n");
+  std::vector<std::string> frames = decodeFrames(rejectingExchange(cobsFrame(KEYHOLE_FRAME_SET, 1, std::string("\x06\xFF\xFF", 3))));
+  CHECK(frames.size() == 1 && frames[0] == "\xEE\x01\x07" "fan2 must not be negative");
+  rejectingExchange(cobsFrame(KEYHOLE_FRAME_TEXT, 0));
+  CHECK(fan2 == 0);
+}
+
+// GET, SET and their error frames, on a keyhole of its own: [VALUE][index][type][payload] comes back for a GET or a
+// verbose SET, a plain SET is silent, and a frame that does not match the variable changes nothing.
+static void testBinaryFrames(void)
+{
+  static Keyhole binary(Serial);
+  static short level = 5, pwm[3] = { 1, 2, 3 };
+  static unsigned short uptime = 0x0102;
+  static String label = "abc";
+  binary.expose("level", level);
+  binary.expose("pwm", pwm, VARIABLE_VERBOSE);
+  binary.expose("uptime", uptime, VARIABLE_READ_ONLY);
+  binary.expose("label", label);
+  Serial.script("binary\n");
+  if (binary.begin()) binary.end();
+  Serial.take();
+  struct { std::string in, out; } exchanges[] = {
+    { cobsFrame(KEYHOLE_FRAME_GET, 0), std::string("\x81\x00\x06\x05\x00", 5) },
+    { cobsFrame(KEYHOLE_FRAME_SET, 0, std::string("\x06\xFF\x7F", 3)), "" },
+    { cobsFrame(KEYHOLE_FRAME_GET, 0), std::string("\x81\x00\x06\xFF\x7F", 5) },
+    { cobsFrame(KEYHOLE_FRAME_SET, 1, std::string("\x06\x0A\x00\x14\x00\x1E\x00", 7)), std::string("\x81\x01\x06\x0A\x00\x14\x00\x1E\x00", 9) },
+    { cobsFrame(KEYHOLE_FRAME_GET, 2), std::string("\x81\x02\x07\x02\x01", 5) },
+    { cobsFrame(KEYHOLE_FRAME_SET, 3, "\x0Cxyzzy"), "" },
+    { cobsFrame(KEYHOLE_FRAME_GET, 3), "\x81\x03\x0Cxyzzy" },
+    { cobsFrame(KEYHOLE_FRAME_SET, 0, std::string("\x08\x01\x00\x00\x00", 5)), std::string("\xEE\x00\x04", 3) }, // a long, not a short
+    { cobsFrame(KEYHOLE_FRAME_SET, 0, std::string("\x06\x01", 2)), std::string("\xEE\x00\x04", 3) },             // too short a payload
+    { cobsFrame(KEYHOLE_FRAME_SET, 1, std::string("\x06\x01\x00", 3)), std::string("\xEE\x01\x04", 3) },         // one element of three
+    { cobsFrame(KEYHOLE_FRAME_SET, 2, std::string("\x07\x00\x00", 3)), std::string("\xEE\x02\x05", 3) },
+    { cobsFrame(KEYHOLE_FRAME_GET, 4), std::string("\xEE\x04\x04", 3) }, // `_stats`, which is text only
+    { cobsFrame(KEYHOLE_FRAME_GET, 4 + KEYHOLE_RESERVED_VARIABLES), std::string("\xEE\x09\x03", 3) },
+    { cobsFrame(0x42, 0), std::string("\xEE\x00\x02", 3) },
+    { std::string("\x03\x01\x02\x00", 4), std::string("\xEE\x00\x01", 3) }, // bad CRC
+  };
+  for (size_t i = 0; i < sizeof(exchanges) / sizeof(exchanges[0]); i++)
+  {
+    Serial.script(exchanges[i].in.data(), exchanges[i].in.size());
+    if (binary.begin()) binary.end();
+    std::vector<std::string> frames = decodeFrames(Serial.take());
+    if (exchanges[i].out.empty()) CHECK(frames.empty());
+    else if (frames.size() == 1) CHECK_EQUAL(exchanges[i].out, frames[0]);
+    else CHECK(frames.size() == 1);
+  }
+  CHECK(level == 0x7FFF && pwm[0] == 10 && pwm[1] == 20 && pwm[2] == 30 && uptime == 0x0102 && label == "xyzzy");
+}
+
+// In the binary protocol the sketch's own errors, and replies cut short by a full queue, come back as error
+// frames: a JSON line would corrupt the stream of frames.
+static void testBinaryErrors(void)
+{
+  exchange("binary\n");
+  std::string set = cobsFrame(KEYHOLE_FRAME_SET, 0, std::string("\x06\x2A\x00", 3)); // fan1 = 42
+  Serial.script(set.data(), set.size());
+  if (keyhole->begin())
+  {
+    if (keyhole->assigned(&fan1)) keyhole->error("no, thanks");
+    keyhole->end();
+  }
+  std::vector<std::string> frames = decodeFrames(Serial.take());
+  CHECK(frames.size() == 1 && frames[0] == std::string("\xEE\x00\x07no, thanks", 13));
+  CHECK(fan1 == 42);
+
+  hostUseManualClock(true);
+  Serial.reset();
+  Serial.baud = 9600;
+  keyhole->output.mode = KEYHOLE_OUTPUT_DROP_NEWEST;
+  name = std::string(40, 'x').c_str();
+  std::string list = cobsFrame(KEYHOLE_FRAME_LIST, 0);
+  std::string output;
+  for (int i = 0; i < 40; i++) output += exchange(list); // until the queue is full, with nothing leaving it
+  for (int pass = 0; pass < KEYHOLE_OUTPUT_SIZE / 64; pass++)
+  {
+    hostAdvanceMillis(100);
+    if (keyhole->begin()) keyhole->end();
+  }
+  output += Serial.take();
+  frames = decodeFrames(output);
+  int tooLong = 0;
+  for (size_t i = 0; i < frames.size(); i++)
+  {
+    CHECK(!frames[i].empty());
+    if (frames[i] == std::string("\xEE\x00\x06", 3)) tooLong++;
+  }
+  CHECK(tooLong > 0 && keyhole->output.dropped > 0);
+
+  exchange(cobsFrame(KEYHOLE_FRAME_TEXT, 0));
+  keyhole->output.sendAll(); // (whatever is still queued)
+  Serial.take();
+  keyhole->output.mode = KEYHOLE_OUTPUT_BLOCKING;
+  keyhole->output.dropped = 0;
+  name = "x";
+  Serial.baud = 0;
+  hostUseManualClock(false);
+}
+
+// With deltaReports = 3, every third automatic report is a full keyframe and the others list only what changed;
+// after output has been dropped, the next report is a keyframe whatever its turn.
+static void testDeltaReports(void)
+{
+  static Keyhole reporter(Serial, 0.1f);
+  static short a = 1, b = 2;
+  reporter.expose("a", a);
+  reporter.expose("b", b);
+  reporter.deltaReports = 3;
+  hostUseManualClock(true);
+  Serial.reset();
+  struct { short a, b; const char * report; } reports[] = {
+    { 1, 2, "{\"a\": 1, \"b\": 2}\r\n" }, // keyframe
+    { 5, 2, "{\"a\": 5}\r\n" },
+    { 5, 2, "" },
+    { 5, 2, "{\"a\": 5, \"b\": 2}\r\n" }, // keyframe
+    { 5, 9, "{\"b\": 9}\r\n" },
+  };
+  for (size_t i = 0; i < sizeof(reports) / sizeof(reports[0]); i++)
+  {
+    a = reports[i].a;
+    b = reports[i].b;
+    hostAdvanceMillis(100);
+    if (reporter.begin()) reporter.end();
+    CHECK_EQUAL(reports[i].report, Serial.take());
+  }
+  reporter.output.dropped++; // as if that last report had been dropped from a full queue: this one was due to be a delta
+  a = 6;
+  hostAdvanceMillis(100);
+  if (reporter.begin()) reporter.end();
+  CHECK_EQUAL("{\"a\": 6, \"b\": 9}\r\n", Serial.take());
+  hostAdvanceMillis(100);
+  if (reporter.begin()) reporter.end();
+  CHECK_EQUAL("{\"a\": 6, \"b\": 9}\r\n", Serial.take()); // the scheduled keyframe
+  hostAdvanceMillis(100);
+  if (reporter.begin()) reporter.end();
+  CHECK_EQUAL("", Serial.take()); // back to deltas
+  hostUseManualClock(false);
+}
+
+// "glidpj" hashes to 0xFFFFFFFF and "ai" takes its slot first, so finding it means probing
+// past the top of the hash range (on AVR the same happens to any key that hashes to 0xFFFF)
+static void testHashWrap(void)
+{
+  static Keyhole wrapped(Serial);
+  static short ai = 1, glidpj = 2;
+  CHECK(Keyhole::hash("glidpj", 6) == 0xFFFFFFFFU);
+  wrapped.expose("ai", ai);
+  wrapped.expose("glidpj", glidpj);
+  Serial.script("glidpj;ai\n");
+  if (wrapped.begin()) wrapped.end();
+  CHECK_EQUAL("{\"glidpj\": 2, \"ai\": 1}\r\n", Serial.take());
+}
+
+int main(void)
+{
+  setUp();
+  testQueryAndAssign();
+  testErrors();
+  testNumbers();
+  testArrays();
+  testListingAndTags();
+  testTaggedBuiltins();
+  testSubscriptions();
+  testStats();
+  testNonBlockingOutput();
+  testDroppingFrames();
+  testReject();
+  testBinaryFrames();
+  testBinaryErrors();
+  testDeltaReports();
+  testHashWrap();
+  return hostTestResult("test_keyhole");
+}
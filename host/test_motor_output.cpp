@@ -0,0 +1,118 @@
+// Host tests of MotorOutput against the recording MotorDriver in this
+// directory, on the manual clock.
+
+#include "MotorOutput.h"
+#include "HostTest.h"
+
+// Repeated and unchanged sets reach the driver once, and only the host's count as skips.
+static void testCoalescing(void)
+{
+  MotorDriver driver;
+  MotorOutput motors(driver);
+  motors.rate[0] = 0; // straight to the target
+  CHECK(motors.set(1, 100));
+  CHECK(!motors.set(1, 100));
+  motors.assign(1, 100);
+  motors.assign(1, 100);
+  motors.update();
+  CHECK(driver.calls == 1 && driver.pwm[1] == 100 && motors.writes == 1);
+  CHECK(motors.skipped == 2); // the two assign()s, not the set()
+  motors.update();
+  CHECK(driver.calls == 1); // nothing changed since
+
+  motors.assign(1, 300); // clamped to 255
+  motors.assign(1, 255);
+  motors.update();
+  CHECK(driver.calls == 2 && driver.pwm[1] == 255 && motors.get(1) == 255 && motors.skipped == 3);
+
+  // jumps that bypass the ramp (as LED patterns make, every pass) are internal: they never count as skips
+  for (int i = 0; i < 50; i++) motors.set(4, i < 25 ? 0 : 200, false);
+  motors.update();
+  CHECK(driver.calls == 3 && driver.pwm[4] == 200 && motors.skipped == 3);
+  CHECK(!motors.set(9, 1) && motors.skipped == 3); // no such motor
+}
+
+// Runs `passes` motor passes, 20 ms apart (the sketch's MOTOR_PERIOD_MS).
+static void run(MotorOutput & motors, int passes)
+{
+  for (int i = 0; i < passes; i++) { hostAdvanceMillis(20); motors.update(); }
+}
+
+// At the default rate a channel takes 2 seconds from 0 to full, moving on every pass.
+static void testRampRate(void)
+{
+  MotorDriver driver;
+  MotorOutput motors(driver);
+  motors.update(); // (the first update() only starts the clock)
+  motors.set(2, 255);
+  run(motors, 1);
+  CHECK(motors.level(2) == 2 && driver.pwm[2] == 2); // 128 steps/s for 20 ms is 2.56 steps
+  run(motors, 49);
+  CHECK(motors.level(2) >= 127 && motors.level(2) <= 128 && driver.pwm[2] == motors.level(2));
+  CHECK(motors.writes == 50); // every pass moved it by at least a whole step
+  run(motors, 49);
+  CHECK(motors.level(2) < 255);
+  run(motors, 1);
+  CHECK(motors.level(2) == 255 && driver.pwm[2] == 255);
+  unsigned long writes = motors.writes;
+  run(motors, 10);
+  CHECK(motors.writes == writes); // arrived: nothing more for the driver
+
+  motors.rate[1] = 16; // slow enough that most passes stay within one PWM step
+  motors.set(2, 245);
+  run(motors, 1);
+  CHECK(motors.level(2) == 254 && motors.writes == writes + 1);
+  run(motors, 200); // 4 seconds at 16 steps/s is 64 steps, but the ramp stops at its target
+  CHECK(motors.level(2) == 245 && driver.pwm[2] == 245 && motors.writes == writes + 10);
+}
+
+// A new target turns a ramp round from wherever it has got to, rather than starting again.
+static void testRetarget(void)
+{
+  MotorDriver driver;
+  MotorOutput motors(driver);
+  motors.update();
+  motors.set(1, 255);
+  run(motors, 25); // half a second: a quarter of the way
+  int halfway = motors.level(1);
+  CHECK(halfway >= 63 && halfway <= 64);
+  motors.set(1, 0);
+  run(motors, 1);
+  CHECK(motors.level(1) < halfway && motors.level(1) >= halfway - 3 && driver.pwm[1] == motors.level(1));
+  run(motors, 24);
+  CHECK(motors.level(1) == 0 && driver.pwm[1] == 0 && motors.get(1) == 0);
+  motors.set(1, 100);
+  motors.set(1, 50); // before any update(): only the last target counts
+  run(motors, 50);
+  CHECK(motors.level(1) == 50 && driver.pwm[1] == 50);
+}
+
+// A rate of 0 jumps straight to each new target, on the next pass.
+static void testRateZero(void)
+{
+  MotorDriver driver;
+  MotorOutput motors(driver);
+  motors.update();
+  motors.rate[2] = 0;
+  motors.set(3, 200);
+  CHECK(motors.level(3) == 0 && driver.calls == 0); // nothing moves before update()
+  run(motors, 1);
+  CHECK(motors.level(3) == 200 && driver.pwm[3] == 200 && driver.calls == 1);
+  motors.set(3, 10);
+  run(motors, 1);
+  CHECK(motors.level(3) == 10 && driver.pwm[3] == 10 && driver.calls == 2);
+  motors.rate[2] = MOTOR_DEFAULT_RATE; // and back to ramping, from where it is
+  motors.set(3, 20);
+  run(motors, 1);
+  CHECK(motors.level(3) == 12);
+}
+
+int main(void)
+{
+  hostUseManualClock(true);
+  testCoalescing();
+  testRampRate();
+  testRetarget();
+  testRateZero();
+  return hostTestResult("test_motor_output");
+}
@@ -0,0 +1,168 @@
+// Host tests of Settings, on the file-backed EEPROM stand-in (which every
+// Settings in the process shares, like the one EEPROM of a board).
+
+#include "Settings.h"
+#include "HostTest.h"
+#include <stdio.h>
+#include <string.h>
+
+// Polls until a save has finished (or `ms` have passed); returns the number of saves made.
+static unsigned long settle(Settings & settings, unsigned long & now, unsigned long ms)
+{
+  unsigned long saves = settings.saves;
+  for (unsigned long end = now + ms; now < end; now += 5) settings.poll(now);
+  return settings.saves - saves;
+}
+
+static void testSaveAndRestore(void)
+{
+  unsigned long now = 0;
+  short a = 1;
+  long b = 2;
+  Settings first;
+  CHECK(first.add(a) && first.add(b));
+  CHECK(!first.begin(now)); // nothing saved with this layout
+  a = 100; b = 200000;
+  CHECK(settle(first, now, SETTINGS_SETTLE_MS + 1000) == 1);
+  CHECK(settle(first, now, SETTINGS_SETTLE_MS + 1000) == 0); // nothing changed since
+
+  a = 0; b = 0;
+  Settings second;
+  second.add(a);
+  second.add(b);
+  CHECK(second.begin(now) && a == 100 && b == 200000);
+}
+
+// The same number of bytes in a different layout is a different list: its saved copy is not restored.
+static void testLayoutChange(void)
+{
+  long b = 7;
+  short a = 8;
+  Settings swapped;
+  swapped.add(b);
+  swapped.add(a);
+  CHECK(!swapped.begin(0) && a == 8 && b == 7);
+}
+
+// A list that does not fit is never restored or saved, rather than restored or saved without its tail.
+static void testTooMuch(void)
+{
+  unsigned long now = 0;
+  short a = 0;
+  long b = 0;
+  char big[SETTINGS_RECORD_MAX] = { 0 };
+  Settings settings;
+  CHECK(settings.add(a) && settings.add(b));
+  CHECK(!settings.add(big));
+  CHECK(!settings.begin(now) && a == 0 && b == 0);
+  a = 1;
+  CHECK(settle(settings, now, SETTINGS_SETTLE_MS + 1000) == 0);
+
+  Settings original; // the first test's copy is still there
+  original.add(a);
+  original.add(b);
+  CHECK(original.begin(now) && a == 100 && b == 200000);
+}
+
+#define LONG_RECORD (2 + sizeof(long) + 2) // sequence number, value, CRC
+
+// Changes `value` and polls just long enough for the change to be saved.
+static void save(Settings & settings, unsigned long & now, long & value, long newValue)
+{
+  value = newValue;
+  settings.poll(now); // seen changing
+  now += SETTINGS_SETTLE_MS;
+  settings.poll(now); // settled: staged
+  for (unsigned int i = 0; i < LONG_RECORD; i++) settings.poll(now); // one byte per call
+}
+
+// Saves go round the ring of slots, and the newest is restored however far round it has got.
+static void testWraparound(void)
+{
+  unsigned long now = 0;
+  long value = 0;
+  Settings settings;
+  settings.add(value);
+  CHECK(!settings.begin(now)); // (a layout of its own: nothing the other tests saved)
+  long slots = SETTINGS_EEPROM_SIZE / LONG_RECORD;
+  for (long i = 1; i <= slots + 2; i++) save(settings, now, value, 1000 + i);
+  CHECK(settings.saves == (unsigned long)slots + 2);
+
+  value = 0;
+  Settings restored;
+  restored.add(value);
+  CHECK(restored.begin(now) && value == 1000 + slots + 2); // from slot 1, not from the highest-numbered slot
+}
+
+// A reset partway through writing a record (after any number of its bytes) leaves the previous record in charge.
+static void testTornRecord(void)
+{
+  unsigned long now = 0;
+  long newest = 1000 + SETTINGS_EEPROM_SIZE / LONG_RECORD + 2; // as testWraparound() left it
+  for (unsigned int written = 0; written < LONG_RECORD; written++)
+  {
+    long value = 0;
+    Settings settings;
+    settings.add(value);
+    CHECK(settings.begin(now) && value == newest);
+    value = 5000;
+    settings.poll(now);
+    now += SETTINGS_SETTLE_MS;
+    settings.poll(now);
+    for (unsigned int i = 0; i < written; i++) settings.poll(now); // ...and then the reset
+  }
+  long value = 0;
+  Settings last;
+  last.add(value);
+  CHECK(last.begin(now) && value == newest);
+}
+
+// Writes a record straight into the EEPROM file, as Settings would for a list of one short.
+static void writeShortRecord(FILE * file, unsigned int slot, unsigned int sequence, short value)
+{
+  unsigned char layout[2] = { 1, sizeof(short) };
+  unsigned char record[2 + sizeof(short) + 2] = { (unsigned char)(sequence & 0xFF), (unsigned char)(sequence >> 8) };
+  memcpy(record + 2, &value, sizeof(short));
+  unsigned int crc = Keyhole::crc16(record, 2 + sizeof(short)) ^ Keyhole::crc16(layout, 2);
+  record[2 + sizeof(short)] = crc & 0xFF;
+  record[2 + sizeof(short) + 1] = crc >> 8;
+  fseek(file, slot * sizeof(record), SEEK_SET);
+  fwrite(record, 1, sizeof(record), file);
+}
+
+// The sequence number is only 16 bits: after 65535 comes 0, which is still the newer record. (This runs first,
+// because the EEPROM file is only read once, and it takes 65536 saves to get there otherwise.)
+static void testSequenceWrap(void)
+{
+  FILE * file = fopen(SETTINGS_EEPROM_FILE, "wb");
+  unsigned char blank[SETTINGS_EEPROM_SIZE];
+  memset(blank, 0xFF, sizeof(blank));
+  fwrite(blank, 1, sizeof(blank), file);
+  writeShortRecord(file, 4, 0xFFFE, 1);
+  writeShortRecord(file, 5, 0xFFFF, 2);
+  writeShortRecord(file, 9, 0xC000, 3); // numbered above 0, but long before 0xFFFE
+  fclose(file);
+
+  unsigned long now = 0;
+  short value = 0;
+  Settings settings;
+  settings.add(value);
+  CHECK(settings.begin(now) && value == 2);
+  value = 4;
+  CHECK(settle(settings, now, SETTINGS_SETTLE_MS + 1000) == 1); // to slot 6, as sequence number 0
+  value = 0;
+  Settings restored;
+  restored.add(value);
+  CHECK(restored.begin(now) && value == 4);
+}
+
+int main(void)
+{
+  testSequenceWrap(); // (writes the EEPROM file itself, with nothing but a few records of a layout of its own)
+  testSaveAndRestore();
+  testLayoutChange();
+  testTooMuch();
+  testWraparound();
+  testTornRecord();
+  return hostTestResult("test_settings");
+}
@@ -0,0 +1,125 @@
+// Host tests of the controller sketch itself: the whole .ino runs against
+// the Arduino stand-in and a recording MotorDriver, on the manual clock.
+
+#include "HostTest.h"
+#include <stdio.h>
+#include "../KIV_Cloudlet_Arduino_Controller.ino"
+
+// Runs loop() for `ms` milliseconds of manual-clock time.
+static void run(unsigned long ms)
+{
+  for (unsigned long i = 0; i < ms; i++) { hostAdvanceMillis(1); loop(); }
+}
+
+// Sends `input`, runs the sketch long enough to handle it, and returns everything it wrote.
+static std::string exchange(const std::string & input)
+{
+  Serial.script(input.data(), input.size());
+  run(200); // long enough for a whole output queue to go out at 9600 baud
+  return Serial.take();
+}
+
+// In fan modes 1 and 2 the controller owns fanN, so the host cannot set them.
+static void testFanModes(void)
+{
+  hostAnalogValue[TEMP_PIN] = 92; // 44.9 C: halfway up the default curve
+  CHECK_EQUAL("", exchange("fan_mode=1\n"));
+  run(5000); // the default slew limit takes the fans up by 50 a second
+  short pwm = fan_pwm[0];
+  CHECK(pwm > 60 && pwm < 255 && fan_pwm[1] == pwm && fan_pwm[2] == pwm);
+
+  const char * rejected = "{\"_KEYHOLE_ERROR_TYPE\": \"BadValue\", \"_KEYHOLE_ERROR_MSG\": \"fan_mode 1 and 2 set the fans themselves: set fan_mode=0 first\"}\r\n";
+  CHECK_EQUAL(rejected, exchange("fan1=10\n"));
+  CHECK(fan_pwm[0] == pwm);
+  CHECK_EQUAL(rejected, exchange("fans=[1,2,3]\n"));
+  CHECK(fan_pwm[0] == pwm && fan_pwm[1] == pwm && fan_pwm[2] == pwm);
+  CHECK_EQUAL(rejected, exchange("fan3=0\n"));
+  CHECK(fan_pwm[2] == pwm && motors.get(M_FAN3) == pwm);
+  // a tagged command gets exactly one line: the error, under its tag, and no acknowledgement
+  std::string tagged = std::string("{\"_KEYHOLE_TAG\": 7, ") + (rejected + 1);
+  CHECK_EQUAL(tagged, exchange("#7 fan1=10\n"));
+  CHECK_EQUAL(tagged + "{\"_KEYHOLE_TAG\": 6}\r\n", exchange("#6 fan_slew=50;#7 fan1=10\n")); // (errors go out as they happen, acknowledgements from end())
+  CHECK(fan_pwm[0] == pwm);
+
+  CHECK_EQUAL("", exchange("fan_mode=0\n"));
+  CHECK_EQUAL("", exchange("fan1=10\n"));
+  CHECK(fan_pwm[0] == 10 && motors.get(M_FAN1) == 10);
+  hostAnalogValue[TEMP_PIN] = 0;
+}
+
+// An unknown led_pattern is an error, and the pattern that was playing carries on.
+static void testLedPattern(void)
+{
+  const char * rejected = "{\"_KEYHOLE_ERROR_TYPE\": \"BadValue\", \"_KEYHOLE_ERROR_MSG\": \"led_pattern must be 0 to 11\"}\r\n";
+  CHECK_EQUAL("", exchange("led_pattern=10\n"));
+  CHECK_EQUAL(rejected, exchange("led_pattern=42\n"));
+  CHECK_EQUAL(rejected, exchange("led_pattern=-1\n"));
+  CHECK_EQUAL("{\"led_pattern\": 10}\r\n", exchange("led_pattern\n"));
+  CHECK(led_pattern.active());
+  // a tagged command gets exactly one line: the error, under its tag, and no acknowledgement
+  CHECK_EQUAL("{\"_KEYHOLE_TAG\": 8, \"_KEYHOLE_ERROR_TYPE\": \"BadValue\", \"_KEYHOLE_ERROR_MSG\": \"led_pattern must be 0 to 11\"}\r\n", exchange("#8 led_pattern=42\n"));
+  CHECK_EQUAL("{\"_KEYHOLE_TAG\": 9}\r\n", exchange("#9 led_pattern=10\n"));
+  CHECK_EQUAL("", exchange("led_pattern=0\n"));
+  CHECK(!led_pattern.active());
+}
+
+// In fan modes 1 and 2 the fans move all the time, so EEPROM only keeps the values last set in mode 0.
+static void testSavedFans(void)
+{
+  CHECK_EQUAL("", exchange("fans=[30,40,50]\n"));
+  run(SETTINGS_SETTLE_MS + 1000);
+  unsigned long saves = settings.saves;
+  CHECK_EQUAL("", exchange("fan_mode=2\n"));
+  for (int i = 0; i < 20; i++) { hostAnalogValue[TEMP_PIN] = 80 + i % 5 * 5; run(1000); }
+  CHECK(fan_pwm[0] != 30);
+  CHECK(settings.saves == saves + 1); // fan_mode itself, once
+  CHECK(manual_pwm[0] == 30 && manual_pwm[1] == 40 && manual_pwm[2] == 50);
+  CHECK_EQUAL("", exchange("fan_mode=0\n"));
+  hostAnalogValue[TEMP_PIN] = 0;
+}
+
+// motor_skips counts only the host's assignments that change nothing: not the fans a `fan1` leaves alone,
+// and not the LED levels that a pattern sets on every pass.
+static void testMotorSkips(void)
+{
+  CHECK_EQUAL("", exchange("fans=[10,20,30]\n"));
+  unsigned long skipped = motors.skipped;
+  CHECK_EQUAL("", exchange("fan1=77\n"));
+  CHECK(motors.skipped == skipped);
+  CHECK_EQUAL("", exchange("fans=[77,20,31]\n"));
+  CHECK(motors.skipped == skipped + 2);
+  CHECK_EQUAL("", exchange("fan2=20;led_pattern=1\n"));
+  run(2000);
+  CHECK(motors.skipped == skipped + 3);
+  CHECK_EQUAL("", exchange("led_pattern=0\n"));
+}
+
+// loop_us, late_us and cmd_rate cover the last whole second, to the microsecond.
+static void testLoopTiming(void)
+{
+  do run(1); while (scheduler.maxLoopMicros != 0); // until measureLoop() has just started a new second
+  hostAdvanceMicros(7300); // one slow pass: every periodic task falls due during it
+  loop();
+  Serial.script("fan_slew;fan_slew;led_pwm\n", 26);
+  run(1000);
+  Serial.take();
+  CHECK(loop_us == 7300);
+  CHECK(late_us >= 2300 && late_us < 7300 && late_us % 1000 != 0); // (a 5 ms task, and not in whole milliseconds)
+  CHECK(cmd_rate == 3);
+  char expected[80];
+  snprintf(expected, sizeof(expected), "{\"loop_us\": 7300, \"late_us\": %lu, \"cmd_rate\": 3}\r\n", late_us);
+  CHECK_EQUAL(expected, exchange("loop_us;late_us;cmd_rate\n"));
+}
+
+int main(void)
+{
+  remove(SETTINGS_EEPROM_FILE); // start from a blank EEPROM
+  hostUseManualClock(true);
+  setup();
+  testFanModes();
+  testLedPattern();
+  testSavedFans();
+  testMotorSkips();
+  testLoopTiming();
+  return hostTestResult("test_sketch");
+}
@@ -0,0 +1,75 @@
+// Host tests of Tachometer: pulses come from calling pulse() (or the
+// attached interrupt) on the manual clock, and update() runs every 1 ms.
+
+#include "Tachometer.h"
+#include "HostTest.h"
+
+static const uint8_t pins[TACH_FANS] = { 2, 3, 7 }; // pin 7 cannot interrupt
+static Tachometer tach; // (begin() attaches the interrupts only once per program, so every test shares this one)
+
+// Runs one window of update() calls, 1 ms apart; fan1 pulses every `period1` ms (with a glitch 300 us after each
+// pulse if `glitches`) and fan2, through its interrupt, every `period2` ms. A period of 0 means no pulses.
+static void runWindow(unsigned int period1, unsigned int period2, bool glitches = false)
+{
+  for (unsigned int ms = 1; ms <= TACH_WINDOW_MS; ms++)
+  {
+    if (period1 && ms % period1 == 0 && glitches) { hostAdvanceMicros(700); tach.pulse(0); hostAdvanceMicros(300); tach.pulse(0); }
+    else
+    {
+      hostAdvanceMillis(1);
+      if (period1 && ms % period1 == 0) tach.pulse(0);
+    }
+    if (period2 && ms % period2 == 0) hostInterrupt[digitalPinToInterrupt(pins[1])]();
+    tach.update();
+  }
+}
+
+// rpm follows from the time between the first and last pulses of each window, at two pulses per revolution.
+static void testRpm(void)
+{
+  CHECK(hostInterrupt[digitalPinToInterrupt(pins[0])] && hostInterrupt[digitalPinToInterrupt(pins[1])]);
+  runWindow(20, 10);
+  CHECK(tach.rpm[0] == 1500 && tach.rpm[1] == 3000 && tach.rpm[2] == 0);
+  runWindow(15, 8);
+  CHECK(tach.rpm[0] == 2000 && tach.rpm[1] == 3750);
+  runWindow(0, 8); // a fan that stops reads 0 in the first window without pulses
+  CHECK(tach.rpm[0] == 0 && tach.rpm[1] == 3750);
+  runWindow(0, 0);
+  CHECK(tach.rpm[1] == 0 && tach.overruns == 0);
+}
+
+// Pulses closer together than TACH_MIN_PERIOD_US are noise, not revolutions.
+static void testGlitchFilter(void)
+{
+  runWindow(20, 0, true);
+  runWindow(20, 0, true);
+  CHECK(tach.rpm[0] == 1500);
+  runWindow(0, 0);
+  runWindow(0, 0);
+}
+
+// A burst fills the ring: the pulses that do not fit are counted, and update() drains at most TACH_DRAIN_MAX per call.
+static void testOverruns(void)
+{
+  for (int i = 0; i < TACH_RING_SIZE + 9; i++) tach.pulse(2); // the ring holds TACH_RING_SIZE - 1
+  CHECK(tach.overruns == 0); // counted by the ISR, and only picked up by update()
+  tach.update();
+  CHECK(tach.overruns == 10);
+  for (int i = 0; i < TACH_DRAIN_MAX + 1; i++) tach.pulse(2); // room for exactly TACH_DRAIN_MAX
+  tach.update();
+  CHECK(tach.overruns == 11);
+  for (int i = 0; i < TACH_RING_SIZE / TACH_DRAIN_MAX; i++) tach.update(); // and then it is empty again
+  for (int i = 0; i < TACH_RING_SIZE - 1; i++) tach.pulse(2);
+  tach.update();
+  CHECK(tach.overruns == 11);
+}
+
+int main(void)
+{
+  hostUseManualClock(true);
+  tach.begin(pins);
+  testRpm();
+  testGlitchFilter();
+  testOverruns();
+  return hostTestResult("test_tachometer");
+}
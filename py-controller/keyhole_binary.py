@@ -0,0 +1,190 @@
+"""
+Host side of the Keyhole binary protocol.
+
+After the text command `binary` (acknowledged with the line
+`{"_KEYHOLE_PROTOCOL": "binary"}`) every message in both directions is a
+COBS-encoded frame terminated by a zero byte. Decoded, a frame is
+
+    [op] [index] [type] [payload...] [crc16 lo] [crc16 hi]
+
+where `index` is the variable's position in the sketch's expose() table,
+`type` is its KeyholeType code (or an error code, in an ERROR frame), the
+payload is the raw little-endian value and the CRC is CRC-16/CCITT-FALSE
+over everything before it. An array variable has the type code of its
+elements, and its payload is all of the elements one after the other.
+
+Run this file directly to print a size and throughput comparison against the text protocol.
+"""
+
+import struct
+
+FRAME_GET   = 0x01
+FRAME_SET   = 0x02
+FRAME_LIST  = 0x03
+FRAME_TEXT  = 0x7F
+FRAME_VALUE = 0x81
+FRAME_ERROR = 0xEE
+
+ERRORS = {
+    1: 'BadFrame',
+    2: 'BadOp',
+    3: 'BadIndex',
+    4: 'BadType',
+    5: 'ReadOnly',
+    6: 'TooLong',
+    7: 'BadValue',  # rejected by the sketch: the payload is its message
+}
+
+# KeyholeType codes, in the order of the enum in Keyhole.h
+BOOL, CHAR, INT8, UCHAR, INT, UINT, SHORT, USHORT, LONG, ULONG, FLOAT, DOUBLE, STRING, STATS = range(14)
+
+# Sizes of the C types on the two families of boards we care about
+SIZES = {
+    'avr': {BOOL: 1, CHAR: 1, INT8: 1, UCHAR: 1, INT: 2, UINT: 2, SHORT: 2, USHORT: 2, LONG: 4, ULONG: 4, FLOAT: 4, DOUBLE: 4},
+    'arm': {BOOL: 1, CHAR: 1, INT8: 1, UCHAR: 1, INT: 4, UINT: 4, SHORT: 2, USHORT: 2, LONG: 4, ULONG: 4, FLOAT: 4, DOUBLE: 8},
+}
+
+# Type names as the `schema` command reports them (an array adds its length, e.g. "short[3]")
+TYPE_NAMES = ['bool', 'char', 'int8_t', 'unsigned char', 'int', 'unsigned int', 'short', 'unsigned short',
+              'long', 'unsigned long', 'float', 'double', 'String', 'stats']  # (`stats` variables are text only)
+
+_SIGNED = {CHAR, INT8, INT, SHORT, LONG}
+_INT_FORMATS = {1: 'b', 2: 'h', 4: 'i', 8: 'q'}
+
+
+def crc16(data):
+    crc = 0xFFFF
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else (crc << 1)
+            crc &= 0xFFFF
+    return crc
+
+
+def cobs_encode(data):
+    out = bytearray()
+    start = 0
+    while True:
+        end = start
+        while end < len(data) and data[end] and end - start < 254:
+            end += 1
+        out.append(end - start + 1)
+        out += data[start:end]
+        if end >= len(data):
+            break
+        start = end + 1 if end - start < 254 else end
+    return bytes(out)
+
+
+def cobs_decode(data):
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        code = data[i]
+        if code == 0 or i + code > len(data):
+            raise ValueError('malformed COBS data')
+        out += data[i + 1:i + code]
+        i += code
+        if code < 0xFF and i < len(data):
+            out.append(0)
+    return bytes(out)
+
+
+def encode_frame(op, index=0, type_code=0, payload=b''):
+    """Return the bytes to send for one frame, including the zero delimiter."""
+    body = bytes([op, index, type_code]) + bytes(payload)
+    crc = crc16(body)
+    return cobs_encode(body + bytes([crc & 0xFF, crc >> 8])) + b'\x00'
+
+
+def decode_frame(raw):
+    """Decode one frame (without its delimiter) into (op, index, type_or_error, payload)."""
+    body = cobs_decode(raw)
+    if len(body) < 5 or crc16(body[:-2]) != body[-2] | (body[-1] << 8):
+        raise ValueError('bad frame')
+    return body[0], body[1], body[2], body[3:-2]
+
+
+def parse_type(name):
+    """Turn a `schema` type name into (type_code, count), where count is 0 unless it is an array."""
+    count = 0
+    if name.endswith(']'):
+        name, length = name[:-1].split('[')
+        count = int(length)
+    return TYPE_NAMES.index(name), count
+
+
+def pack_value(type_code, value, target='avr'):
+    """Pack a value, or a list or tuple of values for an array variable (which is always set whole)."""
+    if type_code == STRING:
+        return value.encode('latin-1') if isinstance(value, str) else bytes(value)
+    if isinstance(value, (list, tuple)):
+        return b''.join(pack_value(type_code, element, target) for element in value)
+    size = SIZES[target][type_code]
+    if type_code in (FLOAT, DOUBLE):
+        return struct.pack('<f' if size == 4 else '<d', value)
+    if type_code == BOOL:
+        return bytes([1 if value else 0])
+    fmt = _INT_FORMATS[size]
+    return struct.pack('<' + (fmt if type_code in _SIGNED else fmt.upper()), value)
+
+
+def unpack_value(type_code, payload, count=0):
+    """The payload length tells us the size of the type on the device. For an array
+    variable, pass its number of elements (see parse_type) to get a list back."""
+    if type_code == STRING:
+        return payload.decode('latin-1')
+    if count:
+        size = len(payload) // count
+        return [unpack_value(type_code, payload[i:i + size]) for i in range(0, size * count, size)]
+    if type_code in (FLOAT, DOUBLE):
+        return struct.unpack('<f' if len(payload) == 4 else '<d', payload)[0]
+    if type_code == BOOL:
+        return payload[0] != 0
+    fmt = _INT_FORMATS[len(payload)]
+    return struct.unpack('<' + (fmt if type_code in _SIGNED else fmt.upper()), payload)[0]
+
+
+class FrameReader:
+    """Accumulates bytes from the serial port and returns complete decoded frames.
+    A frame that fails to decode (line noise, or bytes lost to a full queue) is
+    skipped and counted in `bad`: the next delimiter starts afresh."""
+
+    def __init__(self):
+        self.pending = bytearray()
+        self.bad = 0
+
+    def feed(self, data):
+        frames = []
+        for byte in data:
+            if byte:
+                self.pending.append(byte)
+            elif self.pending:
+                raw, self.pending = bytes(self.pending), bytearray()
+                try:
+                    frames.append(decode_frame(raw))
+                except ValueError:
+                    self.bad += 1
+        return frames
+
+
+def compare(baud=115200):
+    """Bytes on the wire for a few typical exchanges with the cloudlet controller, text versus binary, and how
+    many of each the serial link can carry per second at `baud` (10 bits per byte). The time the device takes
+    to handle each one is measured by host/bench_keyhole.cpp."""
+    # indices in the controller's expose() table: 0 ping!, 1 fans, 2 fan1, ..., 6 loop_us
+    rows = [
+        ('set fan1 (short)',        b'fan1=200\n',          encode_frame(FRAME_SET, 2, SHORT, pack_value(SHORT, 200))),
+        ('get fan1 (short)',        b'fan1\n',              encode_frame(FRAME_GET, 2)),
+        ('fan1 reply',              b'{"fan1": 200}\r\n',   encode_frame(FRAME_VALUE, 2, SHORT, pack_value(SHORT, 200))),
+        ('set fans (short[3])',     b'fans=[200,120,90]\n', encode_frame(FRAME_SET, 1, SHORT, pack_value(SHORT, [200, 120, 90]))),
+        ('loop_us reply (ulong)',   b'{"loop_us": 1234}\r\n', encode_frame(FRAME_VALUE, 6, ULONG, pack_value(ULONG, 1234))),
+    ]
+    print('%-24s %6s %8s %10s %10s' % ('exchange', 'text', 'binary', 'text/s', 'binary/s'))
+    for name, text, binary in rows:
+        print('%-24s %6d %8d %10d %10d' % (name, len(text), len(binary), baud // 10 // len(text), baud // 10 // len(binary)))
+
+
+if __name__ == '__main__':
+    compare()